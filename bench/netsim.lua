@@ -0,0 +1,274 @@
+-- runs encoded speech through simulated network impairments and
+-- reports, for a grid of encoder settings, what each setting costs
+-- in bandwidth and what the receiver ends up playing.
+--
+-- every setting is encoded once, then sent through each network
+-- scenario and decoded twice: with plain PLC, and with in-band FEC
+-- (the next packet's redundancy recovers the lost one when it
+-- arrives in time). the network side is seeded, so every setting
+-- sees exactly the same losses.
+--
+-- the score is the log spectral distance score from quality.lua.
+-- the summary picks the cheapest setting that reaches target for
+-- each scenario.
+--
+-- usage: lua bench/netsim.lua [key=value ...]
+--
+--   seconds=6        length of the test signal
+--   fs=16000         sample rate (8000, 12000, 16000, 24000 or 48000)
+--   frame_ms=20      packet duration
+--   file=speech.raw  use raw mono 16-bit little-endian PCM at fs
+--                    instead of the synthetic signal
+--   bitrate=12000,16000,24000,32000
+--   inband_fec=0,1
+--   packet_loss_perc=0,10,25
+--   dtx=0,1
+--   target=80        score to reach in the summary
+--   seed=1
+
+local opus = require'luaopus'
+local here = string.match(arg and arg[0] or '', '^(.*[/\\])') or ''
+local quality = dofile(here .. 'quality.lua')
+
+local options = {
+  seconds = '6',
+  fs = '16000',
+  frame_ms = '20',
+  bitrate = '12000,16000,24000,32000',
+  inband_fec = '0,1',
+  packet_loss_perc = '0,10,25',
+  dtx = '0,1',
+  target = '80',
+  seed = '1',
+}
+
+for _, a in ipairs(arg or {}) do
+  local k, v = string.match(a, '^([%w_]+)=(.*)$')
+  if not k or (options[k] == nil and k ~= 'file') then
+    error('unknown option: ' .. a)
+  end
+  options[k] = v
+end
+
+local function numbers(s)
+  local t = {}
+  for n in string.gmatch(s, '[^,]+') do
+    t[#t + 1] = assert(tonumber(n), 'not a number: ' .. n)
+  end
+  return t
+end
+
+local seconds = tonumber(options.seconds)
+local fs = tonumber(options.fs)
+local frame_ms = tonumber(options.frame_ms)
+local frame_size = fs * frame_ms / 1000
+local target = tonumber(options.target)
+
+-- the network models, in the order they're reported.
+--   loss        independent loss probability per packet
+--   burst       Gilbert-Elliott: {p(good->bad), p(bad->good), loss in bad}
+--   jitter      mean extra delay in ms, exponentially distributed
+--   reorder     probability a packet is held back reorder_ms more
+--   playout     jitter buffer depth in ms, later packets count as lost
+local scenarios = {
+  { name = 'clean', playout = 60 },
+  { name = 'random 5%', loss = 0.05, playout = 60 },
+  { name = 'random 15%', loss = 0.15, playout = 60 },
+  { name = 'bursty', burst = { 0.03, 0.35, 0.8 }, playout = 60 },
+  { name = 'jitter+reorder', loss = 0.01, jitter = 15, reorder = 0.05,
+    reorder_ms = 50, playout = 60 },
+}
+
+local random = quality.random(tonumber(options.seed))
+
+local nframes = math.floor(seconds * 1000 / frame_ms)
+local reference
+if options.file then
+  reference = quality.load_raw(options.file, nframes * frame_size)
+  nframes = math.floor(#reference / frame_size)
+else
+  reference = quality.speech(fs, nframes * frame_size, random)
+end
+
+local meter = quality.new(reference, fs)
+
+-- network ---------------------------------------------------------
+
+-- for each packet, the delay it arrives with, or false if it
+-- never arrives
+local function network(sc)
+  local delay = {}
+  local bad = false
+  for i = 1, nframes do
+    local lost = false
+    if sc.loss and random() < sc.loss then
+      lost = true
+    end
+    if sc.burst then
+      if bad then
+        if random() < sc.burst[2] then bad = false end
+      else
+        if random() < sc.burst[1] then bad = true end
+      end
+      if bad and random() < sc.burst[3] then lost = true end
+    end
+    local d = 0
+    if sc.jitter then
+      d = d - sc.jitter * math.log(1 - random())
+    end
+    if sc.reorder and random() < sc.reorder then
+      d = d + sc.reorder_ms
+    end
+    delay[i] = not lost and d
+  end
+  return delay
+end
+
+-- codec -----------------------------------------------------------
+
+local encoder = opus.OpusEncoder()
+local decoder = opus.OpusDecoder()
+
+local function encode(config)
+  assert(encoder:init(fs, 1, opus.OPUS_APPLICATION_VOIP))
+  assert(encoder:configure(config))
+  local lookahead = encoder:get_lookahead()
+
+  local packets, bytes = {}, 0
+  local buf = {}
+  for f = 1, nframes do
+    local base = (f - 1) * frame_size
+    for i = 1, frame_size do
+      buf[i] = reference[base + i]
+    end
+    local p = assert(encoder:encode(buf))
+    packets[f] = p
+    bytes = bytes + #p
+  end
+  return packets, bytes * 8 / (nframes * frame_ms), lookahead
+end
+
+-- plays the stream out, returning the decoded audio
+-- and how many frames were concealed
+local function receive(packets, delay, playout, use_fec, lookahead)
+  assert(decoder:init(fs, 1))
+  assert(decoder:set_trim(lookahead * 48000 / fs))
+
+  local out, n = {}, 0
+  local concealed, recovered = 0, 0
+  for f = 1, nframes do
+    local pcm
+    if delay[f] and delay[f] <= playout then
+      pcm = decoder:decode(packets[f])
+    elseif use_fec and f < nframes and delay[f + 1]
+      and delay[f + 1] <= playout - frame_ms then
+      pcm = decoder:decode(packets[f + 1], true, frame_size)
+      recovered = recovered + 1
+    else
+      pcm = decoder:decode(nil, false, frame_size)
+      concealed = concealed + 1
+    end
+    assert(pcm)
+    for i = 1, #pcm do
+      out[n + i] = pcm[i]
+    end
+    n = n + #pcm
+  end
+  return out, concealed / nframes, recovered / nframes
+end
+
+-- run ---------------------------------------------------------------
+
+local configs = {}
+for _, bitrate in ipairs(numbers(options.bitrate)) do
+  for _, dtx in ipairs(numbers(options.dtx)) do
+    for _, fec in ipairs(numbers(options.inband_fec)) do
+      for _, loss in ipairs(numbers(options.packet_loss_perc)) do
+        -- the loss estimate only matters to the encoder with FEC on
+        if fec ~= 0 or loss == 0 then
+          configs[#configs + 1] = {
+            bitrate = bitrate,
+            dtx = dtx ~= 0,
+            inband_fec = fec ~= 0,
+            packet_loss_perc = loss,
+          }
+        end
+      end
+    end
+  end
+end
+
+local function label(c)
+  return string.format('%6d %-3s %-3s %3d%%', c.bitrate,
+    c.dtx and 'dtx' or '-', c.inband_fec and 'fec' or '-', c.packet_loss_perc)
+end
+
+local start = os.clock()
+
+for _, c in ipairs(configs) do
+  c.packets, c.kbps, c.lookahead = encode(c)
+end
+
+-- overhead is against the same bitrate and dtx without FEC
+for _, c in ipairs(configs) do
+  for _, b in ipairs(configs) do
+    if b.bitrate == c.bitrate and b.dtx == c.dtx and not b.inband_fec then
+      c.overhead = c.kbps / b.kbps - 1
+    end
+  end
+end
+
+print(string.format('%d frames of %dms at %dHz, %d settings, %d scenarios',
+  nframes, frame_ms, fs, #configs, #scenarios))
+
+local best = {}
+for s, sc in ipairs(scenarios) do
+  local delay = network(sc)
+  local lost = 0
+  for f = 1, nframes do
+    if not (delay[f] and delay[f] <= sc.playout) then lost = lost + 1 end
+  end
+
+  print()
+  print(string.format('== %s: %.1f%% of packets missed playout', sc.name, lost / nframes * 100))
+  print(string.format('%-20s %6s %6s  %7s %6s  %7s %6s %6s', 'bitrate dtx fec loss',
+    'kbps', 'ovhd', 'plc', 'score', 'fec', 'plc', 'score'))
+  print(string.format('%-20s %14s  %14s  %21s', '', '', '---- PLC ----', '------ with FEC -----'))
+
+  for _, c in ipairs(configs) do
+    local out, plc = receive(c.packets, delay, sc.playout, false, c.lookahead)
+    local plc_score = meter:score(out)
+    -- without FEC in the stream, decode_fec only conceals
+    local fplc, frec, fec_score = plc, 0, plc_score
+    if c.inband_fec then
+      local fout
+      fout, fplc, frec = receive(c.packets, delay, sc.playout, true, c.lookahead)
+      fec_score = meter:score(fout)
+    end
+
+    print(string.format('%-20s %6.1f %5.1f%%  %6.1f%% %6.1f  %6.1f%% %5.1f%% %6.1f',
+      label(c), c.kbps, (c.overhead or 0) * 100,
+      plc * 100, plc_score, frec * 100, fplc * 100, fec_score))
+
+    local q = math.max(plc_score, fec_score)
+    if q >= target and (not best[s] or c.kbps < best[s].kbps) then
+      best[s] = { config = c, kbps = c.kbps, score = q,
+        fec = fec_score > plc_score }
+    end
+  end
+end
+
+print()
+print(string.format('== cheapest setting reaching a score of %g', target))
+for s, sc in ipairs(scenarios) do
+  local b = best[s]
+  if b then
+    print(string.format('%-16s %s  %6.1f kbps  score %5.1f  %s', sc.name,
+      label(b.config), b.kbps, b.score, b.fec and 'receiver uses FEC' or 'PLC only'))
+  else
+    print(string.format('%-16s none', sc.name))
+  end
+end
+
+print()
+print(string.format('%.1fs', os.clock() - start))
@@ -0,0 +1,273 @@
+-- test signals and objective quality measures shared by the bench
+-- scripts, loaded with dofile() from the script's own directory.
+--
+-- the scores compare decoded audio against the original in 20ms
+-- windows, skipping windows where the original is near silent:
+--
+--   score   100 - 5 * log spectral distance in dB, 0 to 100. opus
+--           doesn't preserve the waveform, so this is the one to
+--           rank settings by. not a substitute for POLQA/PEAQ or
+--           a listening test.
+--   segsnr  segmental SNR in dB, each window clamped to -10..35.
+--           only meaningful at high bitrates, where the codec gets
+--           close to the waveform.
+
+local quality = {}
+
+-- Park-Miller, so runs match between Lua versions
+function quality.random(seed)
+  seed = seed or 1
+  return function()
+    seed = (seed * 16807) % 2147483647
+    return seed / 2147483647
+  end
+end
+
+-- voiced syllables with a wandering pitch and two formants, short
+-- gaps between them and a longer pause every couple of seconds
+function quality.speech(fs, n, random)
+  local pcm = {}
+  local pi2 = 2 * math.pi
+  local phase = 0
+  local i = 1
+  local talk = 0
+  while i <= n do
+    local len, voiced
+    if talk > 2.0 * fs then
+      len, voiced, talk = math.floor((0.3 + 0.5 * random()) * fs), false, 0
+    elseif random() < 0.75 then
+      len, voiced = math.floor((0.12 + 0.18 * random()) * fs), true
+    else
+      len, voiced = math.floor((0.04 + 0.1 * random()) * fs), false
+    end
+    local f0 = 100 + 90 * random()
+    local glide = (random() - 0.5) * 60
+    local f1 = 350 + 500 * random()
+    local f2 = 1000 + 1400 * random()
+    for j = 0, len - 1 do
+      if i > n then break end
+      local s = 0
+      if voiced then
+        local env = math.sin(math.pi * j / len)
+        local f = f0 + glide * j / len
+        phase = phase + pi2 * f / fs
+        local k = 1
+        while k * f < fs / 2 and k <= 30 do
+          local h = k * f
+          local w = math.exp(-((h - f1) / 200) ^ 2) + 0.5 * math.exp(-((h - f2) / 300) ^ 2) + 0.05
+          s = s + w / k * math.sin(k * phase)
+          k = k + 1
+        end
+        s = s * env * 9000
+      end
+      pcm[i] = math.floor(s + (random() - 0.5) * 60)
+      i = i + 1
+    end
+    talk = talk + len
+  end
+  return pcm
+end
+
+-- a chord change every half second, each note with decaying
+-- harmonics, and a noise burst on every beat for transients
+function quality.music(fs, n, random)
+  local pcm = {}
+  local pi2 = 2 * math.pi
+  local bar = math.floor(fs / 2)
+  local beat = math.floor(fs / 4)
+  local notes = {}
+  for i = 1, n do
+    local t = i - 1
+    if t % bar == 0 then
+      local root = 110 * 2 ^ (math.floor(random() * 12) / 12)
+      notes = { root, root * 2 ^ (4 / 12), root * 2 ^ (7 / 12), root * 4 }
+    end
+    local s = 0
+    local age = (t % bar) / fs
+    for _, f in ipairs(notes) do
+      local k = 1
+      while k * f < fs / 2 and k <= 8 do
+        s = s + math.sin(pi2 * f * k * t / fs) / (k * k) * math.exp(-age * k)
+        k = k + 1
+      end
+    end
+    s = s * 3000
+    local hit = t % beat
+    if hit < fs / 50 then
+      s = s + (random() - 0.5) * 12000 * (1 - hit / (fs / 50))
+    end
+    pcm[i] = math.floor(s)
+  end
+  return pcm
+end
+
+-- the generators by name
+quality.signals = {
+  speech = quality.speech,
+  music = quality.music,
+}
+
+-- raw mono 16-bit little-endian PCM, at most n samples
+function quality.load_raw(path, n)
+  local f = assert(io.open(path, 'rb'))
+  local data = f:read('*a')
+  f:close()
+  local pcm = {}
+  for i = 1, math.min(n, math.floor(#data / 2)) do
+    local lo, hi = string.byte(data, i * 2 - 1, i * 2)
+    local v = hi * 256 + lo
+    if v >= 32768 then v = v - 65536 end
+    pcm[i] = v
+  end
+  return pcm
+end
+
+local db = 10 / math.log(10)
+
+local meter = {}
+meter.__index = meter
+
+-- power spectrum of pcm[first .. first + size - 1], into out
+function meter:spectrum(pcm, first, out)
+  local re, im = self.re, self.im
+  local cos_t, sin_t = self.cos_t, self.sin_t
+  local size, window, reverse = self.size, self.window, self.reverse
+  local n = self.fft_size
+  for i = 0, n - 1 do
+    local r = reverse[i]
+    local s = r < size and (pcm[first + r] or 0) * window[r + 1] or 0
+    re[i], im[i] = s, 0
+  end
+  local half = 1
+  while half < n do
+    local step = n / (half * 2)
+    for start = 0, n - 1, half * 2 do
+      for k = 0, half - 1 do
+        local a, b = start + k, start + k + half
+        local c, s = cos_t[k * step], sin_t[k * step]
+        local tr = re[b] * c - im[b] * s
+        local ti = re[b] * s + im[b] * c
+        re[b], im[b] = re[a] - tr, im[a] - ti
+        re[a], im[a] = re[a] + tr, im[a] + ti
+      end
+    end
+    half = half * 2
+  end
+  for i = 0, self.bins - 1 do
+    out[i] = re[i] * re[i] + im[i] * im[i]
+  end
+  return out
+end
+
+-- how many windows of decoded can be scored
+function meter:windows(decoded)
+  return math.min(self.count, math.floor(#decoded / self.size))
+end
+
+function meter:score(decoded)
+  local total, count = 0, 0
+  local bins, floor = self.bins, self.floor
+  local p = self.scratch
+  for w = 1, self:windows(decoded) do
+    if self.active[w] then
+      self:spectrum(decoded, (w - 1) * self.size + 1, p)
+      local r = self.ref_db[w]
+      local sum = 0
+      for i = 0, bins - 1 do
+        local d = r[i] - db * math.log(p[i] + floor)
+        sum = sum + d * d
+      end
+      total = total + math.sqrt(sum / bins)
+      count = count + 1
+    end
+  end
+  if count == 0 then return 0, 0 end
+  local lsd = total / count
+  return math.max(0, 100 - 5 * lsd), lsd
+end
+
+function meter:segsnr(decoded)
+  local ref, size = self.reference, self.size
+  local total, count = 0, 0
+  for w = 1, self:windows(decoded) do
+    if self.active[w] then
+      local sig, err = 0, 0
+      for i = (w - 1) * size + 1, w * size do
+        local e = ref[i] - decoded[i]
+        sig = sig + ref[i] * ref[i]
+        err = err + e * e
+      end
+      local snr = err > 0 and db * math.log(sig / err) or 35
+      total = total + math.max(-10, math.min(35, snr))
+      count = count + 1
+    end
+  end
+  if count == 0 then return 0 end
+  return total / count
+end
+
+-- precomputes the reference's spectra, decoded audio passed
+-- to score() and segsnr() has to be sample-aligned with it
+function quality.new(reference, fs)
+  local self = setmetatable({}, meter)
+  local size = math.floor(fs / 50)
+  local n = 1
+  while n < size do n = n * 2 end
+
+  self.reference = reference
+  self.size = size
+  self.fft_size = n
+  self.bins = n / 2 + 1
+  self.count = math.floor(#reference / size)
+  self.re, self.im, self.scratch = {}, {}, {}
+
+  self.window = {}
+  for i = 1, size do
+    self.window[i] = 0.5 - 0.5 * math.cos(2 * math.pi * (i - 0.5) / size)
+  end
+
+  self.cos_t, self.sin_t, self.reverse = {}, {}, {}
+  for i = 0, n / 2 - 1 do
+    self.cos_t[i] = math.cos(-2 * math.pi * i / n)
+    self.sin_t[i] = math.sin(-2 * math.pi * i / n)
+  end
+  local bits = math.floor(math.log(n) / math.log(2) + 0.5)
+  for i = 0, n - 1 do
+    local r, x = 0, i
+    for _ = 1, bits do
+      r = r * 2 + x % 2
+      x = math.floor(x / 2)
+    end
+    self.reverse[i] = r
+  end
+
+  -- spectra in dB, floored 70dB under the loudest bin, and
+  -- windows within 40dB of the loudest get scored
+  local peak, loud = 0, 0
+  local power, energy = {}, {}
+  for w = 1, self.count do
+    local p = self:spectrum(reference, (w - 1) * size + 1, {})
+    local e = 0
+    for i = 0, self.bins - 1 do
+      if p[i] > peak then peak = p[i] end
+      e = e + p[i]
+    end
+    power[w], energy[w] = p, e
+    if e > loud then loud = e end
+  end
+
+  self.floor = peak * 1e-7
+  self.ref_db, self.active = {}, {}
+  for w = 1, self.count do
+    local d = {}
+    for i = 0, self.bins - 1 do
+      d[i] = db * math.log(power[w][i] + self.floor)
+    end
+    self.ref_db[w] = d
+    self.active[w] = energy[w] > loud * 1e-4
+  end
+
+  return self
+end
+
+return quality
@@ -0,0 +1,67 @@
+-- measures how long require'luaopus' takes in a fresh state.
+-- the shared library stays loaded after the first require, so this
+-- times everything after dlopen: finding and registering the module
+-- and its submodules, and building the metatables.
+--
+-- usage: lua bench/startup.lua [iterations]
+
+local iterations = tonumber(arg and arg[1]) or 2000
+
+local clock = os.clock
+
+local function unload()
+  for name in pairs(package.loaded) do
+    if name == 'luaopus' or string.sub(name, 1, 8) == 'luaopus.' then
+      package.loaded[name] = nil
+    end
+  end
+  -- metatables live in the registry, drop them so each
+  -- pass has to build them from scratch
+  local registry = debug.getregistry()
+  for _, name in ipairs({
+    'OpusEncoder', 'OpusDecoder', 'OpusMeter', 'OpusScheduler',
+    'OpusEncoderConfig', 'OpusPcmReader',
+    'OpusProjectionEncoder', 'OpusProjectionDecoder',
+    'OpusDREDDecoder', 'OpusDRED',
+    'OpusCustomMode', 'OpusCustomEncoder', 'OpusCustomDecoder',
+    'OpusCachedPackets',
+  }) do
+    registry[name] = nil
+  end
+end
+
+local function bench(label, fn)
+  unload()
+  fn()
+  collectgarbage()
+  collectgarbage()
+  local kb = collectgarbage('count')
+  local start = clock()
+  for _ = 1, iterations do
+    unload()
+    fn()
+  end
+  local elapsed = clock() - start
+  unload()
+  collectgarbage()
+  collectgarbage()
+  fn()
+  local used = collectgarbage('count') - kb
+  print(string.format('%-28s %8.1f us/load %8.1f KiB',
+    label, elapsed / iterations * 1e6, used))
+end
+
+bench('require luaopus', function()
+  return require'luaopus'
+end)
+
+bench('require luaopus.encoder', function()
+  return require'luaopus.encoder'
+end)
+
+-- objects can't be created here, unload() pulls their
+-- metatables out from under them
+bench('require luaopus + 2 ctls', function()
+  local opus = require'luaopus'
+  return opus.opus_encoder_ctl_set_bitrate, opus.opus_decoder_ctl_set_gain
+end)
@@ -0,0 +1,293 @@
+-- encodes and decodes reference signals across a grid of encoder
+-- settings, reporting CPU time, bitrate and quality for each, then
+-- where raising the complexity stops paying for itself.
+--
+-- every option takes a comma-separated list, and every combination
+-- is run. times are CPU time per frame, the best of several passes,
+-- and include converting samples to and from Lua tables.
+-- streams/core is how many real-time encode+decode pairs one core
+-- could keep up with at that setting.
+--
+-- quality is measured with quality.lua: score ranks settings,
+-- segsnr only means something at high bitrates. the knee is the
+-- lowest complexity scoring within tolerance of the best one.
+--
+-- usage: lua bench/sweep.lua [key=value ...]
+--
+--   signals=speech,music     generated test signals
+--   file=a.raw,b.raw         raw mono 16-bit little-endian PCM at fs,
+--                            instead of the generated signals
+--   seconds=5
+--   fs=48000
+--   complexity=0,2,4,6,8,10
+--   bitrate=16000,32000,64000
+--   signal=auto              auto, voice or music
+--   application=audio        voip, audio or lowdelay
+--   expert_frame_duration=20 2.5, 5, 10, 20, 40 or 60 (ms)
+--   lsb_depth=16
+--   passes=3
+--   tolerance=0.5            score difference for the knee
+--
+-- cmake's "bench" target runs this against the module just built,
+-- with LUAOPUS_BENCH_ARGS as the arguments.
+
+local opus = require'luaopus'
+local here = string.match(arg and arg[0] or '', '^(.*[/\\])') or ''
+local quality = dofile(here .. 'quality.lua')
+
+local options = {
+  signals = 'speech,music',
+  seconds = '5',
+  fs = '48000',
+  complexity = '0,2,4,6,8,10',
+  bitrate = '16000,32000,64000',
+  signal = 'auto',
+  application = 'audio',
+  expert_frame_duration = '20',
+  lsb_depth = '16',
+  passes = '3',
+  tolerance = '0.5',
+}
+
+for _, a in ipairs(arg or {}) do
+  local k, v = string.match(a, '^([%w_]+)=(.*)$')
+  if not k or (options[k] == nil and k ~= 'file') then
+    error('unknown option: ' .. a)
+  end
+  options[k] = v
+end
+
+local function list(s)
+  local t = {}
+  for v in string.gmatch(s, '[^,]+') do
+    t[#t + 1] = v
+  end
+  return t
+end
+
+local function numbers(s)
+  local t = list(s)
+  for i, v in ipairs(t) do
+    t[i] = assert(tonumber(v), 'not a number: ' .. v)
+  end
+  return t
+end
+
+local function names(s, values)
+  local t = list(s)
+  for i, v in ipairs(t) do
+    assert(values[v], 'unknown value: ' .. v)
+    t[i] = { name = v, value = values[v] }
+  end
+  return t
+end
+
+local signals = names(options.signal, {
+  auto = opus.OPUS_AUTO,
+  voice = opus.OPUS_SIGNAL_VOICE,
+  music = opus.OPUS_SIGNAL_MUSIC,
+})
+
+local applications = names(options.application, {
+  voip = opus.OPUS_APPLICATION_VOIP,
+  audio = opus.OPUS_APPLICATION_AUDIO,
+  lowdelay = opus.OPUS_APPLICATION_RESTRICTED_LOWDELAY,
+})
+
+local durations = names(options.expert_frame_duration, {
+  ['2.5'] = opus.OPUS_FRAMESIZE_2_5_MS,
+  ['5'] = opus.OPUS_FRAMESIZE_5_MS,
+  ['10'] = opus.OPUS_FRAMESIZE_10_MS,
+  ['20'] = opus.OPUS_FRAMESIZE_20_MS,
+  ['40'] = opus.OPUS_FRAMESIZE_40_MS,
+  ['60'] = opus.OPUS_FRAMESIZE_60_MS,
+})
+
+local fs = tonumber(options.fs)
+local seconds = tonumber(options.seconds)
+local passes = tonumber(options.passes)
+local tolerance = tonumber(options.tolerance)
+local clock = os.clock
+
+-- reference signals -----------------------------------------------
+
+local references = {}
+if options.file then
+  for _, path in ipairs(list(options.file)) do
+    local pcm = quality.load_raw(path, seconds * fs)
+    references[#references + 1] = { name = string.match(path, '([^/\\]+)$'), pcm = pcm }
+  end
+else
+  local random = quality.random(1)
+  for _, name in ipairs(list(options.signals)) do
+    local generate = assert(quality.signals[name], 'unknown signal: ' .. name)
+    references[#references + 1] = { name = name, pcm = generate(fs, seconds * fs, random) }
+  end
+end
+
+for _, r in ipairs(references) do
+  r.meter = quality.new(r.pcm, fs)
+  r.frames = {}
+end
+
+-- the reference cut into frame_size tables, so building
+-- them isn't part of the encode timing
+local function frames(r, frame_size)
+  if not r.frames[frame_size] then
+    local t = {}
+    for f = 1, math.floor(#r.pcm / frame_size) do
+      local buf = {}
+      local base = (f - 1) * frame_size
+      for i = 1, frame_size do
+        buf[i] = r.pcm[base + i]
+      end
+      t[f] = buf
+    end
+    r.frames[frame_size] = t
+  end
+  return r.frames[frame_size]
+end
+
+-- run -------------------------------------------------------------
+
+local encoder = opus.OpusEncoder()
+local decoder = opus.OpusDecoder()
+
+local function run(r, c)
+  local frame_size = math.floor(fs * tonumber(c.duration.name) / 1000 + 0.5)
+  local input = frames(r, frame_size)
+  local config = {
+    complexity = c.complexity,
+    bitrate = c.bitrate,
+    signal = c.signal.value,
+    expert_frame_duration = c.duration.value,
+    lsb_depth = c.lsb_depth,
+  }
+
+  local packets, bytes, lookahead
+  local enc = math.huge
+  for _ = 1, passes do
+    assert(encoder:init(fs, 1, c.application.value))
+    assert(encoder:configure(config))
+    lookahead = encoder:get_lookahead()
+    packets, bytes = {}, 0
+    local start = clock()
+    for f = 1, #input do
+      packets[f] = encoder:encode(input[f])
+    end
+    enc = math.min(enc, clock() - start)
+    for f = 1, #packets do
+      bytes = bytes + #assert(packets[f])
+    end
+  end
+
+  local decoded
+  local dec = math.huge
+  for _ = 1, passes do
+    assert(decoder:init(fs, 1))
+    assert(decoder:set_trim(lookahead * 48000 / fs))
+    decoded = {}
+    local start = clock()
+    for f = 1, #packets do
+      decoded[f] = decoder:decode(packets[f])
+    end
+    dec = math.min(dec, clock() - start)
+  end
+
+  local out, n = {}, 0
+  for f = 1, #decoded do
+    local pcm = assert(decoded[f])
+    for i = 1, #pcm do
+      out[n + i] = pcm[i]
+    end
+    n = n + #pcm
+  end
+
+  local frame_us = frame_size / fs * 1e6
+  local enc_us = enc / #input * 1e6
+  local dec_us = dec / #input * 1e6
+  return {
+    enc_us = enc_us,
+    dec_us = dec_us,
+    bytes = bytes / (#input * frame_size / fs),
+    score = r.meter:score(out),
+    segsnr = r.meter:segsnr(out),
+    streams = frame_us / (enc_us + dec_us),
+  }
+end
+
+local rows = {}
+for _, r in ipairs(references) do
+  for _, application in ipairs(applications) do
+    for _, signal in ipairs(signals) do
+      for _, duration in ipairs(durations) do
+        for _, lsb_depth in ipairs(numbers(options.lsb_depth)) do
+          for _, bitrate in ipairs(numbers(options.bitrate)) do
+            for _, complexity in ipairs(numbers(options.complexity)) do
+              rows[#rows + 1] = {
+                reference = r,
+                application = application,
+                signal = signal,
+                duration = duration,
+                lsb_depth = lsb_depth,
+                bitrate = bitrate,
+                complexity = complexity,
+              }
+            end
+          end
+        end
+      end
+    end
+  end
+end
+
+print(string.format('%d settings x %d signals, %gs at %dHz, best of %d',
+  #rows / #references, #references, seconds, fs, passes))
+print()
+print(string.format('%-8s %-8s %-5s %4s %3s %6s %4s  %8s %8s %8s %6s %6s %8s',
+  'input', 'app', 'sig', 'ms', 'lsb', 'bitrate', 'cplx',
+  'enc us', 'dec us', 'bytes/s', 'score', 'segsnr', 'streams'))
+
+local start = clock()
+local groups, order = {}, {}
+for _, c in ipairs(rows) do
+  local res = run(c.reference, c)
+  c.result = res
+
+  local head = string.format('%-8s %-8s %-5s %4s %3d %6d',
+    c.reference.name, c.application.name, c.signal.name,
+    c.duration.name, c.lsb_depth, c.bitrate)
+  print(string.format('%s %4d  %8.1f %8.1f %8.0f %6.1f %6.1f %8.1f',
+    head, c.complexity, res.enc_us, res.dec_us, res.bytes,
+    res.score, res.segsnr, res.streams))
+
+  -- everything but the complexity
+  if not groups[head] then
+    groups[head] = {}
+    order[#order + 1] = head
+  end
+  table.insert(groups[head], c)
+end
+
+print()
+print(string.format('== knee: lowest complexity within %g of the best score', tolerance))
+for _, head in ipairs(order) do
+  local g = groups[head]
+  local best, top = nil, g[1]
+  for _, c in ipairs(g) do
+    if not best or c.result.score > best.result.score then best = c end
+    if c.complexity > top.complexity then top = c end
+  end
+  local knee = best
+  for _, c in ipairs(g) do
+    if c.result.score >= best.result.score - tolerance and c.complexity < knee.complexity then
+      knee = c
+    end
+  end
+  print(string.format('%s  complexity %2d  score %5.1f  %7.1f streams/core (%.1f at %d)',
+    head, knee.complexity, knee.result.score, knee.result.streams,
+    top.result.streams, top.complexity))
+end
+
+print()
+print(string.format('%.1fs', clock() - start))
@@ -1,4 +1,4 @@
-#include "luaopus.h"
+#include "luaopus_internal.h"
 #include <assert.h>
 
 static void
@@ -21,12 +21,36 @@ copydown(lua_State *L, const char *tablename) {
 
 LUAOPUS_PUBLIC
 int luaopen_luaopus(lua_State *L) {
+    static const luaopus_lazy * const lazy[] = {
+        &luaopus_encoder_ctl,
+        &luaopus_decoder_ctl,
+        &luaopus_projection_encoder_ctl,
+        &luaopus_projection_decoder_ctl,
+        &luaopus_custom_encoder_ctl,
+        &luaopus_custom_decoder_ctl,
+    };
+
     lua_newtable(L);
 
     copydown(L,"luaopus.version");
-    copydown(L,"luaopus.defines");
-    copydown(L,"luaopus.encoder");
-    copydown(L,"luaopus.decoder");
+
+    /* registered straight into this table, rather than
+     * requiring each submodule and copying it over */
+    luaopus_defines_register(L);
+    luaopus_encoder_register(L);
+    luaopus_decoder_register(L);
+    luaopus_meter_register(L);
+    luaopus_scheduler_register(L);
+    luaopus_pool_register(L);
+    luaopus_memory_register(L);
+    luaopus_config_register(L);
+    luaopus_reader_register(L);
+    luaopus_projection_register(L);
+    luaopus_dred_register(L);
+    luaopus_custom_register(L);
+    luaopus_cache_register(L);
+
+    luaopus_lazy_attach(L,lazy,6);
 
     return 1;
 }
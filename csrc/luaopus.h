@@ -1,5 +1,6 @@
 #include <lua.h>
 #include <lauxlib.h>
+#include <opus/opus_types.h>
 
 #if defined(_WIN32) || defined(_WIN64) || defined(WIN32) || defined(_MSC_VER)
 #define LUAOPUS_PUBLIC __declspec(dllexport)
@@ -25,6 +26,75 @@ int luaopen_luaopus_decoder(lua_State *L);
 LUAOPUS_PUBLIC
 int luaopen_luaopus_defines(lua_State *L);
 
+LUAOPUS_PUBLIC
+int luaopen_luaopus_meter(lua_State *L);
+
+LUAOPUS_PUBLIC
+int luaopen_luaopus_scheduler(lua_State *L);
+
+LUAOPUS_PUBLIC
+int luaopen_luaopus_pool(lua_State *L);
+
+LUAOPUS_PUBLIC
+int luaopen_luaopus_memory(lua_State *L);
+
+LUAOPUS_PUBLIC
+int luaopen_luaopus_config(lua_State *L);
+
+LUAOPUS_PUBLIC
+int luaopen_luaopus_reader(lua_State *L);
+
+LUAOPUS_PUBLIC
+int luaopen_luaopus_projection(lua_State *L);
+
+LUAOPUS_PUBLIC
+int luaopen_luaopus_dred(lua_State *L);
+
+LUAOPUS_PUBLIC
+int luaopen_luaopus_custom(lua_State *L);
+
+LUAOPUS_PUBLIC
+int luaopen_luaopus_cache(lua_State *L);
+
+/* replaces the allocator used for codec state and buffers,
+ * f follows the lua_Alloc contract. passing NULL goes back to
+ * using each lua_State's own allocator. set this before creating
+ * any encoders or decoders, blocks are always freed with the
+ * allocator they came from */
+LUAOPUS_PUBLIC
+void luaopus_set_allocator(lua_Alloc f, void *ud);
+
+/* plain C entry points for the LuaJIT FFI (see luaopus.ffi).
+ * encoder and decoder are the address of an initialized
+ * OpusEncoder or OpusDecoder userdata. these behave like
+ * opus_encode and opus_decode, including any channel map,
+ * meter or other stage attached to the object.
+ * bump LUAOPUS_FFI_ABI when any of these change */
+#define LUAOPUS_FFI_ABI 1
+
+LUAOPUS_PUBLIC
+int luaopus_ffi_abi(void);
+
+LUAOPUS_PUBLIC
+opus_int32 luaopus_ffi_encode(void *encoder, const opus_int16 *pcm, int frame_size, unsigned char *data, opus_int32 max_data_bytes);
+
+LUAOPUS_PUBLIC
+opus_int32 luaopus_ffi_encode_float(void *encoder, const float *pcm, int frame_size, unsigned char *data, opus_int32 max_data_bytes);
+
+LUAOPUS_PUBLIC
+int luaopus_ffi_decode(void *decoder, const unsigned char *data, opus_int32 len, opus_int16 *pcm, int frame_size, int decode_fec);
+
+LUAOPUS_PUBLIC
+int luaopus_ffi_decode_float(void *decoder, const unsigned char *data, opus_int32 len, float *pcm, int frame_size, int decode_fec);
+
+/* channels the caller passes to / gets back from the object,
+ * after any channel map */
+LUAOPUS_PUBLIC
+int luaopus_ffi_encoder_channels(void *encoder);
+
+LUAOPUS_PUBLIC
+int luaopus_ffi_decoder_channels(void *decoder);
+
 #ifdef __cplusplus
 }
 #endif
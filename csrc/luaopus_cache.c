@@ -0,0 +1,669 @@
+#include "luaopus_internal.h"
+#include <opus/opus.h>
+#include <string.h>
+
+/* the cache is shared by every lua_State in the process, which
+ * may be running on different threads. nothing that can raise a
+ * Lua error is called with the lock held */
+#ifdef _WIN32
+#include <windows.h>
+static SRWLOCK luaopus_cache_mutex = SRWLOCK_INIT;
+#define luaopus_cache_lock() AcquireSRWLockExclusive(&luaopus_cache_mutex)
+#define luaopus_cache_unlock() ReleaseSRWLockExclusive(&luaopus_cache_mutex)
+#else
+#include <pthread.h>
+static pthread_mutex_t luaopus_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define luaopus_cache_lock() pthread_mutex_lock(&luaopus_cache_mutex)
+#define luaopus_cache_unlock() pthread_mutex_unlock(&luaopus_cache_mutex)
+#endif
+
+const char * const luaopus_cache_view_mt = "OpusCachedPackets";
+
+#define CACHE_DEFAULT_MAX (64 * 1024 * 1024)
+#define CACHE_MIN_BUCKETS 256
+
+typedef struct luaopus_cache_entry_s luaopus_cache_entry;
+
+/* one asset encoded at one set of settings. the block holds this
+ * struct, the packet offsets, the asset id and the packets. none
+ * of it changes once the entry is made, so views read the
+ * packets without taking the lock */
+struct luaopus_cache_entry_s {
+    luaopus_mem mem;
+
+    /* LRU order, the most recently used is at the head */
+    luaopus_cache_entry *prev;
+    luaopus_cache_entry *next;
+
+    /* next entry in the same bucket */
+    luaopus_cache_entry *chain;
+
+    /* views handed out, and whether the cache still has it.
+     * an entry goes when both are gone */
+    size_t refs;
+    int cached;
+
+    unsigned long hash;
+    opus_int32 Fs;
+    int channels;
+    opus_int32 bitrate;
+    int frame_size;
+
+    const char *asset;
+    size_t asset_len;
+
+    /* packet i is data[offsets[i]] up to data[offsets[i + 1]] */
+    size_t count;
+    size_t *offsets;
+    unsigned char *data;
+};
+
+typedef struct luaopus_cache_key_s {
+    const char *asset;
+    size_t asset_len;
+    opus_int32 Fs;
+    int channels;
+    opus_int32 bitrate;
+    int frame_size;
+    unsigned long hash;
+} luaopus_cache_key;
+
+typedef struct luaopus_cache_s {
+    luaopus_mem buckets_mem;
+    luaopus_cache_entry **buckets;
+    size_t nbuckets;
+
+    luaopus_cache_entry *head;
+    luaopus_cache_entry *tail;
+    size_t entries;
+    size_t bytes;
+
+    /* evicted or replaced, but still held by a view */
+    size_t pinned;
+
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long inserts;
+    unsigned long evictions;
+} luaopus_cache;
+
+static luaopus_cache luaopus_cache_g;
+
+/* bytes of entries the cache holds before evicting */
+static size_t luaopus_cache_max = CACHE_DEFAULT_MAX;
+
+/* a view keeps its entry's packets alive */
+typedef struct luaopus_cache_view_s {
+    luaopus_cache_entry *entry;
+} luaopus_cache_view;
+
+/* reads (asset, Fs, channels, bitrate, frame_size) from idx */
+static void
+luaopus_cache_checkkey(lua_State *L, int idx, luaopus_cache_key *k) {
+    unsigned long h = 2166136261UL;
+    size_t i = 0;
+
+    k->asset = luaL_checklstring(L,idx,&k->asset_len);
+    k->Fs = (opus_int32)luaL_checkinteger(L,idx + 1);
+    k->channels = (int)luaL_checkinteger(L,idx + 2);
+    k->bitrate = (opus_int32)luaL_checkinteger(L,idx + 3);
+    k->frame_size = (int)luaL_checkinteger(L,idx + 4);
+
+    /* FNV-1a over the asset id, then the settings */
+    for(i=0;i<k->asset_len;i++) {
+        h = ((h ^ (unsigned char)k->asset[i]) * 16777619UL) & 0xFFFFFFFFUL;
+    }
+    h = ((h ^ (unsigned long)k->Fs) * 16777619UL) & 0xFFFFFFFFUL;
+    h = ((h ^ (unsigned long)k->channels) * 16777619UL) & 0xFFFFFFFFUL;
+    h = ((h ^ (unsigned long)k->bitrate) * 16777619UL) & 0xFFFFFFFFUL;
+    h = ((h ^ (unsigned long)k->frame_size) * 16777619UL) & 0xFFFFFFFFUL;
+    k->hash = h;
+}
+
+static int
+luaopus_cache_match(const luaopus_cache_entry *e, const luaopus_cache_key *k) {
+    return e->hash == k->hash
+      && e->Fs == k->Fs
+      && e->channels == k->channels
+      && e->bitrate == k->bitrate
+      && e->frame_size == k->frame_size
+      && e->asset_len == k->asset_len
+      && memcmp(e->asset,k->asset,k->asset_len) == 0;
+}
+
+/* everything below is called with the lock held */
+
+static luaopus_cache_entry *
+luaopus_cache_find(luaopus_cache *c, const luaopus_cache_key *k) {
+    luaopus_cache_entry *e = NULL;
+
+    if(c->nbuckets == 0) {
+        return NULL;
+    }
+    for(e = c->buckets[k->hash % c->nbuckets]; e != NULL; e = e->chain) {
+        if(luaopus_cache_match(e,k)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void
+luaopus_cache_lru_unlink(luaopus_cache *c, luaopus_cache_entry *e) {
+    if(e->prev != NULL) e->prev->next = e->next;
+    else c->head = e->next;
+    if(e->next != NULL) e->next->prev = e->prev;
+    else c->tail = e->prev;
+    e->prev = NULL;
+    e->next = NULL;
+}
+
+static void
+luaopus_cache_lru_push(luaopus_cache *c, luaopus_cache_entry *e) {
+    e->prev = NULL;
+    e->next = c->head;
+    if(c->head != NULL) c->head->prev = e;
+    else c->tail = e;
+    c->head = e;
+}
+
+/* doubles the buckets once there are as many entries as buckets.
+ * a failed allocation just leaves the chains long */
+static void
+luaopus_cache_grow(luaopus_cache *c) {
+    luaopus_mem mem;
+    luaopus_cache_entry **buckets = NULL;
+    luaopus_cache_entry *e = NULL;
+    luaopus_cache_entry *next = NULL;
+    size_t nbuckets = 0;
+    size_t i = 0;
+
+    if(c->entries < c->nbuckets) {
+        return;
+    }
+
+    nbuckets = c->nbuckets ? c->nbuckets * 2 : CACHE_MIN_BUCKETS;
+    buckets = luaopus_mem_alloc_shared(&mem,LUAOPUS_MEM_CACHE,
+      sizeof(luaopus_cache_entry *) * nbuckets);
+    if(buckets == NULL) {
+        return;
+    }
+    memset(buckets,0,sizeof(luaopus_cache_entry *) * nbuckets);
+
+    for(i=0;i<c->nbuckets;i++) {
+        for(e = c->buckets[i]; e != NULL; e = next) {
+            next = e->chain;
+            e->chain = buckets[e->hash % nbuckets];
+            buckets[e->hash % nbuckets] = e;
+        }
+    }
+
+    if(c->nbuckets) {
+        luaopus_mem_free(&c->buckets_mem);
+    }
+    c->buckets_mem = mem;
+    c->buckets = buckets;
+    c->nbuckets = nbuckets;
+}
+
+static void
+luaopus_cache_insert(luaopus_cache *c, luaopus_cache_entry *e) {
+    luaopus_cache_entry **b = NULL;
+
+    luaopus_cache_grow(c);
+    if(c->nbuckets == 0) {
+        /* couldn't even get the first bucket array,
+         * so it only lives as long as its views */
+        e->cached = 0;
+        c->pinned += e->mem.size;
+        return;
+    }
+
+    b = &c->buckets[e->hash % c->nbuckets];
+    e->chain = *b;
+    *b = e;
+    e->cached = 1;
+    luaopus_cache_lru_push(c,e);
+    c->entries++;
+    c->bytes += e->mem.size;
+}
+
+/* takes the entry out of the cache, freeing it
+ * unless a view still has it */
+static void
+luaopus_cache_remove(luaopus_cache *c, luaopus_cache_entry *e) {
+    luaopus_cache_entry **p = NULL;
+
+    p = &c->buckets[e->hash % c->nbuckets];
+    while(*p != e) {
+        p = &(*p)->chain;
+    }
+    *p = e->chain;
+    e->chain = NULL;
+
+    luaopus_cache_lru_unlink(c,e);
+    e->cached = 0;
+    c->entries--;
+    c->bytes -= e->mem.size;
+
+    if(e->refs == 0) {
+        luaopus_mem_free(&e->mem);
+    } else {
+        c->pinned += e->mem.size;
+    }
+}
+
+static void
+luaopus_cache_evict(luaopus_cache *c) {
+    while(c->bytes > luaopus_cache_max && c->tail != NULL) {
+        luaopus_cache_remove(c,c->tail);
+        c->evictions++;
+    }
+}
+
+static void
+luaopus_cache_release(luaopus_cache *c, luaopus_cache_entry *e) {
+    e->refs--;
+    if(e->refs == 0 && !e->cached) {
+        c->pinned -= e->mem.size;
+        luaopus_mem_free(&e->mem);
+    }
+}
+
+/* end of the locked functions */
+
+static luaopus_cache_view *
+luaopus_cache_view_new(lua_State *L) {
+    luaopus_cache_view *v = NULL;
+
+    v = lua_newuserdata(L,sizeof(luaopus_cache_view));
+    if(v == NULL) {
+        luaL_error(L,"out of memory");
+        return NULL;
+    }
+    v->entry = NULL;
+    luaL_setmetatable(L,luaopus_cache_view_mt);
+    return v;
+}
+
+static int
+luaopus_cache_view_delete(lua_State *L) {
+    luaopus_cache_view *v = NULL;
+
+    v = luaL_checkudata(L,1,luaopus_cache_view_mt);
+    if(v->entry != NULL) {
+        luaopus_cache_lock();
+        luaopus_cache_release(&luaopus_cache_g,v->entry);
+        luaopus_cache_unlock();
+        v->entry = NULL;
+    }
+    return 0;
+}
+
+/* returns a view of the cached packets, or nil */
+static int
+luaopus_cache_get(lua_State *L) {
+    luaopus_cache *c = &luaopus_cache_g;
+    luaopus_cache_view *v = NULL;
+    luaopus_cache_entry *e = NULL;
+    luaopus_cache_key k;
+
+    luaopus_cache_checkkey(L,1,&k);
+    v = luaopus_cache_view_new(L);
+
+    luaopus_cache_lock();
+    e = luaopus_cache_find(c,&k);
+    if(e != NULL) {
+        luaopus_cache_lru_unlink(c,e);
+        luaopus_cache_lru_push(c,e);
+        e->refs++;
+        c->hits++;
+    } else {
+        c->misses++;
+    }
+    luaopus_cache_unlock();
+
+    if(e == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    v->entry = e;
+    return 1;
+}
+
+/* copies an array of packets into the cache, replacing whatever
+ * was there under the same key. returns a view of them */
+static int
+luaopus_cache_put(lua_State *L) {
+    luaopus_cache *c = &luaopus_cache_g;
+    luaopus_cache_view *v = NULL;
+    luaopus_cache_entry *e = NULL;
+    luaopus_cache_entry *old = NULL;
+    luaopus_cache_key k;
+    luaopus_mem mem;
+    unsigned char *block = NULL;
+    const char *packet = NULL;
+    size_t count = 0;
+    size_t data_len = 0;
+    size_t head = 0;
+    size_t size = 0;
+    size_t len = 0;
+    size_t max = 0;
+    size_t i = 0;
+
+    luaopus_cache_checkkey(L,1,&k);
+    luaL_checktype(L,6,LUA_TTABLE);
+    count = lua_rawlen(L,6);
+
+    for(i=1;i<=count;i++) {
+        lua_rawgeti(L,6,(int)i);
+        if(lua_type(L,-1) != LUA_TSTRING) {
+            return luaL_argerror(L,6,"expected an array of packets");
+        }
+        data_len += lua_rawlen(L,-1);
+        lua_pop(L,1);
+    }
+
+    head = LUAOPUS_MEM_ALIGN(sizeof(luaopus_cache_entry))
+      + LUAOPUS_MEM_ALIGN(sizeof(size_t) * (count + 1))
+      + LUAOPUS_MEM_ALIGN(k.asset_len);
+    size = head + data_len;
+
+    luaopus_cache_lock();
+    max = luaopus_cache_max;
+    luaopus_cache_unlock();
+
+    /* it would only push everything else out, and then itself */
+    if(size > max) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_BUFFER_TOO_SMALL);
+        return 2;
+    }
+
+    v = luaopus_cache_view_new(L);
+
+    block = luaopus_mem_alloc_shared(&mem,LUAOPUS_MEM_CACHE,size);
+    if(block == NULL) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_ALLOC_FAIL);
+        return 2;
+    }
+
+    e = (luaopus_cache_entry *)block;
+    memset(e,0,sizeof(luaopus_cache_entry));
+    e->mem = mem;
+    e->hash = k.hash;
+    e->Fs = k.Fs;
+    e->channels = k.channels;
+    e->bitrate = k.bitrate;
+    e->frame_size = k.frame_size;
+    e->count = count;
+    e->offsets = (size_t *)(block + LUAOPUS_MEM_ALIGN(sizeof(luaopus_cache_entry)));
+    e->asset = (const char *)e->offsets + LUAOPUS_MEM_ALIGN(sizeof(size_t) * (count + 1));
+    e->asset_len = k.asset_len;
+    e->data = block + head;
+    memcpy((char *)e->asset,k.asset,k.asset_len);
+
+    e->offsets[0] = 0;
+    for(i=1;i<=count;i++) {
+        lua_rawgeti(L,6,(int)i);
+        packet = lua_tolstring(L,-1,&len);
+        memcpy(e->data + e->offsets[i - 1],packet,len);
+        e->offsets[i] = e->offsets[i - 1] + len;
+        lua_pop(L,1);
+    }
+
+    /* the view's reference keeps it alive even if
+     * it's evicted before we return */
+    e->refs = 1;
+
+    luaopus_cache_lock();
+    old = luaopus_cache_find(c,&k);
+    if(old != NULL) {
+        luaopus_cache_remove(c,old);
+    }
+    luaopus_cache_insert(c,e);
+    if(e->cached) {
+        c->inserts++;
+        luaopus_cache_evict(c);
+    }
+    luaopus_cache_unlock();
+
+    v->entry = e;
+    return 1;
+}
+
+static int
+luaopus_cache_remove_key(lua_State *L) {
+    luaopus_cache *c = &luaopus_cache_g;
+    luaopus_cache_entry *e = NULL;
+    luaopus_cache_key k;
+
+    luaopus_cache_checkkey(L,1,&k);
+
+    luaopus_cache_lock();
+    e = luaopus_cache_find(c,&k);
+    if(e != NULL) {
+        luaopus_cache_remove(c,e);
+    }
+    luaopus_cache_unlock();
+
+    lua_pushboolean(L,e != NULL);
+    return 1;
+}
+
+static int
+luaopus_cache_clear(lua_State *L) {
+    luaopus_cache *c = &luaopus_cache_g;
+
+    luaopus_cache_lock();
+    while(c->head != NULL) {
+        luaopus_cache_remove(c,c->head);
+    }
+    luaopus_cache_unlock();
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luaopus_cache_set_max(lua_State *L) {
+    luaopus_cache *c = &luaopus_cache_g;
+    lua_Number max = 0;
+
+    max = luaL_checknumber(L,1);
+    if(max < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_BAD_ARG);
+        return 2;
+    }
+
+    luaopus_cache_lock();
+    luaopus_cache_max = (size_t)max;
+    luaopus_cache_evict(c);
+    luaopus_cache_unlock();
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luaopus_cache_stats(lua_State *L) {
+    luaopus_cache s;
+    size_t max = 0;
+
+    luaopus_cache_lock();
+    memcpy(&s,&luaopus_cache_g,sizeof(luaopus_cache));
+    max = luaopus_cache_max;
+    luaopus_cache_unlock();
+
+    lua_createtable(L,0,9);
+    lua_pushnumber(L,(lua_Number)s.entries);
+    lua_setfield(L,-2,"entries");
+    lua_pushnumber(L,(lua_Number)s.bytes);
+    lua_setfield(L,-2,"bytes");
+    lua_pushnumber(L,(lua_Number)max);
+    lua_setfield(L,-2,"max");
+    lua_pushnumber(L,(lua_Number)s.pinned);
+    lua_setfield(L,-2,"pinned");
+    lua_pushnumber(L,(lua_Number)s.hits);
+    lua_setfield(L,-2,"hits");
+    lua_pushnumber(L,(lua_Number)s.misses);
+    lua_setfield(L,-2,"misses");
+    lua_pushnumber(L,s.hits + s.misses ? (lua_Number)s.hits / (lua_Number)(s.hits + s.misses) : 0);
+    lua_setfield(L,-2,"hit_rate");
+    lua_pushnumber(L,(lua_Number)s.inserts);
+    lua_setfield(L,-2,"inserts");
+    lua_pushnumber(L,(lua_Number)s.evictions);
+    lua_setfield(L,-2,"evictions");
+    return 1;
+}
+
+static int
+luaopus_cache_reset_stats(lua_State *L) {
+    luaopus_cache_lock();
+    luaopus_cache_g.hits = 0;
+    luaopus_cache_g.misses = 0;
+    luaopus_cache_g.inserts = 0;
+    luaopus_cache_g.evictions = 0;
+    luaopus_cache_unlock();
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luaopus_cached_packets_count(lua_State *L) {
+    luaopus_cache_view *v = NULL;
+
+    v = luaL_checkudata(L,1,luaopus_cache_view_mt);
+    lua_pushinteger(L,(lua_Integer)v->entry->count);
+    return 1;
+}
+
+/* packet i as a Lua string, which is a copy */
+static int
+luaopus_cached_packets_get(lua_State *L) {
+    luaopus_cache_view *v = NULL;
+    const luaopus_cache_entry *e = NULL;
+    lua_Integer i = 0;
+
+    v = luaL_checkudata(L,1,luaopus_cache_view_mt);
+    i = luaL_checkinteger(L,2);
+    e = v->entry;
+    if(i < 1 || (size_t)i > e->count) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_pushlstring(L,(const char *)e->data + e->offsets[i - 1],
+      e->offsets[i] - e->offsets[i - 1]);
+    return 1;
+}
+
+/* packet i in place, as a pointer and length. good for as long
+ * as the view is, for the LuaJIT FFI or other C code */
+static int
+luaopus_cached_packets_pointer(lua_State *L) {
+    luaopus_cache_view *v = NULL;
+    const luaopus_cache_entry *e = NULL;
+    lua_Integer i = 0;
+
+    v = luaL_checkudata(L,1,luaopus_cache_view_mt);
+    i = luaL_checkinteger(L,2);
+    e = v->entry;
+    if(i < 1 || (size_t)i > e->count) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_pushlightuserdata(L,(void *)(e->data + e->offsets[i - 1]));
+    lua_pushinteger(L,(lua_Integer)(e->offsets[i] - e->offsets[i - 1]));
+    return 2;
+}
+
+/* upvalue is the view, the control variable is the index */
+static int
+luaopus_cached_packets_iter(lua_State *L) {
+    const luaopus_cache_view *v = NULL;
+    const luaopus_cache_entry *e = NULL;
+    lua_Integer i = 0;
+
+    v = (const luaopus_cache_view *)lua_touserdata(L,lua_upvalueindex(1));
+    e = v->entry;
+    i = lua_tointeger(L,2) + 1;
+    if(i < 1 || (size_t)i > e->count) {
+        return 0;
+    }
+
+    lua_pushinteger(L,i);
+    lua_pushlstring(L,(const char *)e->data + e->offsets[i - 1],
+      e->offsets[i] - e->offsets[i - 1]);
+    return 2;
+}
+
+static int
+luaopus_cached_packets_iterate(lua_State *L) {
+    luaL_checkudata(L,1,luaopus_cache_view_mt);
+
+    lua_settop(L,1);
+    lua_pushcclosure(L,luaopus_cached_packets_iter,1);
+    lua_pushnil(L);
+    lua_pushinteger(L,0);
+    return 3;
+}
+
+static const struct luaL_Reg luaopus_cache_functions[] = {
+    { "opus_cache_get", luaopus_cache_get },
+    { "opus_cache_put", luaopus_cache_put },
+    { "opus_cache_remove", luaopus_cache_remove_key },
+    { "opus_cache_clear", luaopus_cache_clear },
+    { "opus_cache_set_max", luaopus_cache_set_max },
+    { "opus_cache_stats", luaopus_cache_stats },
+    { "opus_cache_reset_stats", luaopus_cache_reset_stats },
+    { "opus_cached_packets_count", luaopus_cached_packets_count },
+    { "opus_cached_packets_get", luaopus_cached_packets_get },
+    { "opus_cached_packets_pointer", luaopus_cached_packets_pointer },
+    { "opus_cached_packets_iterate", luaopus_cached_packets_iterate },
+    { NULL, NULL },
+};
+
+static const luaopus_metamethods luaopus_cache_view_metamethods[] = {
+    { "opus_cached_packets_count", "count" },
+    { "opus_cached_packets_get", "packet" },
+    { "opus_cached_packets_pointer", "pointer" },
+    { "opus_cached_packets_iterate", "packets" },
+    { NULL, NULL },
+};
+
+LUAOPUS_PRIVATE
+void luaopus_cache_register(lua_State *L) {
+    const luaopus_metamethods *m = luaopus_cache_view_metamethods;
+
+    luaL_setfuncs(L,luaopus_cache_functions,0);
+
+    if(luaL_newmetatable(L,luaopus_cache_view_mt)) {
+        lua_pushcclosure(L,luaopus_cache_view_delete,0);
+        lua_setfield(L,-2,"__gc");
+        lua_pushcclosure(L,luaopus_cached_packets_count,0);
+        lua_setfield(L,-2,"__len");
+
+        lua_newtable(L);
+        while(m->name != NULL) {
+            lua_getfield(L,-3,m->name);
+            lua_setfield(L,-2,m->metaname);
+            m++;
+        }
+
+        lua_setfield(L,-2,"__index");
+    }
+    lua_pop(L,1);
+}
+
+LUAOPUS_PUBLIC
+int luaopen_luaopus_cache(lua_State *L) {
+    lua_newtable(L);
+    luaopus_cache_register(L);
+    return 1;
+}
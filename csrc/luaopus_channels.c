@@ -0,0 +1,166 @@
+#include "luaopus_internal.h"
+#include <opus/opus_defines.h>
+
+static const char * const luaopus_chanmap_presets[] = {
+    "downmix",
+    "upmix",
+    "swap",
+    NULL,
+};
+
+static int
+luaopus_chanmap_table(lua_State *L, int idx, luaopus_chanmap *m) {
+    int rows = 0;
+    int cols = 0;
+    int r = 0;
+    int c = 0;
+
+    rows = lua_rawlen(L,idx);
+    if(rows < 1 || rows > LUAOPUS_CHANMAP_MAX) {
+        return OPUS_BAD_ARG;
+    }
+
+    for(r=0;r<rows;r++) {
+        lua_rawgeti(L,idx,r+1);
+        if(!lua_istable(L,-1)) {
+            lua_pop(L,1);
+            return OPUS_BAD_ARG;
+        }
+        if(r == 0) {
+            cols = lua_rawlen(L,-1);
+            if(cols < 1 || cols > LUAOPUS_CHANMAP_MAX) {
+                lua_pop(L,1);
+                return OPUS_BAD_ARG;
+            }
+        } else if((int)lua_rawlen(L,-1) != cols) {
+            lua_pop(L,1);
+            return OPUS_BAD_ARG;
+        }
+        for(c=0;c<cols;c++) {
+            lua_rawgeti(L,-1,c+1);
+            m->matrix[(r*cols)+c] = (float)lua_tonumber(L,-1);
+            lua_pop(L,1);
+        }
+        lua_pop(L,1);
+    }
+
+    m->in_channels = cols;
+    m->out_channels = rows;
+    return OPUS_OK;
+}
+
+LUAOPUS_PRIVATE
+int luaopus_chanmap_check(lua_State *L, int idx, luaopus_chanmap *m, int codec_channels, int codec_is_input) {
+    luaopus_chanmap t;
+    int r = OPUS_OK;
+
+    if(lua_isnoneornil(L,idx)) {
+        m->in_channels = 0;
+        m->out_channels = 0;
+        return OPUS_OK;
+    }
+
+    if(lua_istable(L,idx)) {
+        r = luaopus_chanmap_table(L,idx,&t);
+        if(r != OPUS_OK) return r;
+    } else {
+        switch(luaL_checkoption(L,idx,NULL,luaopus_chanmap_presets)) {
+            case 0: {
+                t.in_channels = 2;
+                t.out_channels = 1;
+                t.matrix[0] = (float)luaL_optnumber(L,idx+1,0.5);
+                t.matrix[1] = (float)luaL_optnumber(L,idx+2,0.5);
+                break;
+            }
+            case 1: {
+                t.in_channels = 1;
+                t.out_channels = 2;
+                t.matrix[0] = 1.0f;
+                t.matrix[1] = 1.0f;
+                break;
+            }
+            default: {
+                t.in_channels = 2;
+                t.out_channels = 2;
+                t.matrix[0] = 0.0f;
+                t.matrix[1] = 1.0f;
+                t.matrix[2] = 1.0f;
+                t.matrix[3] = 0.0f;
+                break;
+            }
+        }
+    }
+
+    if(codec_is_input ? t.in_channels != codec_channels : t.out_channels != codec_channels) {
+        return OPUS_BAD_ARG;
+    }
+
+    *m = t;
+    return OPUS_OK;
+}
+
+/* both of these work in-place: when the map widens the signal
+ * we walk backwards so we never overwrite input we still need */
+LUAOPUS_PRIVATE
+void luaopus_chanmap_float(const luaopus_chanmap *m, float *pcm, int frame_size) {
+    float in[LUAOPUS_CHANMAP_MAX];
+    const float *row = NULL;
+    float acc = 0.0f;
+    int f = 0;
+    int step = 1;
+    int i = 0;
+    int o = 0;
+
+    if(m->out_channels > m->in_channels) {
+        f = frame_size - 1;
+        step = -1;
+    }
+
+    for(;f >= 0 && f < frame_size; f += step) {
+        for(i=0;i<m->in_channels;i++) {
+            in[i] = pcm[(f*m->in_channels)+i];
+        }
+        row = m->matrix;
+        for(o=0;o<m->out_channels;o++) {
+            acc = 0.0f;
+            for(i=0;i<m->in_channels;i++) {
+                acc += row[i] * in[i];
+            }
+            pcm[(f*m->out_channels)+o] = acc;
+            row += m->in_channels;
+        }
+    }
+}
+
+LUAOPUS_PRIVATE
+void luaopus_chanmap_int16(const luaopus_chanmap *m, opus_int16 *pcm, int frame_size) {
+    float in[LUAOPUS_CHANMAP_MAX];
+    const float *row = NULL;
+    float acc = 0.0f;
+    int f = 0;
+    int step = 1;
+    int i = 0;
+    int o = 0;
+
+    if(m->out_channels > m->in_channels) {
+        f = frame_size - 1;
+        step = -1;
+    }
+
+    for(;f >= 0 && f < frame_size; f += step) {
+        for(i=0;i<m->in_channels;i++) {
+            in[i] = (float)pcm[(f*m->in_channels)+i];
+        }
+        row = m->matrix;
+        for(o=0;o<m->out_channels;o++) {
+            acc = 0.0f;
+            for(i=0;i<m->in_channels;i++) {
+                acc += row[i] * in[i];
+            }
+            if(acc > 32767.0f) acc = 32767.0f;
+            else if(acc < -32768.0f) acc = -32768.0f;
+            pcm[(f*m->out_channels)+o] = (opus_int16)(acc < 0.0f ? acc - 0.5f : acc + 0.5f);
+            row += m->in_channels;
+        }
+    }
+}
@@ -0,0 +1,372 @@
+#include "luaopus_internal.h"
+#include <opus/opus.h>
+#include <string.h>
+
+const char * const luaopus_encoder_config_mt = "OpusEncoderConfig";
+
+#define LUAOPUS_CONFIG_INTEGER 0
+#define LUAOPUS_CONFIG_BOOLEAN 1
+
+typedef struct luaopus_config_ctl_s {
+    const char *name;
+    int set;
+    int get;
+    int type;
+} luaopus_config_ctl;
+
+#define LUAOPUS_CONFIG_CTL(n,f,t) \
+    { n, OPUS_SET_ ## f ## _REQUEST, OPUS_GET_ ## f ## _REQUEST, LUAOPUS_CONFIG_ ## t }
+
+/* the ctls configure() can set, applied in this order. bitrate
+ * goes last: OPUS_GET_BITRATE reports the rate in use rather than
+ * OPUS_AUTO, so it can't be put back after a later ctl fails */
+static const luaopus_config_ctl luaopus_encoder_config_ctls[] = {
+    LUAOPUS_CONFIG_CTL("application", APPLICATION, INTEGER),
+    LUAOPUS_CONFIG_CTL("signal", SIGNAL, INTEGER),
+    LUAOPUS_CONFIG_CTL("max_bandwidth", MAX_BANDWIDTH, INTEGER),
+    LUAOPUS_CONFIG_CTL("complexity", COMPLEXITY, INTEGER),
+    LUAOPUS_CONFIG_CTL("vbr", VBR, BOOLEAN),
+    LUAOPUS_CONFIG_CTL("vbr_constraint", VBR_CONSTRAINT, BOOLEAN),
+    LUAOPUS_CONFIG_CTL("force_channels", FORCE_CHANNELS, INTEGER),
+    LUAOPUS_CONFIG_CTL("inband_fec", INBAND_FEC, BOOLEAN),
+    LUAOPUS_CONFIG_CTL("packet_loss_perc", PACKET_LOSS_PERC, INTEGER),
+    LUAOPUS_CONFIG_CTL("dtx", DTX, BOOLEAN),
+    LUAOPUS_CONFIG_CTL("lsb_depth", LSB_DEPTH, INTEGER),
+#ifdef OPUS_SET_EXPERT_FRAME_DURATION
+    LUAOPUS_CONFIG_CTL("expert_frame_duration", EXPERT_FRAME_DURATION, INTEGER),
+#endif
+#ifdef OPUS_SET_PREDICTION_DISABLED
+    LUAOPUS_CONFIG_CTL("prediction_disabled", PREDICTION_DISABLED, BOOLEAN),
+#endif
+#ifdef OPUS_SET_PHASE_INVERSION_DISABLED
+    LUAOPUS_CONFIG_CTL("phase_inversion_disabled", PHASE_INVERSION_DISABLED, BOOLEAN),
+#endif
+#ifdef OPUS_SET_DRED_DURATION
+    LUAOPUS_CONFIG_CTL("dred_duration", DRED_DURATION, INTEGER),
+#endif
+    LUAOPUS_CONFIG_CTL("bitrate", BITRATE, INTEGER),
+};
+
+#define LUAOPUS_CONFIG_CTLS \
+    (sizeof(luaopus_encoder_config_ctls) / sizeof(luaopus_encoder_config_ctls[0]))
+
+/* a validated set of ctl values, indexed the same as
+ * luaopus_encoder_config_ctls */
+typedef struct luaopus_encoder_config_s {
+    unsigned char set[LUAOPUS_CONFIG_CTLS];
+    opus_int32 value[LUAOPUS_CONFIG_CTLS];
+} luaopus_encoder_config;
+
+/* fills c from the table at idx. returns OPUS_OK, or OPUS_BAD_ARG
+ * with the offending key left on top of the stack */
+static int
+luaopus_encoder_config_compile(lua_State *L, int idx, luaopus_encoder_config *c) {
+    const char *name = NULL;
+    unsigned int i = 0;
+
+    memset(c,0,sizeof(luaopus_encoder_config));
+
+    lua_pushnil(L);
+    while(lua_next(L,idx) != 0) {
+        if(lua_type(L,-2) != LUA_TSTRING) {
+            lua_pop(L,1);
+            return OPUS_BAD_ARG;
+        }
+        name = lua_tostring(L,-2);
+
+        for(i=0;i<LUAOPUS_CONFIG_CTLS;i++) {
+            if(strcmp(luaopus_encoder_config_ctls[i].name,name) == 0) break;
+        }
+        if(i == LUAOPUS_CONFIG_CTLS) {
+            lua_pop(L,1);
+            return OPUS_BAD_ARG;
+        }
+
+        if(luaopus_encoder_config_ctls[i].type == LUAOPUS_CONFIG_BOOLEAN) {
+            if(lua_type(L,-1) != LUA_TBOOLEAN) {
+                lua_pop(L,1);
+                return OPUS_BAD_ARG;
+            }
+            c->value[i] = lua_toboolean(L,-1);
+        } else {
+            if(lua_type(L,-1) != LUA_TNUMBER) {
+                lua_pop(L,1);
+                return OPUS_BAD_ARG;
+            }
+            c->value[i] = (opus_int32)lua_tointeger(L,-1);
+        }
+        c->set[i] = 1;
+
+        lua_pop(L,1);
+    }
+
+    return OPUS_OK;
+}
+
+/* returns OPUS_OK, or the opus error with *failed set to the
+ * ctl that caused it. on failure the ctls already set are put
+ * back, so the encoder is left as it was */
+static int
+luaopus_encoder_config_apply_one(OpusEncoder *encoder, const luaopus_encoder_config *c, const char **failed) {
+    opus_int32 old[LUAOPUS_CONFIG_CTLS];
+    unsigned int i = 0;
+    int err = 0;
+
+    for(i=0;i<LUAOPUS_CONFIG_CTLS;i++) {
+        if(!c->set[i]) continue;
+        /* bitrate is last, nothing after it can fail */
+        if(i < LUAOPUS_CONFIG_CTLS - 1) {
+            err = opus_encoder_ctl(encoder,luaopus_encoder_config_ctls[i].get,&old[i]);
+        }
+        if(err >= 0) {
+            err = opus_encoder_ctl(encoder,luaopus_encoder_config_ctls[i].set,c->value[i]);
+        }
+        if(err < 0) {
+            *failed = luaopus_encoder_config_ctls[i].name;
+            while(i-- > 0) {
+                if(!c->set[i]) continue;
+                opus_encoder_ctl(encoder,luaopus_encoder_config_ctls[i].set,old[i]);
+            }
+            return err;
+        }
+    }
+
+    return OPUS_OK;
+}
+
+/* checks the settings that can fail on one encoder and not
+ * another, before apply() changes any of them: force_channels
+ * against the channel count, and application, which libopus
+ * won't change once the encoder has started. that's found out
+ * by setting it and putting it straight back */
+static int
+luaopus_encoder_config_check(luaopus_encoder *u, const luaopus_encoder_config *c, const char **failed) {
+    opus_int32 old = 0;
+    opus_int32 x = 0;
+    unsigned int i = 0;
+    int err = 0;
+
+    for(i=0;i<LUAOPUS_CONFIG_CTLS;i++) {
+        if(!c->set[i]) continue;
+        x = c->value[i];
+        if(luaopus_encoder_config_ctls[i].set == OPUS_SET_FORCE_CHANNELS_REQUEST) {
+            if(x != OPUS_AUTO && (x < 1 || x > u->channels)) err = OPUS_BAD_ARG;
+        } else if(luaopus_encoder_config_ctls[i].set == OPUS_SET_APPLICATION_REQUEST) {
+            err = opus_encoder_ctl(u->encoder,OPUS_GET_APPLICATION(&old));
+            if(err >= 0 && old != x) {
+                err = opus_encoder_ctl(u->encoder,OPUS_SET_APPLICATION(x));
+                if(err >= 0) opus_encoder_ctl(u->encoder,OPUS_SET_APPLICATION(old));
+            }
+        }
+        if(err < 0) {
+            *failed = luaopus_encoder_config_ctls[i].name;
+            return err;
+        }
+    }
+
+    return OPUS_OK;
+}
+
+static int
+luaopus_OpusEncoderConfig(lua_State *L) {
+    luaopus_encoder_config *c = NULL;
+    luaopus_encoder_config tmp;
+
+    luaL_checktype(L,1,LUA_TTABLE);
+
+    if(luaopus_encoder_config_compile(L,1,&tmp) != OPUS_OK) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_BAD_ARG);
+        lua_pushvalue(L,-3);
+        return 3;
+    }
+
+    c = (luaopus_encoder_config *)lua_newuserdata(L,sizeof(luaopus_encoder_config));
+    memcpy(c,&tmp,sizeof(luaopus_encoder_config));
+    luaL_setmetatable(L,luaopus_encoder_config_mt);
+    return 1;
+}
+
+/* applies the config to every encoder given, either directly
+ * or in an array. every encoder is checked first, so a bad
+ * argument or a setting one of them can't take leaves them all
+ * as they were. returns nil, error, ctl name, and which encoder
+ * (counting from 1) on failure */
+static int
+luaopus_encoder_config_apply(lua_State *L) {
+    luaopus_encoder_config *c = NULL;
+    luaopus_encoder *u = NULL;
+    const char *failed = NULL;
+    int top = 0;
+    int pass = 0;
+    int arg = 0;
+    int count = 0;
+    int n = 0;
+    int i = 0;
+    int err = 0;
+
+    c = luaL_checkudata(L,1,luaopus_encoder_config_mt);
+    top = lua_gettop(L);
+
+    for(pass=0;pass<2;pass++) {
+        count = 0;
+        for(arg=2;arg<=top;arg++) {
+            n = lua_type(L,arg) == LUA_TTABLE ? (int)lua_rawlen(L,arg) : 1;
+            for(i=1;i<=n;i++) {
+                if(lua_type(L,arg) == LUA_TTABLE) {
+                    lua_rawgeti(L,arg,i);
+                    u = luaL_testudata(L,-1,luaopus_encoder_mt);
+                    lua_pop(L,1);
+                } else {
+                    u = luaL_checkudata(L,arg,luaopus_encoder_mt);
+                }
+                count++;
+                if(u == NULL) {
+                    err = OPUS_BAD_ARG;
+                    goto fail;
+                }
+                if(pass == 0) {
+                    err = luaopus_encoder_config_check(u,c,&failed);
+                } else {
+                    err = luaopus_encoder_config_apply_one(u->encoder,c,&failed);
+                }
+                if(err < 0) goto fail;
+            }
+        }
+    }
+
+    lua_pushinteger(L,count);
+    return 1;
+
+    fail:
+    lua_pushnil(L);
+    lua_pushinteger(L,err);
+    if(failed != NULL) {
+        lua_pushstring(L,failed);
+    } else {
+        lua_pushnil(L);
+    }
+    lua_pushinteger(L,count);
+    return 4;
+}
+
+LUAOPUS_PRIVATE
+int luaopus_encoder_configure(lua_State *L) {
+    luaopus_encoder *u = NULL;
+    luaopus_encoder_config *c = NULL;
+    luaopus_encoder_config tmp;
+    const char *failed = NULL;
+    int err = 0;
+
+    u = luaL_checkudata(L,1,luaopus_encoder_mt);
+
+    c = luaL_testudata(L,2,luaopus_encoder_config_mt);
+    if(c == NULL) {
+        luaL_checktype(L,2,LUA_TTABLE);
+        if(luaopus_encoder_config_compile(L,2,&tmp) != OPUS_OK) {
+            lua_pushnil(L);
+            lua_pushinteger(L,OPUS_BAD_ARG);
+            lua_pushvalue(L,-3);
+            return 3;
+        }
+        c = &tmp;
+    }
+
+    err = luaopus_encoder_config_apply_one(u->encoder,c,&failed);
+    if(err < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L,err);
+        lua_pushstring(L,failed);
+        return 3;
+    }
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+/* reads back every ctl configure() can set, so the table
+ * can be handed to configure() on another encoder */
+LUAOPUS_PRIVATE
+int luaopus_encoder_get_config(lua_State *L) {
+    luaopus_encoder *u = NULL;
+    opus_int32 x = 0;
+    unsigned int i = 0;
+
+    u = luaL_checkudata(L,1,luaopus_encoder_mt);
+
+    lua_createtable(L,0,LUAOPUS_CONFIG_CTLS);
+    for(i=0;i<LUAOPUS_CONFIG_CTLS;i++) {
+        if(opus_encoder_ctl(u->encoder,luaopus_encoder_config_ctls[i].get,&x) < 0) {
+            continue;
+        }
+        if(luaopus_encoder_config_ctls[i].type == LUAOPUS_CONFIG_BOOLEAN) {
+            lua_pushboolean(L,x);
+        } else {
+            lua_pushinteger(L,x);
+        }
+        lua_setfield(L,-2,luaopus_encoder_config_ctls[i].name);
+    }
+
+    return 1;
+}
+
+/* returns the config as a plain table */
+static int
+luaopus_encoder_config_totable(lua_State *L) {
+    luaopus_encoder_config *c = NULL;
+    unsigned int i = 0;
+
+    c = luaL_checkudata(L,1,luaopus_encoder_config_mt);
+
+    lua_newtable(L);
+    for(i=0;i<LUAOPUS_CONFIG_CTLS;i++) {
+        if(!c->set[i]) continue;
+        if(luaopus_encoder_config_ctls[i].type == LUAOPUS_CONFIG_BOOLEAN) {
+            lua_pushboolean(L,c->value[i]);
+        } else {
+            lua_pushinteger(L,c->value[i]);
+        }
+        lua_setfield(L,-2,luaopus_encoder_config_ctls[i].name);
+    }
+
+    return 1;
+}
+
+static const struct luaL_Reg luaopus_config_functions[] = {
+    { "OpusEncoderConfig", luaopus_OpusEncoderConfig },
+    { "opus_encoder_config_apply", luaopus_encoder_config_apply },
+    { "opus_encoder_config_totable", luaopus_encoder_config_totable },
+    { NULL, NULL },
+};
+
+static const luaopus_metamethods luaopus_config_metamethods[] = {
+    { "opus_encoder_config_apply", "apply" },
+    { "opus_encoder_config_totable", "totable" },
+    { NULL, NULL },
+};
+
+LUAOPUS_PRIVATE
+void luaopus_config_register(lua_State *L) {
+    const luaopus_metamethods *m = luaopus_config_metamethods;
+
+    luaL_setfuncs(L,luaopus_config_functions,0);
+
+    if(luaL_newmetatable(L,luaopus_encoder_config_mt)) {
+        lua_newtable(L);
+        while(m->name != NULL) {
+            lua_getfield(L,-3,m->name);
+            lua_setfield(L,-2,m->metaname);
+            m++;
+        }
+
+        lua_setfield(L,-2,"__index");
+    }
+    lua_pop(L,1);
+}
+
+LUAOPUS_PUBLIC
+int luaopen_luaopus_config(lua_State *L) {
+    lua_newtable(L);
+    luaopus_config_register(L);
+    return 1;
+}
@@ -0,0 +1,733 @@
+#include "luaopus_internal.h"
+#include <opus/opus.h>
+
+/* custom modes are a libopus build option (--enable-custom-modes),
+ * opus_custom.h is installed either way, so there's no header to
+ * look for. cmake checks the library, anything else has to define
+ * LUAOPUS_HAVE_CUSTOM itself */
+
+#ifdef LUAOPUS_HAVE_CUSTOM
+
+/* opus_custom.h only declares opus_custom_encoder_init when
+ * CUSTOM_MODES is set, which it is in the library we link to */
+#ifndef CUSTOM_MODES
+#define CUSTOM_MODES
+#endif
+#include <opus/opus_custom.h>
+
+/* the largest packet a custom mode encoder writes */
+#define MAX_CUSTOM_PACKET 1275
+
+const char * const luaopus_custom_mode_mt = "OpusCustomMode";
+const char * const luaopus_custom_encoder_mt = "OpusCustomEncoder";
+const char * const luaopus_custom_decoder_mt = "OpusCustomDecoder";
+
+/* libopus allocates modes itself, there's no get_size/init
+ * pair for them like there is for the codecs */
+typedef struct luaopus_custom_mode_s {
+    OpusCustomMode *mode;
+    opus_int32 Fs;
+    int frame_size;
+} luaopus_custom_mode;
+
+/* encoders and decoders point into their mode, so the mode
+ * userdata is held in their uservalue table */
+typedef struct luaopus_custom_encoder_s {
+    /* holds the encoder state and the packet buffer */
+    luaopus_mem mem;
+
+    OpusCustomEncoder *custom_encoder;
+
+    /* MAX_CUSTOM_PACKET bytes */
+    unsigned char *buffer;
+
+    opus_int32 Fs;
+    int frame_size;
+    int channels;
+
+    /* what set_bitrate and set_vbr last set, CELT can't report them.
+     * bitrate is OPUS_BITRATE_MAX until one is set */
+    opus_int32 bitrate;
+    int vbr;
+} luaopus_custom_encoder;
+
+typedef struct luaopus_custom_decoder_s {
+    /* holds the decoder state and the sample buffer */
+    luaopus_mem mem;
+
+    OpusCustomDecoder *custom_decoder;
+
+    /* one frame, float storage that's also used for int16 */
+    float *pcm_float;
+    opus_int16 *pcm_int16;
+
+    opus_int32 Fs;
+    int frame_size;
+    int channels;
+} luaopus_custom_decoder;
+
+static int
+luaopus_OpusCustomMode(lua_State *L) {
+    luaopus_custom_mode *u = NULL;
+    opus_int32 Fs = 0;
+    int frame_size = 0;
+    int err = 0;
+
+    Fs = (opus_int32)luaL_checkinteger(L,1);
+    frame_size = (int)luaL_checkinteger(L,2);
+
+    u = lua_newuserdata(L,sizeof(luaopus_custom_mode));
+    if(u == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    u->mode = NULL;
+    luaL_setmetatable(L,luaopus_custom_mode_mt);
+
+    u->mode = opus_custom_mode_create(Fs,frame_size,&err);
+    if(u->mode == NULL) {
+        lua_pushnil(L);
+        lua_pushinteger(L,err < 0 ? err : OPUS_ALLOC_FAIL);
+        return 2;
+    }
+    u->Fs = Fs;
+    u->frame_size = frame_size;
+
+    return 1;
+}
+
+static int
+luaopus_OpusCustomMode_delete(lua_State *L) {
+    luaopus_custom_mode *u = NULL;
+
+    u = luaL_checkudata(L,1,luaopus_custom_mode_mt);
+    if(u->mode != NULL) {
+        opus_custom_mode_destroy(u->mode);
+        u->mode = NULL;
+    }
+
+    return 0;
+}
+
+static int
+luaopus_custom_mode_get_samplerate(lua_State *L) {
+    luaopus_custom_mode *u = NULL;
+
+    u = luaL_checkudata(L,1,luaopus_custom_mode_mt);
+    lua_pushinteger(L,u->Fs);
+    return 1;
+}
+
+static int
+luaopus_custom_mode_get_frame_size(lua_State *L) {
+    luaopus_custom_mode *u = NULL;
+
+    u = luaL_checkudata(L,1,luaopus_custom_mode_mt);
+    lua_pushinteger(L,u->frame_size);
+    return 1;
+}
+
+/* the mode at index idx becomes the object's mode */
+static void
+luaopus_custom_keep_mode(lua_State *L, int obj, int idx) {
+    lua_getuservalue(L,obj);
+    lua_pushvalue(L,idx);
+    lua_setfield(L,-2,"mode");
+    lua_pop(L,1);
+}
+
+/* allocates the state for the mode at index idx,
+ * returns an opus error code */
+static int
+luaopus_custom_encoder_setup(lua_State *L, luaopus_custom_encoder *u, int idx, int channels) {
+    luaopus_custom_mode *m = NULL;
+    luaopus_mem mem;
+    unsigned char *block = NULL;
+    int state_size = 0;
+    int result = 0;
+
+    m = luaL_checkudata(L,idx,luaopus_custom_mode_mt);
+    if(m->mode == NULL || channels < 1 || channels > 2) {
+        return OPUS_BAD_ARG;
+    }
+
+    state_size = opus_custom_encoder_get_size(m->mode,channels);
+    if(state_size <= 0) {
+        return OPUS_BAD_ARG;
+    }
+
+    block = luaopus_mem_alloc(L,&mem,LUAOPUS_MEM_ENCODER,
+      LUAOPUS_MEM_ALIGN((size_t)state_size) + MAX_CUSTOM_PACKET);
+    if(block == NULL) {
+        return OPUS_ALLOC_FAIL;
+    }
+
+    result = opus_custom_encoder_init((OpusCustomEncoder *)block,m->mode,channels);
+    if(result != OPUS_OK) {
+        luaopus_mem_free(&mem);
+        return result;
+    }
+
+    luaopus_mem_free(&u->mem);
+    u->mem = mem;
+    u->custom_encoder = (OpusCustomEncoder *)block;
+    u->buffer = block + LUAOPUS_MEM_ALIGN((size_t)state_size);
+    u->Fs = m->Fs;
+    u->frame_size = m->frame_size;
+    u->channels = channels;
+    u->bitrate = OPUS_BITRATE_MAX;
+    u->vbr = 0;
+    return OPUS_OK;
+}
+
+static int
+luaopus_custom_decoder_setup(lua_State *L, luaopus_custom_decoder *u, int idx, int channels) {
+    luaopus_custom_mode *m = NULL;
+    luaopus_mem mem;
+    unsigned char *block = NULL;
+    int state_size = 0;
+    int result = 0;
+
+    m = luaL_checkudata(L,idx,luaopus_custom_mode_mt);
+    if(m->mode == NULL || channels < 1 || channels > 2) {
+        return OPUS_BAD_ARG;
+    }
+
+    state_size = opus_custom_decoder_get_size(m->mode,channels);
+    if(state_size <= 0) {
+        return OPUS_BAD_ARG;
+    }
+
+    block = luaopus_mem_alloc(L,&mem,LUAOPUS_MEM_DECODER,
+      LUAOPUS_MEM_ALIGN((size_t)state_size) + (sizeof(float) * m->frame_size * channels));
+    if(block == NULL) {
+        return OPUS_ALLOC_FAIL;
+    }
+
+    result = opus_custom_decoder_init((OpusCustomDecoder *)block,m->mode,channels);
+    if(result != OPUS_OK) {
+        luaopus_mem_free(&mem);
+        return result;
+    }
+
+    luaopus_mem_free(&u->mem);
+    u->mem = mem;
+    u->custom_decoder = (OpusCustomDecoder *)block;
+    u->pcm_float = (float *)(block + LUAOPUS_MEM_ALIGN((size_t)state_size));
+    u->pcm_int16 = (opus_int16 *)u->pcm_float;
+    u->Fs = m->Fs;
+    u->frame_size = m->frame_size;
+    u->channels = channels;
+    return OPUS_OK;
+}
+
+static int
+luaopus_custom_encoder_init(lua_State *L) {
+    luaopus_custom_encoder *u = NULL;
+    int result = 0;
+
+    u = luaL_checkudata(L,1,luaopus_custom_encoder_mt);
+    result = luaopus_custom_encoder_setup(L,u,2,luaL_checkinteger(L,3));
+    if(result != OPUS_OK) {
+        lua_pushnil(L);
+        lua_pushinteger(L,result);
+        return 2;
+    }
+    luaopus_custom_keep_mode(L,1,2);
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luaopus_OpusCustomEncoder(lua_State *L) {
+    luaopus_custom_encoder *u = NULL;
+    int result = 0;
+
+    u = lua_newuserdata(L,sizeof(luaopus_custom_encoder));
+    if(u == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    u->mem.ptr = NULL;
+    u->custom_encoder = NULL;
+
+    lua_newtable(L);
+    lua_setuservalue(L,-2);
+    luaL_setmetatable(L,luaopus_custom_encoder_mt);
+
+    result = luaopus_custom_encoder_setup(L,u,1,luaL_checkinteger(L,2));
+    if(result != OPUS_OK) {
+        lua_pushnil(L);
+        lua_pushinteger(L,result);
+        return 2;
+    }
+    luaopus_custom_keep_mode(L,-1,1);
+
+    return 1;
+}
+
+static int
+luaopus_OpusCustomEncoder_delete(lua_State *L) {
+    luaopus_custom_encoder *u = NULL;
+
+    u = luaL_checkudata(L,1,luaopus_custom_encoder_mt);
+    luaopus_mem_free(&u->mem);
+    u->custom_encoder = NULL;
+
+    return 0;
+}
+
+static int
+luaopus_custom_decoder_init(lua_State *L) {
+    luaopus_custom_decoder *u = NULL;
+    int result = 0;
+
+    u = luaL_checkudata(L,1,luaopus_custom_decoder_mt);
+    result = luaopus_custom_decoder_setup(L,u,2,luaL_checkinteger(L,3));
+    if(result != OPUS_OK) {
+        lua_pushnil(L);
+        lua_pushinteger(L,result);
+        return 2;
+    }
+    luaopus_custom_keep_mode(L,1,2);
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luaopus_OpusCustomDecoder(lua_State *L) {
+    luaopus_custom_decoder *u = NULL;
+    int result = 0;
+
+    u = lua_newuserdata(L,sizeof(luaopus_custom_decoder));
+    if(u == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    u->mem.ptr = NULL;
+    u->custom_decoder = NULL;
+
+    lua_newtable(L);
+    lua_setuservalue(L,-2);
+    luaL_setmetatable(L,luaopus_custom_decoder_mt);
+
+    result = luaopus_custom_decoder_setup(L,u,1,luaL_checkinteger(L,2));
+    if(result != OPUS_OK) {
+        lua_pushnil(L);
+        lua_pushinteger(L,result);
+        return 2;
+    }
+    luaopus_custom_keep_mode(L,-1,1);
+
+    return 1;
+}
+
+static int
+luaopus_OpusCustomDecoder_delete(lua_State *L) {
+    luaopus_custom_decoder *u = NULL;
+
+    u = luaL_checkudata(L,1,luaopus_custom_decoder_mt);
+    luaopus_mem_free(&u->mem);
+    u->custom_decoder = NULL;
+
+    return 0;
+}
+
+/* pcm is a string of interleaved native-endian samples, at most
+ * the mode's frame size. max_bytes caps the packet. with no
+ * bitrate set, CBR packets are max_bytes long, so it's required.
+ * otherwise it defaults to the bitrate's packet size in CBR, and
+ * to the largest packet in VBR */
+static int
+luaopus_custom_encode_packed(lua_State *L, int is_float) {
+    luaopus_custom_encoder *u = NULL;
+    const char *pcm = NULL;
+    size_t len = 0;
+    size_t frame_bytes = 0;
+    lua_Integer max_bytes = 0;
+    int bytes = 0;
+
+    u = luaL_checkudata(L,1,luaopus_custom_encoder_mt);
+    pcm = luaL_checklstring(L,2,&len);
+    if(!lua_isnoneornil(L,3)) {
+        max_bytes = luaL_checkinteger(L,3);
+    } else if(u->bitrate == OPUS_BITRATE_MAX) {
+        max_bytes = 0;
+    } else if(u->vbr) {
+        max_bytes = MAX_CUSTOM_PACKET;
+    } else {
+        max_bytes = (lua_Integer)u->bitrate * u->frame_size / u->Fs / 8;
+        if(max_bytes < 1) max_bytes = 1;
+        if(max_bytes > MAX_CUSTOM_PACKET) max_bytes = MAX_CUSTOM_PACKET;
+    }
+
+    frame_bytes = (is_float ? sizeof(float) : sizeof(opus_int16)) * u->channels;
+    if(len == 0 || len % frame_bytes != 0 || len / frame_bytes > (size_t)u->frame_size
+      || max_bytes < 1 || max_bytes > MAX_CUSTOM_PACKET) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_BAD_ARG);
+        return 2;
+    }
+
+    /* lua strings are aligned for any type, so the
+     * samples go to the encoder without a copy */
+    if(is_float) {
+        bytes = opus_custom_encode_float(u->custom_encoder,
+          (const float *)pcm,
+          (int)(len / frame_bytes),
+          u->buffer,
+          (int)max_bytes);
+    } else {
+        bytes = opus_custom_encode(u->custom_encoder,
+          (const opus_int16 *)pcm,
+          (int)(len / frame_bytes),
+          u->buffer,
+          (int)max_bytes);
+    }
+
+    if(bytes < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L,bytes);
+        return 2;
+    }
+
+    lua_pushlstring(L,(const char *)u->buffer,bytes);
+    return 1;
+}
+
+static int
+luaopus_custom_encode(lua_State *L) {
+    return luaopus_custom_encode_packed(L,0);
+}
+
+static int
+luaopus_custom_encode_float(lua_State *L) {
+    return luaopus_custom_encode_packed(L,1);
+}
+
+/* returns one frame as a string of interleaved native-endian
+ * samples. a nil packet is a lost one, and gets concealed */
+static int
+luaopus_custom_decode_packed(lua_State *L, int is_float) {
+    luaopus_custom_decoder *u = NULL;
+    const unsigned char *data = NULL;
+    size_t len = 0;
+    int samples = 0;
+
+    u = luaL_checkudata(L,1,luaopus_custom_decoder_mt);
+    if(!lua_isnoneornil(L,2)) {
+        data = (const unsigned char *)luaL_checklstring(L,2,&len);
+        if(len == 0) {
+            data = NULL;
+        }
+    }
+
+    if(is_float) {
+        samples = opus_custom_decode_float(u->custom_decoder,
+          data,
+          (int)len,
+          u->pcm_float,
+          u->frame_size);
+    } else {
+        samples = opus_custom_decode(u->custom_decoder,
+          data,
+          (int)len,
+          u->pcm_int16,
+          u->frame_size);
+    }
+
+    if(samples < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L,samples);
+        return 2;
+    }
+
+    lua_pushlstring(L,(const char *)u->pcm_float,
+      (size_t)samples * u->channels * (is_float ? sizeof(float) : sizeof(opus_int16)));
+    return 1;
+}
+
+static int
+luaopus_custom_decode(lua_State *L) {
+    return luaopus_custom_decode_packed(L,0);
+}
+
+static int
+luaopus_custom_decode_float(lua_State *L) {
+    return luaopus_custom_decode_packed(L,1);
+}
+
+#define LUAOPUS_CUSTOM_ENCODER_SET_INTEGER(f) LUAOPUS_CTL_SET_INTEGER(custom_encoder,f)
+#define LUAOPUS_CUSTOM_ENCODER_GET_INTEGER(f) LUAOPUS_CTL_GET_INTEGER(custom_encoder,f)
+#define LUAOPUS_CUSTOM_ENCODER_GET_UINTEGER(f) LUAOPUS_CTL_GET_UINTEGER(custom_encoder,f)
+#define LUAOPUS_CUSTOM_ENCODER_SET_BOOLEAN(f) LUAOPUS_CTL_SET_BOOLEAN(custom_encoder,f)
+#define LUAOPUS_CUSTOM_ENCODER_GET_BOOLEAN(f) LUAOPUS_CTL_GET_BOOLEAN(custom_encoder,f)
+#define LUAOPUS_CUSTOM_DECODER_GET_INTEGER(f) LUAOPUS_CTL_GET_INTEGER(custom_decoder,f)
+#define LUAOPUS_CUSTOM_DECODER_GET_UINTEGER(f) LUAOPUS_CTL_GET_UINTEGER(custom_decoder,f)
+#define LUAOPUS_CUSTOM_DECODER_SET_BOOLEAN(f) LUAOPUS_CTL_SET_BOOLEAN(custom_decoder,f)
+#define LUAOPUS_CUSTOM_DECODER_GET_BOOLEAN(f) LUAOPUS_CTL_GET_BOOLEAN(custom_decoder,f)
+
+#define ctl_set(t,f) "opus_custom_" t "_ctl_set_" f
+#define ctl_get(t,f) "opus_custom_" t "_ctl_get_" f
+#define ENC_SET(f) luaopus_custom_encoder_ctl_set_ ## f
+#define ENC_GET(f) luaopus_custom_encoder_ctl_get_ ## f
+#define DEC_SET(f) luaopus_custom_decoder_ctl_set_ ## f
+#define DEC_GET(f) luaopus_custom_decoder_ctl_get_ ## f
+
+#define ctl_get_short(t,f) { "opus_custom_" t "_ctl_get_" f , "get_" f }
+#define ctl_set_short(t,f) { "opus_custom_" t "_ctl_set_" f , "set_" f }
+
+/* the CELT ctls, most of them can only be set */
+LUAOPUS_CTL_RESET_STATE(custom_encoder)
+LUAOPUS_CUSTOM_ENCODER_SET_INTEGER(COMPLEXITY)
+
+/* bitrate and vbr are kept for the max_bytes default */
+static int
+luaopus_custom_encoder_ctl_set_BITRATE(lua_State *L) {
+    luaopus_custom_encoder *u = NULL;
+    opus_int32 x = 0;
+    int err = 0;
+
+    u = luaL_checkudata(L,1,luaopus_custom_encoder_mt);
+    x = lua_tointeger(L,2);
+    err = opus_custom_encoder_ctl(u->custom_encoder, OPUS_SET_BITRATE(x));
+    if(err < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L,err);
+        return 2;
+    }
+    /* CELT caps it the same way */
+    if(x != OPUS_BITRATE_MAX && x > 260000 * u->channels) {
+        x = 260000 * u->channels;
+    }
+    u->bitrate = x;
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luaopus_custom_encoder_ctl_set_VBR(lua_State *L) {
+    luaopus_custom_encoder *u = NULL;
+    opus_int32 x = 0;
+    int err = 0;
+
+    u = luaL_checkudata(L,1,luaopus_custom_encoder_mt);
+    x = lua_toboolean(L,2);
+    err = opus_custom_encoder_ctl(u->custom_encoder, OPUS_SET_VBR(x));
+    if(err < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L,err);
+        return 2;
+    }
+    u->vbr = x;
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+LUAOPUS_CUSTOM_ENCODER_SET_BOOLEAN(VBR_CONSTRAINT)
+LUAOPUS_CUSTOM_ENCODER_SET_INTEGER(PACKET_LOSS_PERC)
+LUAOPUS_CUSTOM_ENCODER_SET_INTEGER(LSB_DEPTH)
+LUAOPUS_CUSTOM_ENCODER_GET_INTEGER(LSB_DEPTH)
+LUAOPUS_CUSTOM_ENCODER_GET_UINTEGER(FINAL_RANGE)
+#ifdef OPUS_SET_PHASE_INVERSION_DISABLED
+LUAOPUS_CUSTOM_ENCODER_SET_BOOLEAN(PHASE_INVERSION_DISABLED)
+LUAOPUS_CUSTOM_ENCODER_GET_BOOLEAN(PHASE_INVERSION_DISABLED)
+#endif
+
+LUAOPUS_CTL_RESET_STATE(custom_decoder)
+LUAOPUS_CUSTOM_DECODER_GET_INTEGER(LOOKAHEAD)
+LUAOPUS_CUSTOM_DECODER_GET_INTEGER(PITCH)
+LUAOPUS_CUSTOM_DECODER_GET_UINTEGER(FINAL_RANGE)
+#ifdef OPUS_SET_PHASE_INVERSION_DISABLED
+LUAOPUS_CUSTOM_DECODER_SET_BOOLEAN(PHASE_INVERSION_DISABLED)
+LUAOPUS_CUSTOM_DECODER_GET_BOOLEAN(PHASE_INVERSION_DISABLED)
+#endif
+
+static const struct luaL_Reg luaopus_custom_functions[] = {
+    { "OpusCustomMode", luaopus_OpusCustomMode },
+    { "OpusCustomEncoder", luaopus_OpusCustomEncoder },
+    { "OpusCustomDecoder", luaopus_OpusCustomDecoder },
+    { "opus_custom_mode_get_samplerate", luaopus_custom_mode_get_samplerate },
+    { "opus_custom_mode_get_frame_size", luaopus_custom_mode_get_frame_size },
+    { "opus_custom_encoder_init", luaopus_custom_encoder_init },
+    { "opus_custom_encode", luaopus_custom_encode },
+    { "opus_custom_encode_float", luaopus_custom_encode_float },
+    { "opus_custom_decoder_init", luaopus_custom_decoder_init },
+    { "opus_custom_decode", luaopus_custom_decode },
+    { "opus_custom_decode_float", luaopus_custom_decode_float },
+    { "opus_custom_encoder_ctl_reset_state", luaopus_custom_encoder_ctl_reset_state },
+    { "opus_custom_decoder_ctl_reset_state", luaopus_custom_decoder_ctl_reset_state },
+    { NULL, NULL },
+};
+
+static const struct luaL_Reg luaopus_custom_encoder_ctl_functions[] = {
+    { ctl_set("encoder","bitrate"), ENC_SET(BITRATE) },
+    { ctl_set("encoder","complexity"), ENC_SET(COMPLEXITY) },
+    { ctl_set("encoder","vbr"), ENC_SET(VBR) },
+    { ctl_set("encoder","vbr_constraint"), ENC_SET(VBR_CONSTRAINT) },
+    { ctl_set("encoder","packet_loss_perc"), ENC_SET(PACKET_LOSS_PERC) },
+    { ctl_set("encoder","lsb_depth"), ENC_SET(LSB_DEPTH) },
+    { ctl_get("encoder","lsb_depth"), ENC_GET(LSB_DEPTH) },
+    { ctl_get("encoder","final_range"), ENC_GET(FINAL_RANGE) },
+#ifdef OPUS_SET_PHASE_INVERSION_DISABLED
+    { ctl_set("encoder","phase_inversion_disabled"), ENC_SET(PHASE_INVERSION_DISABLED) },
+    { ctl_get("encoder","phase_inversion_disabled"), ENC_GET(PHASE_INVERSION_DISABLED) },
+#endif
+    { NULL, NULL },
+};
+
+static const struct luaL_Reg luaopus_custom_decoder_ctl_functions[] = {
+    { ctl_get("decoder","lookahead"), DEC_GET(LOOKAHEAD) },
+    { ctl_get("decoder","pitch"), DEC_GET(PITCH) },
+    { ctl_get("decoder","final_range"), DEC_GET(FINAL_RANGE) },
+#ifdef OPUS_SET_PHASE_INVERSION_DISABLED
+    { ctl_set("decoder","phase_inversion_disabled"), DEC_SET(PHASE_INVERSION_DISABLED) },
+    { ctl_get("decoder","phase_inversion_disabled"), DEC_GET(PHASE_INVERSION_DISABLED) },
+#endif
+    { NULL, NULL },
+};
+
+static const luaopus_metamethods luaopus_custom_mode_metamethods[] = {
+    { "opus_custom_mode_get_samplerate", "get_samplerate" },
+    { "opus_custom_mode_get_frame_size", "get_frame_size" },
+    { NULL, NULL },
+};
+
+static const luaopus_metamethods luaopus_custom_encoder_metamethods[] = {
+    { "opus_custom_encoder_init", "init" },
+    { "opus_custom_encode", "encode" },
+    { "opus_custom_encode_float", "encode_float" },
+    { "opus_custom_encoder_ctl_reset_state", "reset_state" },
+    { NULL, NULL },
+};
+
+static const luaopus_metamethods luaopus_custom_decoder_metamethods[] = {
+    { "opus_custom_decoder_init", "init" },
+    { "opus_custom_decode", "decode" },
+    { "opus_custom_decode_float", "decode_float" },
+    { "opus_custom_decoder_ctl_reset_state", "reset_state" },
+    { NULL, NULL },
+};
+
+static const luaopus_metamethods luaopus_custom_encoder_ctl_metamethods[] = {
+    ctl_set_short("encoder","bitrate"),
+    ctl_set_short("encoder","complexity"),
+    ctl_set_short("encoder","vbr"),
+    ctl_set_short("encoder","vbr_constraint"),
+    ctl_set_short("encoder","packet_loss_perc"),
+    ctl_set_short("encoder","lsb_depth"),
+    ctl_get_short("encoder","lsb_depth"),
+    ctl_get_short("encoder","final_range"),
+    ctl_set_short("encoder","phase_inversion_disabled"),
+    ctl_get_short("encoder","phase_inversion_disabled"),
+    { NULL, NULL },
+};
+
+static const luaopus_metamethods luaopus_custom_decoder_ctl_metamethods[] = {
+    ctl_get_short("decoder","lookahead"),
+    ctl_get_short("decoder","pitch"),
+    ctl_get_short("decoder","final_range"),
+    ctl_set_short("decoder","phase_inversion_disabled"),
+    ctl_get_short("decoder","phase_inversion_disabled"),
+    { NULL, NULL },
+};
+
+const luaopus_lazy luaopus_custom_encoder_ctl = {
+    luaopus_custom_encoder_ctl_functions,
+    NULL,
+};
+
+const luaopus_lazy luaopus_custom_decoder_ctl = {
+    luaopus_custom_decoder_ctl_functions,
+    NULL,
+};
+
+static const luaopus_lazy luaopus_custom_encoder_ctl_methods = {
+    luaopus_custom_encoder_ctl_functions,
+    luaopus_custom_encoder_ctl_metamethods,
+};
+
+static const luaopus_lazy luaopus_custom_decoder_ctl_methods = {
+    luaopus_custom_decoder_ctl_functions,
+    luaopus_custom_decoder_ctl_metamethods,
+};
+
+/* sets up the metatable for one of the three types, the
+ * module table is just below where it's being built */
+static void
+luaopus_custom_metatable(lua_State *L, const char *mt, lua_CFunction gc, const luaopus_metamethods *m, const luaopus_lazy *ctl) {
+    const luaopus_lazy * lazy[1];
+
+    lazy[0] = ctl;
+    if(luaL_newmetatable(L,mt)) {
+        lua_pushcclosure(L,gc,0);
+        lua_setfield(L,-2,"__gc");
+
+        lua_newtable(L);
+        while(m->name != NULL) {
+            lua_getfield(L,-3,m->name);
+            lua_setfield(L,-2,m->metaname);
+            m++;
+        }
+        if(ctl != NULL) {
+            luaopus_lazy_attach(L,lazy,1);
+        }
+
+        lua_setfield(L,-2,"__index");
+    }
+    lua_pop(L,1);
+}
+
+LUAOPUS_PRIVATE
+void luaopus_custom_register(lua_State *L) {
+    luaL_setfuncs(L,luaopus_custom_functions,0);
+
+    luaopus_custom_metatable(L,luaopus_custom_mode_mt,
+      luaopus_OpusCustomMode_delete,
+      luaopus_custom_mode_metamethods,
+      NULL);
+    luaopus_custom_metatable(L,luaopus_custom_encoder_mt,
+      luaopus_OpusCustomEncoder_delete,
+      luaopus_custom_encoder_metamethods,
+      &luaopus_custom_encoder_ctl_methods);
+    luaopus_custom_metatable(L,luaopus_custom_decoder_mt,
+      luaopus_OpusCustomDecoder_delete,
+      luaopus_custom_decoder_metamethods,
+      &luaopus_custom_decoder_ctl_methods);
+}
+
+#else
+
+/* libopus without custom modes, there's nothing to add */
+static const struct luaL_Reg luaopus_custom_none[] = {
+    { NULL, NULL },
+};
+
+const luaopus_lazy luaopus_custom_encoder_ctl = {
+    luaopus_custom_none,
+    NULL,
+};
+
+const luaopus_lazy luaopus_custom_decoder_ctl = {
+    luaopus_custom_none,
+    NULL,
+};
+
+LUAOPUS_PRIVATE
+void luaopus_custom_register(lua_State *L) {
+    (void)L;
+}
+
+#endif
+
+LUAOPUS_PUBLIC
+int luaopen_luaopus_custom(lua_State *L) {
+    static const luaopus_lazy * const lazy[] = {
+        &luaopus_custom_encoder_ctl,
+        &luaopus_custom_decoder_ctl,
+    };
+
+    lua_newtable(L);
+    luaopus_custom_register(L);
+    luaopus_lazy_attach(L,lazy,2);
+    return 1;
+}
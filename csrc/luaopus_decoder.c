@@ -1,63 +1,59 @@
 #include "luaopus_internal.h"
 #include <opus/opus.h>
 #include <assert.h>
+#include <string.h>
 
-/* max sample rate: 48000
- * max channels: 2
- * max ms: 120ms
- * (5760 frames for 48kHz)
- * I think this may be overkill, that there's some limitation
- * around sample rate for packets >60ms? */
-#define MAX_SAMPLES 5760 * 2
+/* most samples per channel we'll ask for,
+ * a channel map can double this up to LUAOPUS_MAX_SAMPLES */
+#define MAX_FRAME_SIZE 5760
 
 const char * const luaopus_decoder_mt = "OpusDecoder";
 
-struct luaopus_decoder_s {
-    OpusDecoder *decoder;
-
-    /* buffer for storing audio samples from Opus
-     * before sending to Lua
-     * using float storage since that can
-     * also encapsulate int16 */
-    float pcm_float[MAX_SAMPLES];
-
-    /* will point to pcm_float, so we use the same memory
-     * area for floats and ints */
-    opus_int16 *pcm_int16;
-    int channels;
-
-    /* stores a reference to the decoder userdata so it doesn't get
-     * garbage-collected */
-    int decoder_ref;
-};
-
-typedef struct luaopus_decoder_s luaopus_decoder;
-
-static int
-luaopus_OpusDecoder(lua_State *L) {
+/* leaves the new decoder on the stack */
+LUAOPUS_PRIVATE
+luaopus_decoder *luaopus_decoder_new(lua_State *L) {
     luaopus_decoder *u = NULL;
+    unsigned char *block = NULL;
+    size_t state_size = 0;
 
     u = lua_newuserdata(L,sizeof(luaopus_decoder));
     if(u == NULL) {
-        return luaL_error(L,"out of memory");
+        luaL_error(L,"out of memory");
+        return NULL;
     }
+    u->mem.ptr = NULL;
 
-    /* get a table to associate decoder reference with */
+    /* table for anything attached to the decoder */
     lua_newtable(L);
+    lua_setuservalue(L,-2);
 
     /* max channels for an decoder is 2 */
     /* we'll just always allocate the max */
-    u->decoder = lua_newuserdata(L,opus_decoder_get_size(2));
-    if(u->decoder == NULL) {
-        return luaL_error(L,"out of memory");
+    state_size = LUAOPUS_MEM_ALIGN(opus_decoder_get_size(2));
+    block = luaopus_mem_alloc(L,&u->mem,LUAOPUS_MEM_DECODER,
+      state_size + (sizeof(float) * LUAOPUS_MAX_SAMPLES));
+    if(block == NULL) {
+        luaL_error(L,"out of memory");
+        return NULL;
     }
-    u->decoder_ref = luaL_ref(L,-2);
 
+    u->decoder = (OpusDecoder *)block;
+    u->pcm_float = (float *)(block + state_size);
     u->pcm_int16 = (opus_int16 *)u->pcm_float;
-
-    lua_setuservalue(L,-2);
+    u->Fs = 0;
+    u->channels = 0;
+    u->map.in_channels = 0;
+    u->meter = NULL;
+    u->trim_skip = 0;
+    u->trim_left = -1;
 
     luaL_setmetatable(L,luaopus_decoder_mt);
+    return u;
+}
+
+static int
+luaopus_OpusDecoder(lua_State *L) {
+    luaopus_decoder_new(L);
     return 1;
 }
 
@@ -66,15 +62,83 @@ luaopus_OpusDecoder_delete(lua_State *L) {
     luaopus_decoder *u = NULL;
 
     u = luaL_checkudata(L,1,luaopus_decoder_mt);
-    lua_getuservalue(L,1);
+    luaopus_mem_free(&u->mem);
+    u->decoder = NULL;
+
+    return 0;
+}
+
+/* detaches any stages, idx is the decoder's
+ * absolute stack index */
+LUAOPUS_PRIVATE
+void luaopus_decoder_clear(lua_State *L, int idx, luaopus_decoder *u) {
+    u->map.in_channels = 0;
+    u->meter = NULL;
+    u->trim_skip = 0;
+    u->trim_left = -1;
+
+    lua_getuservalue(L,idx);
+    lua_pushnil(L);
+    lua_setfield(L,-2,"meter");
+    lua_pop(L,1);
+}
+
+/* (re)initializes the codec and clears any attached stages */
+LUAOPUS_PRIVATE
+int luaopus_decoder_setup(lua_State *L, int idx, luaopus_decoder *u, opus_int32 Fs, int channels) {
+    int result = 0;
+
+    result = opus_decoder_init(u->decoder,Fs,channels);
+    if(result != OPUS_OK) {
+        return result;
+    }
+
+    u->Fs = Fs;
+    u->channels = channels;
+    luaopus_decoder_clear(L,idx,u);
+
+#ifdef OPUS_SET_DNN_BLOB
+    /* init reloads the built-in weights, so a blob set
+     * before is no longer referenced. reset_state keeps it */
+    lua_getuservalue(L,idx);
+    lua_pushnil(L);
+    lua_setfield(L,-2,"dnn_blob");
+    lua_pop(L,1);
+#endif
+    return OPUS_OK;
+}
 
-    if(u->decoder_ref != LUA_NOREF) {
-        luaL_unref(L,-1,u->decoder_ref);
-        u->decoder_ref = LUA_NOREF;
-        u->decoder = NULL;
+LUAOPUS_PRIVATE
+int luaopus_decoder_reset(lua_State *L, int idx, luaopus_decoder *u) {
+    int result = 0;
+
+#ifdef OPUS_SET_DNN_BLOB
+    lua_getuservalue(L,idx);
+    lua_getfield(L,-1,"dnn_blob");
+    result = !lua_isnil(L,-1);
+    lua_pop(L,2);
+    if(result) {
+        return luaopus_decoder_setup(L,idx,u,u->Fs,u->channels);
     }
+#endif
 
-    return 0;
+    result = opus_decoder_ctl(u->decoder, OPUS_RESET_STATE);
+    if(result != OPUS_OK) return result;
+
+    /* the ctls a user can change, at their opus_decoder_init values */
+    result = opus_decoder_ctl(u->decoder, OPUS_SET_GAIN(0));
+    if(result != OPUS_OK) return result;
+#ifdef OPUS_SET_PHASE_INVERSION_DISABLED
+    result = opus_decoder_ctl(u->decoder, OPUS_SET_PHASE_INVERSION_DISABLED(0));
+    if(result != OPUS_OK) return result;
+#endif
+#ifdef OPUS_SET_DNN_BLOB
+    result = opus_decoder_ctl(u->decoder, OPUS_SET_COMPLEXITY(0));
+    if(result != OPUS_OK) return result;
+#endif
+
+    luaopus_decoder_clear(L,idx,u);
+    return OPUS_OK;
 }
 
 static int
@@ -87,39 +151,267 @@ luaopus_decoder_init(lua_State *L) {
     u = luaL_checkudata(L,1,luaopus_decoder_mt);
     Fs = luaL_checkinteger(L,2);
     channels = luaL_checkinteger(L,3);
-    result = opus_decoder_init(u->decoder,Fs,channels);
+    result = luaopus_decoder_setup(L,1,u,Fs,channels);
 
     if(result != OPUS_OK) {
         lua_pushnil(L);
         lua_pushinteger(L,result);
         return 2;
     }
-    u->channels = channels;
+
     lua_pushboolean(L,1);
     return 1;
 }
 
+static int
+luaopus_decoder_set_channel_map(lua_State *L) {
+    luaopus_decoder *u = NULL;
+    int result = 0;
+
+    u = luaL_checkudata(L,1,luaopus_decoder_mt);
+    result = luaopus_chanmap_check(L,2,&u->map,u->channels,1);
+
+    if(result != OPUS_OK) {
+        lua_pushnil(L);
+        lua_pushinteger(L,result);
+        return 2;
+    }
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+/* number of interleaved channels we hand back to the caller */
+LUAOPUS_PRIVATE
+int luaopus_decoder_output_channels(const luaopus_decoder *u) {
+    return u->map.in_channels ? u->map.out_channels : u->channels;
+}
+
+static int
+luaopus_decoder_set_meter(lua_State *L) {
+    luaopus_decoder *u = NULL;
+    luaopus_meter *m = NULL;
+
+    lua_settop(L,2);
+    u = luaL_checkudata(L,1,luaopus_decoder_mt);
+    if(!lua_isnil(L,2)) {
+        m = luaL_checkudata(L,2,luaopus_meter_mt);
+        if(m->Fs != u->Fs || m->channels != luaopus_decoder_output_channels(u)) {
+            lua_pushnil(L);
+            lua_pushinteger(L,OPUS_BAD_ARG);
+            return 2;
+        }
+    }
+
+    lua_getuservalue(L,1);
+    lua_pushvalue(L,2);
+    lua_setfield(L,-2,"meter");
+    lua_pop(L,1);
+
+    u->meter = m;
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+/* pre_skip and length are in 48kHz samples, like an Ogg Opus
+ * header and granule positions. length is how much audio follows
+ * the pre-skip, or nil to keep everything */
+static int
+luaopus_decoder_set_trim(lua_State *L) {
+    luaopus_decoder *u = NULL;
+    lua_Number pre_skip = 0;
+    lua_Number length = -1;
+
+    u = luaL_checkudata(L,1,luaopus_decoder_mt);
+    pre_skip = luaL_checknumber(L,2);
+    if(!lua_isnoneornil(L,3)) {
+        length = luaL_checknumber(L,3);
+        /* written so NaN fails too; the cap keeps length * Fs
+         * inside an opus_int64 at any sample rate */
+        if(!(length >= 0 && length <= 192153584101141.0)) {
+            lua_pushnil(L);
+            lua_pushinteger(L,OPUS_BAD_ARG);
+            return 2;
+        }
+    }
+
+    if(u->Fs == 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_INVALID_STATE);
+        return 2;
+    }
+    if(!(pre_skip >= 0 && pre_skip <= 2147483647.0)) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_BAD_ARG);
+        return 2;
+    }
+
+    u->trim_skip = (opus_int32)(((opus_int64)pre_skip * u->Fs) / 48000);
+    u->trim_left = length < 0 ? -1 : ((opus_int64)length * u->Fs) / 48000;
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+/* how many of samples survive the trim, and how
+ * many come off the front */
+static int
+luaopus_decoder_trim_count(const luaopus_decoder *u, int samples, int *skip) {
+    *skip = samples < u->trim_skip ? samples : u->trim_skip;
+    samples -= *skip;
+    if(u->trim_left >= 0 && samples > u->trim_left) {
+        samples = (int)u->trim_left;
+    }
+    return samples;
+}
+
+/* drops trimmed samples from pcm_int16/pcm_float, moving
+ * what's left to the front. returns samples per channel */
+static int
+luaopus_decoder_trim(luaopus_decoder *u, int samples, int is_float) {
+    size_t frame_bytes = 0;
+    int skip = 0;
+    int keep = 0;
+
+    keep = luaopus_decoder_trim_count(u,samples,&skip);
+    u->trim_skip -= skip;
+    if(u->trim_left >= 0) u->trim_left -= keep;
+
+    if(skip > 0 && keep > 0) {
+        frame_bytes = (is_float ? sizeof(float) : sizeof(opus_int16)) * u->channels;
+        memmove(u->pcm_float,(unsigned char *)u->pcm_float + (frame_bytes * skip),frame_bytes * keep);
+    }
+
+    return keep;
+}
+
+/* runs freshly decoded samples through the trim, channel
+ * map and meter, returns what's left per channel */
+static int
+luaopus_decoder_stages(luaopus_decoder *u, int samples, int is_float) {
+    if(u->trim_skip > 0 || u->trim_left >= 0) {
+        samples = luaopus_decoder_trim(u,samples,is_float);
+    }
+
+    if(u->map.in_channels) {
+        if(is_float) {
+            luaopus_chanmap_float(&u->map,u->pcm_float,samples);
+        } else {
+            luaopus_chanmap_int16(&u->map,u->pcm_int16,samples);
+        }
+    }
+
+    if(u->meter != NULL && u->meter->channels == luaopus_decoder_output_channels(u)) {
+        if(is_float) {
+            luaopus_meter_float(u->meter,u->pcm_float,samples);
+        } else {
+            luaopus_meter_int16(u->meter,u->pcm_int16,samples);
+        }
+    }
+
+    return samples;
+}
+
+/* decodes a packet into pcm_int16/pcm_float and runs the
+ * result through any attached stages. frame_size only matters
+ * for lost packets and FEC, where it sets how much to produce.
+ * returns the number of samples per channel, or an opus error code */
+LUAOPUS_PRIVATE
+int luaopus_decoder_packet(luaopus_decoder *u, const unsigned char *data, opus_int32 len, int frame_size, int decode_fec, int is_float) {
+    int samples = 0;
+
+    if(is_float) {
+        samples = opus_decode_float(u->decoder,
+          data,
+          len,
+          u->pcm_float,
+          frame_size,
+          decode_fec);
+    } else {
+        samples = opus_decode(u->decoder,
+          data,
+          len,
+          u->pcm_int16,
+          frame_size,
+          decode_fec);
+    }
+
+    if(samples < 0) {
+        return samples;
+    }
+
+    return luaopus_decoder_stages(u,samples,is_float);
+}
+
+#ifdef OPUS_SET_DRED_DURATION
+/* like luaopus_decoder_packet, but recovers frame_size samples
+ * ending offset samples before the packet dred was parsed from */
+LUAOPUS_PRIVATE
+int luaopus_decoder_dred(luaopus_decoder *u, const OpusDRED *dred, opus_int32 offset, int frame_size, int is_float) {
+    int samples = 0;
+
+    if(is_float) {
+        samples = opus_decoder_dred_decode_float(u->decoder,
+          dred,
+          offset,
+          u->pcm_float,
+          frame_size);
+    } else {
+        samples = opus_decoder_dred_decode(u->decoder,
+          dred,
+          offset,
+          u->pcm_int16,
+          frame_size);
+    }
+
+    if(samples < 0) {
+        return samples;
+    }
+
+    return luaopus_decoder_stages(u,samples,is_float);
+}
+#endif
+
+/* reads (packet, decode_fec, frame_size) from stack index 2.
+ * a nil or empty packet is a lost one. returns the frame size,
+ * or OPUS_BAD_ARG */
+static int
+luaopus_decode_args(lua_State *L, const unsigned char **data, size_t *len, int *decode_fec) {
+    lua_Integer frame_size = MAX_FRAME_SIZE;
+
+    *data = (const unsigned char *)luaL_optlstring(L,2,NULL,len);
+    if(*len == 0) *data = NULL;
+    if(lua_isboolean(L,3)) {
+        *decode_fec = lua_toboolean(L,3);
+    }
+    if(!lua_isnoneornil(L,4)) {
+        frame_size = luaL_checkinteger(L,4);
+        if(frame_size <= 0 || frame_size > MAX_FRAME_SIZE) {
+            return OPUS_BAD_ARG;
+        }
+    }
+
+    return (int)frame_size;
+}
+
 static int
 luaopus_decode(lua_State *L) {
     luaopus_decoder *u = NULL;
     const unsigned char *data = NULL;
     size_t len = 0;
     int decode_fec = 0;
+    int frame_size = 0;
     int samples = 0;
     int i = 0;
 
     u = luaL_checkudata(L,1,luaopus_decoder_mt);
-    data = (const unsigned char *)luaL_checklstring(L,2,&len);
-    if(lua_isboolean(L,3)) {
-        decode_fec = lua_toboolean(L,3);
+    frame_size = luaopus_decode_args(L,&data,&len,&decode_fec);
+    if(frame_size < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L,frame_size);
+        return 2;
     }
 
-    samples = opus_decode(u->decoder,
-      data,
-      (opus_int32)len,
-      u->pcm_int16,
-      MAX_SAMPLES,
-      decode_fec);
+    samples = luaopus_decoder_packet(u,data,(opus_int32)len,frame_size,decode_fec,0);
 
     if(samples < 0) {
         lua_pushnil(L);
@@ -127,7 +419,7 @@ luaopus_decode(lua_State *L) {
         return 2;
     }
 
-    samples *= u->channels;
+    samples *= luaopus_decoder_output_channels(u);
 
     lua_createtable(L, samples,  0);
     while(i<samples) {
@@ -144,21 +436,19 @@ luaopus_decode_float(lua_State *L) {
     const unsigned char *data = NULL;
     size_t len = 0;
     int decode_fec = 0;
+    int frame_size = 0;
     int samples = 0;
     int i = 0;
 
     u = luaL_checkudata(L,1,luaopus_decoder_mt);
-    data = (const unsigned char *)luaL_checklstring(L,2,&len);
-    if(lua_isboolean(L,3)) {
-        decode_fec = lua_toboolean(L,3);
+    frame_size = luaopus_decode_args(L,&data,&len,&decode_fec);
+    if(frame_size < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L,frame_size);
+        return 2;
     }
 
-    samples = opus_decode_float(u->decoder,
-      data,
-      (opus_int32)len,
-      u->pcm_float,
-      MAX_SAMPLES,
-      decode_fec);
+    samples = luaopus_decoder_packet(u,data,(opus_int32)len,frame_size,decode_fec,1);
 
     if(samples < 0) {
         lua_pushnil(L);
@@ -166,7 +456,7 @@ luaopus_decode_float(lua_State *L) {
         return 2;
     }
 
-    samples *= u->channels;
+    samples *= luaopus_decoder_output_channels(u);
 
     lua_createtable(L, samples,  0);
     while(i<samples) {
@@ -177,6 +467,101 @@ luaopus_decode_float(lua_State *L) {
     return 1;
 }
 
+/* a packet split with opus_packet_parse, the frames
+ * point into the packet string held next to it */
+typedef struct luaopus_decode_frames_s {
+    unsigned char toc;
+    int count;
+    int next;
+    int is_float;
+    const unsigned char *frames[48];
+    opus_int16 sizes[48];
+} luaopus_decode_frames_state;
+
+/* upvalues are the decoder, the packet and the split state. each
+ * frame goes back to libopus as a packet of its own, with the
+ * packet's TOC switched to code 0 (one frame) */
+static int
+luaopus_decode_frames_iter(lua_State *L) {
+    luaopus_decoder *u = NULL;
+    luaopus_decode_frames_state *s = NULL;
+    unsigned char packet[1 + 1275];
+    int samples = 0;
+    int i = 0;
+
+    u = (luaopus_decoder *)lua_touserdata(L,lua_upvalueindex(1));
+    s = (luaopus_decode_frames_state *)lua_touserdata(L,lua_upvalueindex(3));
+
+    if(s->next == s->count) {
+        return 0;
+    }
+
+    packet[0] = s->toc & 0xFC;
+    memcpy(packet + 1,s->frames[s->next],s->sizes[s->next]);
+
+    /* for loops stop at nil, so errors have to be raised */
+    samples = luaopus_decoder_packet(u,packet,1 + s->sizes[s->next],
+      MAX_FRAME_SIZE,0,s->is_float);
+    if(samples < 0) {
+        return luaL_error(L,"OpusDecoder: %s",opus_strerror(samples));
+    }
+    s->next++;
+
+    samples *= luaopus_decoder_output_channels(u);
+
+    lua_createtable(L,samples,0);
+    while(i<samples) {
+        if(s->is_float) {
+            lua_pushnumber(L,u->pcm_float[i]);
+        } else {
+            lua_pushinteger(L,u->pcm_int16[i]);
+        }
+        lua_rawseti(L,-2,++i);
+    }
+
+    return 1;
+}
+
+static int
+luaopus_decode_frames_table(lua_State *L, int is_float) {
+    luaopus_decode_frames_state *s = NULL;
+    const unsigned char *data = NULL;
+    size_t len = 0;
+    int count = 0;
+
+    luaL_checkudata(L,1,luaopus_decoder_mt);
+    data = (const unsigned char *)luaL_checklstring(L,2,&len);
+    lua_settop(L,2);
+
+    s = lua_newuserdata(L,sizeof(luaopus_decode_frames_state));
+    if(s == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+
+    count = opus_packet_parse(data,(opus_int32)len,&s->toc,s->frames,s->sizes,NULL);
+    if(count < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L,count);
+        return 2;
+    }
+    s->count = count;
+    s->next = 0;
+    s->is_float = is_float;
+
+    lua_pushcclosure(L,luaopus_decode_frames_iter,3);
+    return 1;
+}
+
+static int
+luaopus_decode_frames(lua_State *L) {
+    return luaopus_decode_frames_table(L,0);
+}
+
+static int
+luaopus_decode_frames_float(lua_State *L) {
+    return luaopus_decode_frames_table(L,1);
+}
+
 static int
 luaopus_packet_get_bandwidth(lua_State *L) {
     const unsigned char *data = NULL;
@@ -264,6 +649,7 @@ luaopus_decoder_get_nb_samples(lua_State *L) {
     luaopus_decoder *u = NULL;
     const unsigned char *data = NULL;
     size_t datalen = 0;
+    int skip = 0;
     int r = 0;
 
     u = luaL_checkudata(L,1,luaopus_decoder_mt);
@@ -275,10 +661,10 @@ luaopus_decoder_get_nb_samples(lua_State *L) {
         lua_pushinteger(L,r);
         return 2;
     }
+    /* what decoding it would hand back, after trimming */
+    r = luaopus_decoder_trim_count(u,r,&skip);
     lua_pushinteger(L,r);
     return 1;
-
-    return 1;
 }
 
 /* this didn't appear until opus 1.1, may fail if compiling against
@@ -357,6 +743,13 @@ LUAOPUS_DECODER_GET_BOOLEAN(PHASE_INVERSION_DISABLED)
 LUAOPUS_DECODER_GET_BOOLEAN(IN_DTX)
 #endif
 
+/* decoder complexity arrived with the neural PLC in opus >= 1.5,
+ * 5 and up turns on deep PLC, 7 and up the OSCE enhancement */
+#ifdef OPUS_SET_DNN_BLOB
+LUAOPUS_DECODER_SET_INTEGER(COMPLEXITY)
+LUAOPUS_DECODER_GET_INTEGER(COMPLEXITY)
+#endif
+
 LUAOPUS_DECODER_SET_INTEGER(GAIN)
 LUAOPUS_DECODER_GET_INTEGER(GAIN)
 LUAOPUS_DECODER_GET_INTEGER(LAST_PACKET_DURATION)
@@ -367,6 +760,24 @@ static const struct luaL_Reg luaopus_decoder_functions[] = {
     { "opus_decoder_init", luaopus_decoder_init },
     { "opus_decode", luaopus_decode },
     { "opus_decode_float", luaopus_decode_float },
+    { "opus_decode_frames", luaopus_decode_frames },
+    { "opus_decode_frames_float", luaopus_decode_frames_float },
+    { "opus_decode_to_file", luaopus_decode_to_file },
+    { "opus_decode_float_to_file", luaopus_decode_float_to_file },
+    { "opus_decode_to_fd", luaopus_decode_to_fd },
+    { "opus_decode_float_to_fd", luaopus_decode_float_to_fd },
+    { "opus_decoder_set_channel_map", luaopus_decoder_set_channel_map },
+    { "opus_decoder_set_meter", luaopus_decoder_set_meter },
+    { "opus_decoder_set_trim", luaopus_decoder_set_trim },
+    { "opus_decoder_serialize", luaopus_decoder_serialize },
+    { "opus_decoder_restore", luaopus_decoder_restore },
+#ifdef OPUS_SET_DNN_BLOB
+    { "opus_decoder_set_dnn_blob", luaopus_decoder_set_dnn_blob },
+#endif
+#ifdef OPUS_SET_DRED_DURATION
+    { "opus_decoder_dred_decode", luaopus_decoder_dred_decode },
+    { "opus_decoder_dred_decode_float", luaopus_decoder_dred_decode_float },
+#endif
     { "opus_decoder_ctl_reset_state", luaopus_decoder_ctl_reset_state },
     { "opus_packet_get_bandwidth", luaopus_packet_get_bandwidth },
     { "opus_packet_get_samples_per_frame", luaopus_packet_get_samples_per_frame },
@@ -375,6 +786,10 @@ static const struct luaL_Reg luaopus_decoder_functions[] = {
     { "opus_packet_get_nb_samples", luaopus_packet_get_nb_samples },
     { "opus_decoder_get_nb_samples", luaopus_decoder_get_nb_samples },
     { "opus_pcm_soft_clip", luaopus_pcm_soft_clip },
+    { NULL, NULL },
+};
+
+static const struct luaL_Reg luaopus_decoder_ctl_functions[] = {
     { ctl_get("final_range"), CTL_GET(FINAL_RANGE) },
     { ctl_get("bandwdth"), CTL_GET(BANDWIDTH) },
     { ctl_get("samplerate"), CTL_GET(SAMPLE_RATE) },
@@ -386,6 +801,10 @@ static const struct luaL_Reg luaopus_decoder_functions[] = {
 #endif
 #ifdef OPUS_GET_IN_DTX
     { ctl_get("in_dtx"), CTL_GET(IN_DTX) },
+#endif
+#ifdef OPUS_SET_DNN_BLOB
+    { ctl_set("complexity"), CTL_SET(COMPLEXITY) },
+    { ctl_get("complexity"), CTL_GET(COMPLEXITY) },
 #endif
     { ctl_get("gain"), CTL_GET(GAIN) },
     { ctl_set("gain"), CTL_SET(GAIN) },
@@ -398,13 +817,33 @@ static const luaopus_metamethods luaopus_decoder_metamethods[] = {
     { "opus_decoder_init", "init" },
     { "opus_decode", "decode" },
     { "opus_decode_float", "decode_float" },
-    { "opus_deocder_get_nb_samples", "get_nb_samples" },
+    { "opus_decode_frames", "decode_frames" },
+    { "opus_decode_frames_float", "decode_frames_float" },
+    { "opus_decode_to_file", "decode_to_file" },
+    { "opus_decode_float_to_file", "decode_float_to_file" },
+    { "opus_decode_to_fd", "decode_to_fd" },
+    { "opus_decode_float_to_fd", "decode_float_to_fd" },
+    { "opus_decoder_get_nb_samples", "get_nb_samples" },
+    { "opus_decoder_set_channel_map", "set_channel_map" },
+    { "opus_decoder_set_meter", "set_meter" },
+    { "opus_decoder_set_trim", "set_trim" },
+    { "opus_decoder_serialize", "serialize" },
+    { "opus_decoder_restore", "restore" },
+    { "opus_decoder_set_dnn_blob", "set_dnn_blob" },
+    { "opus_decoder_dred_decode", "dred_decode" },
+    { "opus_decoder_dred_decode_float", "dred_decode_float" },
+    { NULL, NULL },
+};
+
+static const luaopus_metamethods luaopus_decoder_ctl_metamethods[] = {
     ctl_get_short("final_range"),
     ctl_get_short("bandwdth"),
     ctl_get_short("samplerate"),
     ctl_set_short("phase_inversion_disabled"),
     ctl_get_short("phase_inversion_disabled"),
     ctl_get_short("in_dtx"),
+    ctl_set_short("complexity"),
+    ctl_get_short("complexity"),
     ctl_get_short("gain"),
     ctl_set_short("gain"),
     ctl_get_short("last_packet_duration"),
@@ -412,27 +851,47 @@ static const luaopus_metamethods luaopus_decoder_metamethods[] = {
     { NULL, NULL },
 };
 
-LUAOPUS_PUBLIC
-int luaopen_luaopus_decoder(lua_State *L) {
-    const luaopus_metamethods *m = luaopus_decoder_metamethods;
+const luaopus_lazy luaopus_decoder_ctl = {
+    luaopus_decoder_ctl_functions,
+    NULL,
+};
 
-    lua_newtable(L);
+static const luaopus_lazy luaopus_decoder_ctl_methods = {
+    luaopus_decoder_ctl_functions,
+    luaopus_decoder_ctl_metamethods,
+};
+
+LUAOPUS_PRIVATE
+void luaopus_decoder_register(lua_State *L) {
+    static const luaopus_lazy * const lazy[] = { &luaopus_decoder_ctl_methods };
+    const luaopus_metamethods *m = luaopus_decoder_metamethods;
 
     luaL_setfuncs(L,luaopus_decoder_functions,0);
 
-    luaL_newmetatable(L,luaopus_decoder_mt);
+    /* the metatable is shared by every copy of the module */
+    if(luaL_newmetatable(L,luaopus_decoder_mt)) {
+        lua_pushcclosure(L,luaopus_OpusDecoder_delete,0);
+        lua_setfield(L,-2,"__gc");
 
-    lua_pushcclosure(L,luaopus_OpusDecoder_delete,0);
-    lua_setfield(L,-2,"__gc");
+        lua_newtable(L);
+        while(m->name != NULL) {
+            lua_getfield(L,-3,m->name);
+            lua_setfield(L,-2,m->metaname);
+            m++;
+        }
+        luaopus_lazy_attach(L,lazy,1);
 
-    lua_newtable(L);
-    while(m->name != NULL) {
-        lua_getfield(L,-3,m->name);
-        lua_setfield(L,-2,m->metaname);
-        m++;
+        lua_setfield(L,-2,"__index");
     }
-
-    lua_setfield(L,-2,"__index");
     lua_pop(L,1);
+}
+
+LUAOPUS_PUBLIC
+int luaopen_luaopus_decoder(lua_State *L) {
+    static const luaopus_lazy * const lazy[] = { &luaopus_decoder_ctl };
+
+    lua_newtable(L);
+    luaopus_decoder_register(L);
+    luaopus_lazy_attach(L,lazy,1);
     return 1;
 }
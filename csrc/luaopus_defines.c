@@ -13,10 +13,8 @@ luaopus_get_version_string(lua_State *L) {
     return 1;
 }
 
-LUAOPUS_PUBLIC
-int luaopen_luaopus_defines(lua_State *L) {
-    lua_newtable(L);
-
+LUAOPUS_PRIVATE
+void luaopus_defines_register(lua_State *L) {
 /* defined in opus >= 1.0 */
     luaopus_push_const(OPUS_OK);
     luaopus_push_const(OPUS_BAD_ARG);
@@ -76,6 +74,11 @@ int luaopen_luaopus_defines(lua_State *L) {
 
     lua_pushcclosure(L,luaopus_strerror,0);
     lua_setfield(L,-2,"opus_strerror");
+}
 
+LUAOPUS_PUBLIC
+int luaopen_luaopus_defines(lua_State *L) {
+    lua_newtable(L);
+    luaopus_defines_register(L);
     return 1;
 }
@@ -0,0 +1,371 @@
+#include "luaopus_internal.h"
+#include <opus/opus.h>
+#include <string.h>
+
+/* deep redundancy (DRED) and the neural PLC models arrived in opus
+ * 1.5. the ctls and types are there whenever the headers are, but
+ * unless libopus was built with --enable-dred the calls fail with
+ * OPUS_UNIMPLEMENTED, which we hand back like any other error */
+
+#ifdef OPUS_SET_DNN_BLOB
+/* libopus keeps pointers into the blob rather than copying it,
+ * so the string is held in the object's uservalue table until the
+ * codec is initialized again */
+static int
+luaopus_dnn_blob_keep(lua_State *L, int err) {
+    if(err < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L,err);
+        return 2;
+    }
+
+    lua_getuservalue(L,1);
+    lua_pushvalue(L,2);
+    lua_setfield(L,-2,"dnn_blob");
+    lua_pop(L,1);
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+LUAOPUS_PRIVATE
+int luaopus_encoder_set_dnn_blob(lua_State *L) {
+    luaopus_encoder *u = NULL;
+    void *blob = NULL;
+    size_t len = 0;
+
+    u = luaL_checkudata(L,1,luaopus_encoder_mt);
+    blob = (void *)luaL_checklstring(L,2,&len);
+    return luaopus_dnn_blob_keep(L,
+      opus_encoder_ctl(u->encoder, OPUS_SET_DNN_BLOB(blob,(opus_int32)len)));
+}
+
+LUAOPUS_PRIVATE
+int luaopus_decoder_set_dnn_blob(lua_State *L) {
+    luaopus_decoder *u = NULL;
+    void *blob = NULL;
+    size_t len = 0;
+
+    u = luaL_checkudata(L,1,luaopus_decoder_mt);
+    blob = (void *)luaL_checklstring(L,2,&len);
+    return luaopus_dnn_blob_keep(L,
+      opus_decoder_ctl(u->decoder, OPUS_SET_DNN_BLOB(blob,(opus_int32)len)));
+}
+#endif
+
+#ifdef OPUS_SET_DRED_DURATION
+
+const char * const luaopus_dred_decoder_mt = "OpusDREDDecoder";
+const char * const luaopus_dred_mt = "OpusDRED";
+
+/* most samples per channel we'll recover at once, same as opus_decode */
+#define MAX_FRAME_SIZE 5760
+
+/* runs the DRED model, shared between however many
+ * decoders are recovering from the same stream */
+typedef struct luaopus_dred_decoder_s {
+    luaopus_mem mem;
+    OpusDREDDecoder *dred_decoder;
+} luaopus_dred_decoder;
+
+/* what's in an OpusDRED, libopus doesn't check
+ * before decoding from one */
+#define DRED_EMPTY 0
+#define DRED_DEFERRED 1
+#define DRED_READY 2
+
+/* redundancy parsed out of one packet */
+typedef struct luaopus_dred_s {
+    luaopus_mem mem;
+    OpusDRED *dred;
+    int state;
+} luaopus_dred;
+
+static int
+luaopus_OpusDREDDecoder(lua_State *L) {
+    luaopus_dred_decoder *u = NULL;
+    int size = 0;
+    int err = 0;
+
+    size = opus_dred_decoder_get_size();
+    if(size <= 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_UNIMPLEMENTED);
+        return 2;
+    }
+
+    u = lua_newuserdata(L,sizeof(luaopus_dred_decoder));
+    if(u == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    u->mem.ptr = NULL;
+
+    /* table for the DNN blob, if one's loaded */
+    lua_newtable(L);
+    lua_setuservalue(L,-2);
+    luaL_setmetatable(L,luaopus_dred_decoder_mt);
+
+    u->dred_decoder = luaopus_mem_alloc(L,&u->mem,LUAOPUS_MEM_DECODER,(size_t)size);
+    if(u->dred_decoder == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+
+    err = opus_dred_decoder_init(u->dred_decoder);
+    if(err != OPUS_OK) {
+        lua_pushnil(L);
+        lua_pushinteger(L,err);
+        return 2;
+    }
+
+    return 1;
+}
+
+static int
+luaopus_OpusDREDDecoder_delete(lua_State *L) {
+    luaopus_dred_decoder *u = NULL;
+
+    u = luaL_checkudata(L,1,luaopus_dred_decoder_mt);
+    luaopus_mem_free(&u->mem);
+    u->dred_decoder = NULL;
+
+    return 0;
+}
+
+static int
+luaopus_OpusDRED(lua_State *L) {
+    luaopus_dred *u = NULL;
+    int size = 0;
+
+    size = opus_dred_get_size();
+    if(size <= 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_UNIMPLEMENTED);
+        return 2;
+    }
+
+    u = lua_newuserdata(L,sizeof(luaopus_dred));
+    if(u == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    u->mem.ptr = NULL;
+    u->state = DRED_EMPTY;
+    luaL_setmetatable(L,luaopus_dred_mt);
+
+    u->dred = luaopus_mem_alloc(L,&u->mem,LUAOPUS_MEM_DECODER,(size_t)size);
+    if(u->dred == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    memset(u->dred,0,(size_t)size);
+
+    return 1;
+}
+
+static int
+luaopus_OpusDRED_delete(lua_State *L) {
+    luaopus_dred *u = NULL;
+
+    u = luaL_checkudata(L,1,luaopus_dred_mt);
+    luaopus_mem_free(&u->mem);
+    u->dred = NULL;
+
+    return 0;
+}
+
+#ifdef OPUS_SET_DNN_BLOB
+static int
+luaopus_dred_decoder_set_dnn_blob(lua_State *L) {
+    luaopus_dred_decoder *u = NULL;
+    void *blob = NULL;
+    size_t len = 0;
+
+    u = luaL_checkudata(L,1,luaopus_dred_decoder_mt);
+    blob = (void *)luaL_checklstring(L,2,&len);
+    return luaopus_dnn_blob_keep(L,
+      opus_dred_decoder_ctl(u->dred_decoder, OPUS_SET_DNN_BLOB(blob,(opus_int32)len)));
+}
+#endif
+
+/* returns the offset of the first recoverable sample and
+ * where the redundancy ends, both in samples at Fs.
+ * an offset of 0 means the packet had no redundancy */
+static int
+luaopus_dred_parse(lua_State *L) {
+    luaopus_dred_decoder *d = NULL;
+    luaopus_dred *u = NULL;
+    const unsigned char *data = NULL;
+    size_t len = 0;
+    opus_int32 max_samples = 0;
+    opus_int32 Fs = 0;
+    int defer = 0;
+    int dred_end = 0;
+    int result = 0;
+
+    d = luaL_checkudata(L,1,luaopus_dred_decoder_mt);
+    u = luaL_checkudata(L,2,luaopus_dred_mt);
+    data = (const unsigned char *)luaL_checklstring(L,3,&len);
+    max_samples = (opus_int32)luaL_checkinteger(L,4);
+    Fs = (opus_int32)luaL_checkinteger(L,5);
+    defer = lua_toboolean(L,6);
+
+    result = opus_dred_parse(d->dred_decoder,u->dred,data,(opus_int32)len,
+      max_samples,Fs,&dred_end,defer);
+    u->state = defer ? DRED_DEFERRED : DRED_READY;
+    if(result < 0) {
+        u->state = DRED_EMPTY;
+        lua_pushnil(L);
+        lua_pushinteger(L,result);
+        return 2;
+    }
+
+    lua_pushinteger(L,result);
+    lua_pushinteger(L,dred_end);
+    return 2;
+}
+
+/* finishes a parse that was deferred, src and dst can be the same */
+static int
+luaopus_dred_process(lua_State *L) {
+    luaopus_dred_decoder *d = NULL;
+    luaopus_dred *src = NULL;
+    luaopus_dred *dst = NULL;
+    int result = 0;
+
+    d = luaL_checkudata(L,1,luaopus_dred_decoder_mt);
+    src = luaL_checkudata(L,2,luaopus_dred_mt);
+    dst = lua_isnoneornil(L,3) ? src : luaL_checkudata(L,3,luaopus_dred_mt);
+
+    if(src->state == DRED_EMPTY) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_BAD_ARG);
+        return 2;
+    }
+
+    result = opus_dred_process(d->dred_decoder,src->dred,dst->dred);
+    if(result < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L,result);
+        return 2;
+    }
+    dst->state = DRED_READY;
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+/* decoder:dred_decode(dred, offset, frame_size), the samples go
+ * through the decoder's trim, channel map and meter like any other */
+static int
+luaopus_decoder_dred_decode_table(lua_State *L, int is_float) {
+    luaopus_decoder *u = NULL;
+    luaopus_dred *dred = NULL;
+    opus_int32 offset = 0;
+    opus_int32 frame_size = 0;
+    int samples = 0;
+    int i = 0;
+
+    u = luaL_checkudata(L,1,luaopus_decoder_mt);
+    dred = luaL_checkudata(L,2,luaopus_dred_mt);
+    offset = (opus_int32)luaL_checkinteger(L,3);
+    frame_size = (opus_int32)luaL_checkinteger(L,4);
+
+    if(frame_size <= 0 || frame_size > MAX_FRAME_SIZE || dred->state != DRED_READY) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_BAD_ARG);
+        return 2;
+    }
+
+    samples = luaopus_decoder_dred(u,dred->dred,offset,frame_size,is_float);
+    if(samples < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L,samples);
+        return 2;
+    }
+
+    samples *= luaopus_decoder_output_channels(u);
+
+    lua_createtable(L,samples,0);
+    while(i<samples) {
+        if(is_float) {
+            lua_pushnumber(L,u->pcm_float[i]);
+        } else {
+            lua_pushinteger(L,u->pcm_int16[i]);
+        }
+        lua_rawseti(L,-2,++i);
+    }
+
+    return 1;
+}
+
+LUAOPUS_PRIVATE
+int luaopus_decoder_dred_decode(lua_State *L) {
+    return luaopus_decoder_dred_decode_table(L,0);
+}
+
+LUAOPUS_PRIVATE
+int luaopus_decoder_dred_decode_float(lua_State *L) {
+    return luaopus_decoder_dred_decode_table(L,1);
+}
+
+static const struct luaL_Reg luaopus_dred_functions[] = {
+    { "OpusDREDDecoder", luaopus_OpusDREDDecoder },
+    { "OpusDRED", luaopus_OpusDRED },
+    { "opus_dred_parse", luaopus_dred_parse },
+    { "opus_dred_process", luaopus_dred_process },
+#ifdef OPUS_SET_DNN_BLOB
+    { "opus_dred_decoder_set_dnn_blob", luaopus_dred_decoder_set_dnn_blob },
+#endif
+    { NULL, NULL },
+};
+
+static const luaopus_metamethods luaopus_dred_decoder_metamethods[] = {
+    { "opus_dred_parse", "parse" },
+    { "opus_dred_process", "process" },
+    { "opus_dred_decoder_set_dnn_blob", "set_dnn_blob" },
+    { NULL, NULL },
+};
+
+LUAOPUS_PRIVATE
+void luaopus_dred_register(lua_State *L) {
+    const luaopus_metamethods *m = luaopus_dred_decoder_metamethods;
+
+    luaL_setfuncs(L,luaopus_dred_functions,0);
+
+    if(luaL_newmetatable(L,luaopus_dred_decoder_mt)) {
+        lua_pushcclosure(L,luaopus_OpusDREDDecoder_delete,0);
+        lua_setfield(L,-2,"__gc");
+
+        lua_newtable(L);
+        while(m->name != NULL) {
+            lua_getfield(L,-3,m->name);
+            lua_setfield(L,-2,m->metaname);
+            m++;
+        }
+
+        lua_setfield(L,-2,"__index");
+    }
+    lua_pop(L,1);
+
+    /* nothing to call on parsed redundancy, it's only
+     * handed to parse, process and dred_decode */
+    if(luaL_newmetatable(L,luaopus_dred_mt)) {
+        lua_pushcclosure(L,luaopus_OpusDRED_delete,0);
+        lua_setfield(L,-2,"__gc");
+    }
+    lua_pop(L,1);
+}
+
+#else
+
+LUAOPUS_PRIVATE
+void luaopus_dred_register(lua_State *L) {
+    (void)L;
+}
+
+#endif
+
+LUAOPUS_PUBLIC
+int luaopen_luaopus_dred(lua_State *L) {
+    lua_newtable(L);
+    luaopus_dred_register(L);
+    return 1;
+}
@@ -1,69 +1,75 @@
 #include "luaopus_internal.h"
 #include <opus/opus.h>
 #include <assert.h>
-
-/* recommendation from opus header is 4000 bytes */
-#define MAX_PACKET 4000
-
-/* max sample rate: 48000
- * max channels: 2
- * max ms: 120ms (5760 frames for 48kHz)
- * this may be overkill (I don't think the encoder interface
- * lets you encode more than 60ms at a time) */
-#define MAX_SAMPLES 5760 * 2
+#include <math.h>
+#include <stdlib.h>
 
 const char * const luaopus_encoder_mt = "OpusEncoder";
 
-struct luaopus_encoder_s {
-    OpusEncoder *encoder;
-
-    /* buffer for storing the encoded Opus packet
-     * before passing to Lua */
-    unsigned char buffer[MAX_PACKET];
-
-    /* buffer for storing audio samples from Lua
-     * before sending to Opus.
-     * using float storage since that can
-     * also encapsulate int16 */
-    float pcm_float[MAX_SAMPLES];
-
-    /* will point to pcm_float, so we use the same memory
-     * area for floats and ints */
-    opus_int16 *pcm_int16;
-    int channels;
-
-    /* stores a reference to the encoder userdata so it doesn't get
-     * garbage-collected */
-    int encoder_ref;
+/* what to do with frames the silence detector rejects */
+#define VAD_OFF 0
+#define VAD_DETECT 1
+#define VAD_DTX 2
+#define VAD_DROP 3
+
+/* how often (in frames) the complexity controller re-evaluates */
+#define BUDGET_INTERVAL 20
+
+static const char * const luaopus_encoder_vad_modes[] = {
+    "off",
+    "detect",
+    "dtx",
+    "drop",
+    NULL,
 };
 
-typedef struct luaopus_encoder_s luaopus_encoder;
-
-static int
-luaopus_OpusEncoder(lua_State *L) {
+/* leaves the new encoder on the stack */
+LUAOPUS_PRIVATE
+luaopus_encoder *luaopus_encoder_new(lua_State *L) {
     luaopus_encoder *u = NULL;
+    unsigned char *block = NULL;
+    size_t state_size = 0;
 
     u = lua_newuserdata(L,sizeof(luaopus_encoder));
     if(u == NULL) {
-        return luaL_error(L,"out of memory");
+        luaL_error(L,"out of memory");
+        return NULL;
     }
+    u->mem.ptr = NULL;
 
-    /* get a table to associate encoder reference with */
+    /* table for anything attached to the encoder */
     lua_newtable(L);
+    lua_setuservalue(L,-2);
 
     /* max channels for an encoder is 2 */
     /* we'll just always allocate the max */
-    u->encoder = lua_newuserdata(L,opus_encoder_get_size(2));
-    if(u->encoder == NULL) {
-        return luaL_error(L,"out of memory");
+    state_size = LUAOPUS_MEM_ALIGN(opus_encoder_get_size(2));
+    block = luaopus_mem_alloc(L,&u->mem,LUAOPUS_MEM_ENCODER,
+      state_size + (sizeof(float) * LUAOPUS_MAX_SAMPLES) + LUAOPUS_MAX_PACKET);
+    if(block == NULL) {
+        luaL_error(L,"out of memory");
+        return NULL;
     }
-    u->encoder_ref = luaL_ref(L,-2);
 
+    u->encoder = (OpusEncoder *)block;
+    u->pcm_float = (float *)(block + state_size);
+    u->buffer = block + state_size + (sizeof(float) * LUAOPUS_MAX_SAMPLES);
     u->pcm_int16 = (opus_int16 *)u->pcm_float;
-
-    lua_setuservalue(L,-2);
+    u->Fs = 0;
+    u->channels = 0;
+    u->map.in_channels = 0;
+    u->meter = NULL;
+    u->vad_mode = VAD_OFF;
+    u->vad_toc = -1;
+    u->budget_avg = 0.0f;
 
     luaL_setmetatable(L,luaopus_encoder_mt);
+    return u;
+}
+
+static int
+luaopus_OpusEncoder(lua_State *L) {
+    luaopus_encoder_new(L);
     return 1;
 }
 
@@ -72,15 +78,121 @@ luaopus_OpusEncoder_delete(lua_State *L) {
     luaopus_encoder *u = NULL;
 
     u = luaL_checkudata(L,1,luaopus_encoder_mt);
-    lua_getuservalue(L,1);
+    luaopus_mem_free(&u->mem);
+    u->encoder = NULL;
 
-    if(u->encoder_ref != LUA_NOREF) {
-        luaL_unref(L,-1,u->encoder_ref);
-        u->encoder_ref = LUA_NOREF;
-        u->encoder = NULL;
+    return 0;
+}
+
+/* detaches any stages, idx is the encoder's
+ * absolute stack index */
+LUAOPUS_PRIVATE
+void luaopus_encoder_clear(lua_State *L, int idx, luaopus_encoder *u) {
+    u->map.in_channels = 0;
+    u->meter = NULL;
+    u->vad_mode = VAD_OFF;
+    u->vad_toc = -1;
+    u->budget_avg = 0.0f;
+
+    lua_getuservalue(L,idx);
+    lua_pushnil(L);
+    lua_setfield(L,-2,"meter");
+    lua_pop(L,1);
+}
+
+/* (re)initializes the codec and clears any attached stages */
+LUAOPUS_PRIVATE
+int luaopus_encoder_setup(lua_State *L, int idx, luaopus_encoder *u, opus_int32 Fs, int channels, int application) {
+    int result = 0;
+
+    result = opus_encoder_init(u->encoder,Fs,channels,application);
+    if(result != OPUS_OK) {
+        return result;
     }
 
-    return 0;
+    u->Fs = Fs;
+    u->channels = channels;
+    u->init_complexity = 10;
+    opus_encoder_ctl(u->encoder, OPUS_GET_COMPLEXITY(&u->init_complexity));
+    luaopus_encoder_clear(L,idx,u);
+
+#ifdef OPUS_SET_DNN_BLOB
+    /* init reloads the built-in weights, so a blob set
+     * before is no longer referenced. reset_state keeps it */
+    lua_getuservalue(L,idx);
+    lua_pushnil(L);
+    lua_setfield(L,-2,"dnn_blob");
+    lua_pop(L,1);
+#endif
+    return OPUS_OK;
+}
+
+/* the ctls a user can change, at their opus_encoder_init values.
+ * complexity is kept in the encoder and the application is left
+ * alone, the pool files encoders under it */
+static const struct {
+    int request;
+    opus_int32 value;
+} luaopus_encoder_defaults[] = {
+    { OPUS_SET_SIGNAL_REQUEST, OPUS_AUTO },
+    { OPUS_SET_BITRATE_REQUEST, OPUS_AUTO },
+    { OPUS_SET_BANDWIDTH_REQUEST, OPUS_AUTO },
+    { OPUS_SET_MAX_BANDWIDTH_REQUEST, OPUS_BANDWIDTH_FULLBAND },
+    { OPUS_SET_VBR_REQUEST, 1 },
+    { OPUS_SET_VBR_CONSTRAINT_REQUEST, 1 },
+    { OPUS_SET_FORCE_CHANNELS_REQUEST, OPUS_AUTO },
+    { OPUS_SET_INBAND_FEC_REQUEST, 0 },
+    { OPUS_SET_PACKET_LOSS_PERC_REQUEST, 0 },
+    { OPUS_SET_DTX_REQUEST, 0 },
+    { OPUS_SET_LSB_DEPTH_REQUEST, 24 },
+#ifdef OPUS_SET_EXPERT_FRAME_DURATION
+    { OPUS_SET_EXPERT_FRAME_DURATION_REQUEST, OPUS_FRAMESIZE_ARG },
+#endif
+#ifdef OPUS_SET_PREDICTION_DISABLED
+    { OPUS_SET_PREDICTION_DISABLED_REQUEST, 0 },
+#endif
+#ifdef OPUS_SET_PHASE_INVERSION_DISABLED
+    { OPUS_SET_PHASE_INVERSION_DISABLED_REQUEST, 0 },
+#endif
+#ifdef OPUS_SET_DRED_DURATION
+    { OPUS_SET_DRED_DURATION_REQUEST, 0 },
+#endif
+};
+
+LUAOPUS_PRIVATE
+int luaopus_encoder_reset(lua_State *L, int idx, luaopus_encoder *u) {
+    opus_int32 application = 0;
+    size_t i = 0;
+    int result = 0;
+
+#ifdef OPUS_SET_DNN_BLOB
+    lua_getuservalue(L,idx);
+    lua_getfield(L,-1,"dnn_blob");
+    result = !lua_isnil(L,-1);
+    lua_pop(L,2);
+    if(result) {
+        result = opus_encoder_ctl(u->encoder, OPUS_GET_APPLICATION(&application));
+        if(result != OPUS_OK) return result;
+        return luaopus_encoder_setup(L,idx,u,u->Fs,u->channels,application);
+    }
+#endif
+    (void)application;
+
+    result = opus_encoder_ctl(u->encoder, OPUS_RESET_STATE);
+    if(result != OPUS_OK) return result;
+
+    for(i=0;i<sizeof(luaopus_encoder_defaults) / sizeof(luaopus_encoder_defaults[0]);i++) {
+        result = opus_encoder_ctl(u->encoder,
+          luaopus_encoder_defaults[i].request,
+          luaopus_encoder_defaults[i].value);
+        /* a ctl this libopus doesn't implement was never changed */
+        if(result != OPUS_OK && result != OPUS_UNIMPLEMENTED) return result;
+    }
+    result = opus_encoder_ctl(u->encoder, OPUS_SET_COMPLEXITY(u->init_complexity));
+    if(result != OPUS_OK) return result;
+
+    luaopus_encoder_clear(L,idx,u);
+    return OPUS_OK;
 }
 
 static int
@@ -95,18 +207,378 @@ luaopus_encoder_init(lua_State *L) {
     Fs = luaL_checkinteger(L,2);
     channels = luaL_checkinteger(L,3);
     application = luaL_checkinteger(L,4);
-    result = opus_encoder_init(u->encoder,Fs,channels,application);
+    result = luaopus_encoder_setup(L,1,u,Fs,channels,application);
 
     if(result != OPUS_OK) {
         lua_pushnil(L);
         lua_pushinteger(L,result);
         return 2;
     }
-    u->channels = channels;
+
     lua_pushboolean(L,1);
     return 1;
 }
 
+static int
+luaopus_encoder_set_channel_map(lua_State *L) {
+    luaopus_encoder *u = NULL;
+    int result = 0;
+
+    u = luaL_checkudata(L,1,luaopus_encoder_mt);
+    result = luaopus_chanmap_check(L,2,&u->map,u->channels,0);
+
+    if(result != OPUS_OK) {
+        lua_pushnil(L);
+        lua_pushinteger(L,result);
+        return 2;
+    }
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luaopus_encoder_set_meter(lua_State *L) {
+    luaopus_encoder *u = NULL;
+    luaopus_meter *m = NULL;
+
+    lua_settop(L,2);
+    u = luaL_checkudata(L,1,luaopus_encoder_mt);
+    if(!lua_isnil(L,2)) {
+        m = luaL_checkudata(L,2,luaopus_meter_mt);
+        if(m->Fs != u->Fs || m->channels != u->channels) {
+            lua_pushnil(L);
+            lua_pushinteger(L,OPUS_BAD_ARG);
+            return 2;
+        }
+    }
+
+    lua_getuservalue(L,1);
+    lua_pushvalue(L,2);
+    lua_setfield(L,-2,"meter");
+    lua_pop(L,1);
+
+    u->meter = m;
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luaopus_encoder_set_vad(lua_State *L) {
+    luaopus_encoder *u = NULL;
+    int mode = 0;
+    int err = 0;
+
+    u = luaL_checkudata(L,1,luaopus_encoder_mt);
+    mode = luaL_checkoption(L,2,"detect",luaopus_encoder_vad_modes);
+
+    /* anything we let through to the encoder can still
+     * end up as DTX, so turn it on when we're skipping,
+     * and put the caller's setting back when we stop */
+    if(mode >= VAD_DTX && u->vad_mode < VAD_DTX) {
+        err = opus_encoder_ctl(u->encoder, OPUS_GET_DTX(&u->vad_saved_dtx));
+        if(err >= 0) {
+            err = opus_encoder_ctl(u->encoder, OPUS_SET_DTX(1));
+        }
+    } else if(mode < VAD_DTX && u->vad_mode >= VAD_DTX) {
+        err = opus_encoder_ctl(u->encoder, OPUS_SET_DTX(u->vad_saved_dtx));
+    }
+    if(err < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L,err);
+        return 2;
+    }
+
+    u->vad_mode = mode;
+    u->vad_threshold = (float)luaL_optnumber(L,3,-60.0);
+    u->vad_hangover = (int)luaL_optinteger(L,4,10);
+    u->vad_count = 0;
+    u->vad_active = 1;
+    u->vad_in_dtx = 0;
+    u->vad_level = (float)-HUGE_VAL;
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luaopus_encoder_get_vad(lua_State *L) {
+    luaopus_encoder *u = NULL;
+
+    u = luaL_checkudata(L,1,luaopus_encoder_mt);
+    if(u->vad_mode == VAD_OFF) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_INVALID_STATE);
+        return 2;
+    }
+
+    lua_pushboolean(L,u->vad_active);
+    lua_pushnumber(L,u->vad_level);
+    lua_pushboolean(L,u->vad_in_dtx);
+    return 3;
+}
+
+/* mean power of the frame, in dBFS */
+static float
+luaopus_encoder_level(const luaopus_encoder *u, int frame_size, int is_float) {
+    double sum = 0.0;
+    int samples = frame_size * u->channels;
+    int i = 0;
+
+    if(samples == 0) return (float)-HUGE_VAL;
+
+    if(is_float) {
+        for(i=0;i<samples;i++) {
+            sum += (double)u->pcm_float[i] * (double)u->pcm_float[i];
+        }
+    } else {
+        for(i=0;i<samples;i++) {
+            sum += (double)u->pcm_int16[i] * (double)u->pcm_int16[i];
+        }
+        sum /= 32768.0 * 32768.0;
+    }
+
+    if(sum <= 0.0) return (float)-HUGE_VAL;
+    return (float)(10.0 * log10(sum / (double)samples));
+}
+
+/* updates voice activity for the frame, returns 1 if
+ * the frame should skip the encoder */
+static int
+luaopus_encoder_vad(luaopus_encoder *u, int frame_size, int is_float) {
+    u->vad_level = luaopus_encoder_level(u,frame_size,is_float);
+
+    if(u->vad_level >= u->vad_threshold) {
+        u->vad_count = u->vad_hangover;
+        u->vad_active = 1;
+    } else if(u->vad_count > 0) {
+        u->vad_count--;
+        u->vad_active = 1;
+    } else {
+        u->vad_active = 0;
+    }
+
+    /* we need one real packet before we know what
+     * TOC to put on a DTX packet */
+    return !u->vad_active && u->vad_mode >= VAD_DTX && u->vad_toc >= 0;
+}
+
+static int
+luaopus_encoder_set_complexity_budget(lua_State *L) {
+    luaopus_encoder *u = NULL;
+    opus_int32 complexity = 0;
+    float avg = 0.0f;
+    int err = 0;
+
+    u = luaL_checkudata(L,1,luaopus_encoder_mt);
+    avg = (float)luaL_optnumber(L,2,0.0);
+
+    if(avg <= 0.0f) {
+        u->budget_avg = 0.0f;
+        lua_pushboolean(L,1);
+        return 1;
+    }
+
+    err = opus_encoder_ctl(u->encoder, OPUS_GET_COMPLEXITY(&complexity));
+    if(err < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L,err);
+        return 2;
+    }
+
+    u->budget_avg = avg;
+    u->budget_p99 = (float)luaL_optnumber(L,3,avg * 2.0f);
+    u->budget_bandwidth = lua_toboolean(L,4);
+    u->budget_max_complexity = (int)luaL_optinteger(L,5,10);
+    u->budget_complexity = complexity;
+    u->budget_max_bandwidth = OPUS_BANDWIDTH_FULLBAND;
+    u->budget_pos = 0;
+    u->budget_count = 0;
+    u->budget_frames = 0;
+    u->budget_last_avg = 0.0f;
+    u->budget_last_p99 = 0.0f;
+    u->budget_changes = 0;
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luaopus_encoder_get_complexity_budget(lua_State *L) {
+    luaopus_encoder *u = NULL;
+
+    u = luaL_checkudata(L,1,luaopus_encoder_mt);
+    if(u->budget_avg <= 0.0f) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_INVALID_STATE);
+        return 2;
+    }
+
+    lua_createtable(L,0,6);
+    lua_pushinteger(L,u->budget_complexity);
+    lua_setfield(L,-2,"complexity");
+    lua_pushinteger(L,u->budget_max_bandwidth);
+    lua_setfield(L,-2,"max_bandwidth");
+    lua_pushnumber(L,u->budget_last_avg);
+    lua_setfield(L,-2,"avg_us");
+    lua_pushnumber(L,u->budget_last_p99);
+    lua_setfield(L,-2,"p99_us");
+    lua_pushinteger(L,u->budget_frames);
+    lua_setfield(L,-2,"frames");
+    lua_pushinteger(L,u->budget_changes);
+    lua_setfield(L,-2,"changes");
+    return 1;
+}
+
+static int
+luaopus_encoder_cmp_float(const void *a, const void *b) {
+    float x = *(const float *)a;
+    float y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+/* records how long the encoder took and, every
+ * BUDGET_INTERVAL frames, steps complexity (and then
+ * bandwidth, if allowed) down when we're over budget,
+ * or back up when there's plenty of headroom */
+static void
+luaopus_encoder_budget(luaopus_encoder *u, float elapsed) {
+    float sorted[LUAOPUS_BUDGET_HISTORY];
+    double sum = 0.0;
+    opus_int32 complexity = 0;
+    int changed = 0;
+    int i = 0;
+
+    u->budget_times[u->budget_pos] = elapsed;
+    u->budget_pos = (u->budget_pos + 1) % LUAOPUS_BUDGET_HISTORY;
+    if(u->budget_count < LUAOPUS_BUDGET_HISTORY) u->budget_count++;
+    u->budget_frames++;
+
+    if(u->budget_frames % BUDGET_INTERVAL != 0) return;
+
+    /* set_complexity or configure since our last step, the
+     * caller's value is where we go on from, and the timings
+     * so far were (partly) taken at the old one */
+    if(opus_encoder_ctl(u->encoder, OPUS_GET_COMPLEXITY(&complexity)) == OPUS_OK
+      && complexity != u->budget_complexity) {
+        u->budget_complexity = complexity;
+        u->budget_pos = 0;
+        u->budget_count = 0;
+        return;
+    }
+
+    for(i=0;i<u->budget_count;i++) {
+        sorted[i] = u->budget_times[i];
+        sum += sorted[i];
+    }
+    qsort(sorted,u->budget_count,sizeof(float),luaopus_encoder_cmp_float);
+
+    u->budget_last_avg = (float)(sum / (double)u->budget_count);
+    u->budget_last_p99 = sorted[((u->budget_count * 99) - 1) / 100];
+
+    if(u->budget_last_avg > u->budget_avg || u->budget_last_p99 > u->budget_p99) {
+        if(u->budget_complexity > 0) {
+            u->budget_complexity--;
+            opus_encoder_ctl(u->encoder, OPUS_SET_COMPLEXITY(u->budget_complexity));
+            changed = 1;
+        } else if(u->budget_bandwidth && u->budget_max_bandwidth > OPUS_BANDWIDTH_WIDEBAND) {
+            u->budget_max_bandwidth--;
+            opus_encoder_ctl(u->encoder, OPUS_SET_MAX_BANDWIDTH(u->budget_max_bandwidth));
+            changed = 1;
+        }
+    } else if(u->budget_last_avg < u->budget_avg * 0.6f && u->budget_last_p99 < u->budget_p99 * 0.6f) {
+        if(u->budget_max_bandwidth < OPUS_BANDWIDTH_FULLBAND) {
+            u->budget_max_bandwidth++;
+            opus_encoder_ctl(u->encoder, OPUS_SET_MAX_BANDWIDTH(u->budget_max_bandwidth));
+            changed = 1;
+        } else if(u->budget_complexity < u->budget_max_complexity) {
+            u->budget_complexity++;
+            opus_encoder_ctl(u->encoder, OPUS_SET_COMPLEXITY(u->budget_complexity));
+            changed = 1;
+        }
+    }
+
+    /* old timings say nothing about the new setting */
+    if(changed) {
+        u->budget_changes++;
+        u->budget_pos = 0;
+        u->budget_count = 0;
+    }
+}
+
+/* runs samples loaded into pcm_int16/pcm_float through any
+ * attached stages and then the encoder, the packet
+ * ends up in u->buffer */
+LUAOPUS_PRIVATE
+int luaopus_encoder_frame(luaopus_encoder *u, int frame_size, opus_int32 max_data_bytes, int is_float) {
+    double start = 0.0;
+    int bytes = 0;
+
+    if(u->map.in_channels) {
+        if(is_float) {
+            luaopus_chanmap_float(&u->map,u->pcm_float,frame_size);
+        } else {
+            luaopus_chanmap_int16(&u->map,u->pcm_int16,frame_size);
+        }
+    }
+
+    if(u->meter != NULL) {
+        if(is_float) {
+            luaopus_meter_float(u->meter,u->pcm_float,frame_size);
+        } else {
+            luaopus_meter_int16(u->meter,u->pcm_int16,frame_size);
+        }
+    }
+
+    if(u->vad_mode != VAD_OFF && luaopus_encoder_vad(u,frame_size,is_float)) {
+        u->vad_in_dtx = 1;
+        if(u->vad_mode == VAD_DROP) {
+            return 0;
+        }
+        /* a TOC byte with no frame data is decoded as DTX */
+        u->buffer[0] = (unsigned char)u->vad_toc;
+        return 1;
+    }
+
+    if(u->budget_avg > 0.0f) {
+        start = luaopus_clock_us();
+    }
+
+    if(is_float) {
+        bytes = opus_encode_float(u->encoder,
+          u->pcm_float,
+          frame_size,
+          u->buffer,
+          max_data_bytes);
+    } else {
+        bytes = opus_encode(u->encoder,
+          u->pcm_int16,
+          frame_size,
+          u->buffer,
+          max_data_bytes);
+    }
+
+    if(u->budget_avg > 0.0f) {
+        luaopus_encoder_budget(u,(float)(luaopus_clock_us() - start));
+    }
+
+    if(bytes > 0 && u->vad_mode != VAD_OFF) {
+        u->vad_toc = u->buffer[0] & 0xFC;
+#ifdef OPUS_GET_IN_DTX
+        opus_encoder_ctl(u->encoder, OPUS_GET_IN_DTX(&u->vad_in_dtx));
+#else
+        u->vad_in_dtx = bytes <= 2;
+#endif
+    }
+
+    return bytes;
+}
+
+/* number of interleaved channels the caller hands us */
+LUAOPUS_PRIVATE
+int luaopus_encoder_input_channels(const luaopus_encoder *u) {
+    return u->map.in_channels ? u->map.in_channels : u->channels;
+}
+
 static int
 luaopus_encode(lua_State *L) {
     luaopus_encoder *u = NULL;
@@ -117,7 +589,13 @@ luaopus_encode(lua_State *L) {
 
     u = luaL_checkudata(L,1,luaopus_encoder_mt);
     frames = lua_rawlen(L,2);
-    frame_size = frames / u->channels;
+    frame_size = frames / luaopus_encoder_input_channels(u);
+
+    if(frames > LUAOPUS_MAX_SAMPLES || frame_size * u->channels > LUAOPUS_MAX_SAMPLES) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_BAD_ARG);
+        return 2;
+    }
 
     while(f<frames) {
         lua_rawgeti(L,2,f+1);
@@ -126,11 +604,7 @@ luaopus_encode(lua_State *L) {
         f++;
     }
 
-    bytes = opus_encode(u->encoder,
-      u->pcm_int16,
-      (int)frame_size,
-      u->buffer,
-      MAX_PACKET);
+    bytes = luaopus_encoder_frame(u,(int)frame_size,LUAOPUS_MAX_PACKET,0);
 
     if(bytes < 0) {
         lua_pushnil(L);
@@ -152,7 +626,13 @@ luaopus_encode_float(lua_State *L) {
 
     u = luaL_checkudata(L,1,luaopus_encoder_mt);
     frames = lua_rawlen(L,2);
-    frame_size = frames / u->channels;
+    frame_size = frames / luaopus_encoder_input_channels(u);
+
+    if(frames > LUAOPUS_MAX_SAMPLES || frame_size * u->channels > LUAOPUS_MAX_SAMPLES) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_BAD_ARG);
+        return 2;
+    }
 
     while(f<frames) {
         lua_rawgeti(L,2,f+1);
@@ -161,11 +641,7 @@ luaopus_encode_float(lua_State *L) {
         f++;
     }
 
-    bytes = opus_encode_float(u->encoder,
-      u->pcm_float,
-      (int)frame_size,
-      u->buffer,
-      MAX_PACKET);
+    bytes = luaopus_encoder_frame(u,(int)frame_size,LUAOPUS_MAX_PACKET,1);
 
     if(bytes < 0) {
         lua_pushnil(L);
@@ -260,12 +736,38 @@ LUAOPUS_ENCODER_SET_BOOLEAN(PREDICTION_DISABLED)
 LUAOPUS_ENCODER_GET_BOOLEAN(PREDICTION_DISABLED)
 #endif
 
+/* deep redundancy doesn't appear until opus >= 1.5,
+ * duration is in 2.5ms units */
+#ifdef OPUS_SET_DRED_DURATION
+LUAOPUS_ENCODER_SET_INTEGER(DRED_DURATION)
+#endif
+#ifdef OPUS_GET_DRED_DURATION
+LUAOPUS_ENCODER_GET_INTEGER(DRED_DURATION)
+#endif
+
 static const struct luaL_Reg luaopus_encoder_functions[] = {
     { "OpusEncoder", luaopus_OpusEncoder },
     { "opus_encoder_init", luaopus_encoder_init },
     { "opus_encode", luaopus_encode },
     { "opus_encode_float", luaopus_encode_float },
+    { "opus_encoder_set_channel_map", luaopus_encoder_set_channel_map },
+    { "opus_encoder_set_meter", luaopus_encoder_set_meter },
+    { "opus_encoder_set_vad", luaopus_encoder_set_vad },
+    { "opus_encoder_get_vad", luaopus_encoder_get_vad },
+    { "opus_encoder_set_complexity_budget", luaopus_encoder_set_complexity_budget },
+    { "opus_encoder_get_complexity_budget", luaopus_encoder_get_complexity_budget },
+    { "opus_encoder_configure", luaopus_encoder_configure },
+    { "opus_encoder_get_config", luaopus_encoder_get_config },
+    { "opus_encoder_serialize", luaopus_encoder_serialize },
+    { "opus_encoder_restore", luaopus_encoder_restore },
+#ifdef OPUS_SET_DNN_BLOB
+    { "opus_encoder_set_dnn_blob", luaopus_encoder_set_dnn_blob },
+#endif
     { "opus_encoder_ctl_reset_state", luaopus_encoder_ctl_reset_state },
+    { NULL, NULL },
+};
+
+static const struct luaL_Reg luaopus_encoder_ctl_functions[] = {
     { ctl_get("final_range"), CTL_GET(FINAL_RANGE) },
     { ctl_get("bandwdth"), CTL_GET(BANDWIDTH) },
     { ctl_get("samplerate"), CTL_GET(SAMPLE_RATE) },
@@ -292,8 +794,10 @@ static const struct luaL_Reg luaopus_encoder_functions[] = {
     { ctl_get("max_bandwidth"), CTL_GET(MAX_BANDWIDTH) },
     { ctl_set("signal"), CTL_SET(SIGNAL) },
     { ctl_get("signal"), CTL_GET(SIGNAL) },
-    { ctl_set("signal"), CTL_SET(APPLICATION) },
-    { ctl_get("signal"), CTL_GET(APPLICATION) },
+    /* these used to be registered as "signal" too, which overrode
+     * the SIGNAL entries above; see the README */
+    { ctl_set("application"), CTL_SET(APPLICATION) },
+    { ctl_get("application"), CTL_GET(APPLICATION) },
     { ctl_get("lookahead"), CTL_GET(LOOKAHEAD) },
     { ctl_set("inband_fec"), CTL_SET(INBAND_FEC) },
     { ctl_get("inband_fec"), CTL_GET(INBAND_FEC) },
@@ -314,6 +818,12 @@ static const struct luaL_Reg luaopus_encoder_functions[] = {
 #endif
 #ifdef OPUS_GET_PREDICTION_DISABLED
     { ctl_get("prediction_disabled"), CTL_GET(PREDICTION_DISABLED) },
+#endif
+#ifdef OPUS_SET_DRED_DURATION
+    { ctl_set("dred_duration"), CTL_SET(DRED_DURATION) },
+#endif
+#ifdef OPUS_GET_DRED_DURATION
+    { ctl_get("dred_duration"), CTL_GET(DRED_DURATION) },
 #endif
     { NULL, NULL },
 };
@@ -322,6 +832,21 @@ static const luaopus_metamethods luaopus_encoder_metamethods[] = {
     { "opus_encoder_init", "init" },
     { "opus_encode", "encode" },
     { "opus_encode_float", "encode_float" },
+    { "opus_encoder_set_channel_map", "set_channel_map" },
+    { "opus_encoder_set_meter", "set_meter" },
+    { "opus_encoder_set_vad", "set_vad" },
+    { "opus_encoder_get_vad", "get_vad" },
+    { "opus_encoder_set_complexity_budget", "set_complexity_budget" },
+    { "opus_encoder_get_complexity_budget", "get_complexity_budget" },
+    { "opus_encoder_configure", "configure" },
+    { "opus_encoder_get_config", "get_config" },
+    { "opus_encoder_serialize", "serialize" },
+    { "opus_encoder_restore", "restore" },
+    { "opus_encoder_set_dnn_blob", "set_dnn_blob" },
+    { NULL, NULL },
+};
+
+static const luaopus_metamethods luaopus_encoder_ctl_metamethods[] = {
     ctl_get_short("final_range"),
     ctl_get_short("bandwdth"),
     ctl_get_short("samplerate"),
@@ -357,31 +882,52 @@ static const luaopus_metamethods luaopus_encoder_metamethods[] = {
     ctl_get_short("expert_frame_duration"),
     ctl_set_short("prediction_disabled"),
     ctl_get_short("prediction_disabled"),
+    ctl_set_short("dred_duration"),
+    ctl_get_short("dred_duration"),
     { NULL, NULL },
 };
 
+const luaopus_lazy luaopus_encoder_ctl = {
+    luaopus_encoder_ctl_functions,
+    NULL,
+};
 
-LUAOPUS_PUBLIC
-int luaopen_luaopus_encoder(lua_State *L) {
-    const luaopus_metamethods *m = luaopus_encoder_metamethods;
+static const luaopus_lazy luaopus_encoder_ctl_methods = {
+    luaopus_encoder_ctl_functions,
+    luaopus_encoder_ctl_metamethods,
+};
 
-    lua_newtable(L);
+LUAOPUS_PRIVATE
+void luaopus_encoder_register(lua_State *L) {
+    static const luaopus_lazy * const lazy[] = { &luaopus_encoder_ctl_methods };
+    const luaopus_metamethods *m = luaopus_encoder_metamethods;
 
     luaL_setfuncs(L,luaopus_encoder_functions,0);
 
-    luaL_newmetatable(L,luaopus_encoder_mt);
+    /* the metatable is shared by every copy of the module */
+    if(luaL_newmetatable(L,luaopus_encoder_mt)) {
+        lua_pushcclosure(L,luaopus_OpusEncoder_delete,0);
+        lua_setfield(L,-2,"__gc");
 
-    lua_pushcclosure(L,luaopus_OpusEncoder_delete,0);
-    lua_setfield(L,-2,"__gc");
+        lua_newtable(L);
+        while(m->name != NULL) {
+            lua_getfield(L,-3,m->name);
+            lua_setfield(L,-2,m->metaname);
+            m++;
+        }
+        luaopus_lazy_attach(L,lazy,1);
 
-    lua_newtable(L);
-    while(m->name != NULL) {
-        lua_getfield(L,-3,m->name);
-        lua_setfield(L,-2,m->metaname);
-        m++;
+        lua_setfield(L,-2,"__index");
     }
-
-    lua_setfield(L,-2,"__index");
     lua_pop(L,1);
+}
+
+LUAOPUS_PUBLIC
+int luaopen_luaopus_encoder(lua_State *L) {
+    static const luaopus_lazy * const lazy[] = { &luaopus_encoder_ctl };
+
+    lua_newtable(L);
+    luaopus_encoder_register(L);
+    luaopus_lazy_attach(L,lazy,1);
     return 1;
 }
@@ -0,0 +1,102 @@
+#include "luaopus_internal.h"
+#include <opus/opus.h>
+#include <string.h>
+
+/* these skip the Lua API entirely, so they copy through the
+ * object's own buffers and reuse the same pipelines as
+ * opus_encode/opus_decode */
+
+static opus_int32
+luaopus_ffi_encode_frame(luaopus_encoder *u, const void *pcm, size_t sample_size, int frame_size, unsigned char *data, opus_int32 max_data_bytes, int is_float) {
+    int channels = 0;
+    int bytes = 0;
+
+    if(u == NULL || u->encoder == NULL || u->channels == 0) {
+        return OPUS_INVALID_STATE;
+    }
+
+    channels = luaopus_encoder_input_channels(u);
+    if(pcm == NULL || data == NULL || frame_size <= 0 || max_data_bytes <= 0
+      || frame_size * LUAOPUS_CHANMAP_MAX > LUAOPUS_MAX_SAMPLES) {
+        return OPUS_BAD_ARG;
+    }
+
+    /* the limit has to reach libopus, checking afterwards
+     * would lose a frame the encoder had already taken */
+    if(max_data_bytes > LUAOPUS_MAX_PACKET) {
+        max_data_bytes = LUAOPUS_MAX_PACKET;
+    }
+
+    memcpy(u->pcm_float,pcm,sample_size * frame_size * channels);
+
+    bytes = luaopus_encoder_frame(u,frame_size,max_data_bytes,is_float);
+    if(bytes <= 0) {
+        return bytes;
+    }
+
+    memcpy(data,u->buffer,bytes);
+    return bytes;
+}
+
+static int
+luaopus_ffi_decode_packet(luaopus_decoder *u, const unsigned char *data, opus_int32 len, void *pcm, size_t sample_size, int frame_size, int decode_fec, int is_float) {
+    int samples = 0;
+
+    if(u == NULL || u->decoder == NULL || u->channels == 0) {
+        return OPUS_INVALID_STATE;
+    }
+
+    if(pcm == NULL || frame_size <= 0) {
+        return OPUS_BAD_ARG;
+    }
+
+    /* we can't produce more than our own buffer holds */
+    if(frame_size * LUAOPUS_CHANMAP_MAX > LUAOPUS_MAX_SAMPLES) {
+        frame_size = LUAOPUS_MAX_SAMPLES / LUAOPUS_CHANMAP_MAX;
+    }
+
+    samples = luaopus_decoder_packet(u,len ? data : NULL,len,frame_size,decode_fec,is_float);
+    if(samples < 0) {
+        return samples;
+    }
+
+    memcpy(pcm,u->pcm_float,sample_size * samples * luaopus_decoder_output_channels(u));
+    return samples;
+}
+
+LUAOPUS_PUBLIC
+int luaopus_ffi_abi(void) {
+    return LUAOPUS_FFI_ABI;
+}
+
+LUAOPUS_PUBLIC
+opus_int32 luaopus_ffi_encode(void *encoder, const opus_int16 *pcm, int frame_size, unsigned char *data, opus_int32 max_data_bytes) {
+    return luaopus_ffi_encode_frame(encoder,pcm,sizeof(opus_int16),frame_size,data,max_data_bytes,0);
+}
+
+LUAOPUS_PUBLIC
+opus_int32 luaopus_ffi_encode_float(void *encoder, const float *pcm, int frame_size, unsigned char *data, opus_int32 max_data_bytes) {
+    return luaopus_ffi_encode_frame(encoder,pcm,sizeof(float),frame_size,data,max_data_bytes,1);
+}
+
+LUAOPUS_PUBLIC
+int luaopus_ffi_decode(void *decoder, const unsigned char *data, opus_int32 len, opus_int16 *pcm, int frame_size, int decode_fec) {
+    return luaopus_ffi_decode_packet(decoder,data,len,pcm,sizeof(opus_int16),frame_size,decode_fec,0);
+}
+
+LUAOPUS_PUBLIC
+int luaopus_ffi_decode_float(void *decoder, const unsigned char *data, opus_int32 len, float *pcm, int frame_size, int decode_fec) {
+    return luaopus_ffi_decode_packet(decoder,data,len,pcm,sizeof(float),frame_size,decode_fec,1);
+}
+
+LUAOPUS_PUBLIC
+int luaopus_ffi_encoder_channels(void *encoder) {
+    luaopus_encoder *u = encoder;
+    return luaopus_encoder_input_channels(u);
+}
+
+LUAOPUS_PUBLIC
+int luaopus_ffi_decoder_channels(void *decoder) {
+    luaopus_decoder *u = decoder;
+    return luaopus_decoder_output_channels(u);
+}
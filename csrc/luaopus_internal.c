@@ -1,8 +1,19 @@
+/* for clock_gettime */
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 199309L
+#endif
+
 #include "luaopus_internal.h"
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 
 #if !defined(luaL_newlibtable) \
   && (!defined LUA_VERSION_NUM || LUA_VERSION_NUM==501)
-#include <string.h>
 LUAOPUS_PRIVATE
 void luaL_setfuncs (lua_State *L, const luaL_Reg *l, int nup) {
     luaL_checkstack(L, nup+1, "too many upvalues");
@@ -43,3 +54,74 @@ void *luaL_testudata (lua_State *L, int i, const char *tname) {
     return p;
 }
 #endif
+
+/* __index for tables with lazy sets, upvalue 1 is the number
+ * of sets, the rest are the sets. found functions are stored
+ * in the table so this only runs once per name */
+static int
+luaopus_lazy_index(lua_State *L) {
+    const luaopus_lazy *set = NULL;
+    const luaopus_metamethods *m = NULL;
+    const luaL_Reg *f = NULL;
+    const char *name = NULL;
+    int n = 0;
+    int i = 0;
+
+    if(lua_type(L,2) != LUA_TSTRING) return 0;
+
+    n = (int)lua_tointeger(L,lua_upvalueindex(1));
+    for(i=0;i<n;i++) {
+        set = (const luaopus_lazy *)lua_touserdata(L,lua_upvalueindex(i+2));
+        name = lua_tostring(L,2);
+
+        if(set->methods != NULL) {
+            for(m = set->methods; m->name != NULL; m++) {
+                if(strcmp(m->metaname,name) == 0) break;
+            }
+            if(m->name == NULL) continue;
+            name = m->name;
+        }
+
+        for(f = set->funcs; f->name != NULL; f++) {
+            if(strcmp(f->name,name) == 0) break;
+        }
+        if(f->name == NULL) continue;
+
+        lua_pushcfunction(L,f->func);
+        lua_pushvalue(L,2);
+        lua_pushvalue(L,-2);
+        lua_rawset(L,1);
+        return 1;
+    }
+
+    return 0;
+}
+
+LUAOPUS_PRIVATE
+void luaopus_lazy_attach(lua_State *L, const luaopus_lazy * const *sets, int n) {
+    int i = 0;
+
+    lua_createtable(L,0,1);
+    lua_pushinteger(L,n);
+    for(i=0;i<n;i++) {
+        lua_pushlightuserdata(L,(void *)sets[i]);
+    }
+    lua_pushcclosure(L,luaopus_lazy_index,n + 1);
+    lua_setfield(L,-2,"__index");
+    lua_setmetatable(L,-2);
+}
+
+LUAOPUS_PRIVATE
+double luaopus_clock_us(void) {
+#ifdef _WIN32
+    LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart * 1000000.0 / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ((double)ts.tv_sec * 1000000.0) + ((double)ts.tv_nsec / 1000.0);
+#endif
+}
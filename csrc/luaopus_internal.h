@@ -1,4 +1,5 @@
 #include "luaopus.h"
+#include <opus/opus.h>
 
 #define LUAOPUS_CTL_RESET_STATE(t) \
 static int \
@@ -132,6 +133,205 @@ typedef struct luaopus_metamethods_s {
     const char *metaname;
 } luaopus_metamethods;
 
+/* a set of functions that's created on first use rather than
+ * at load time. with methods set, keys are method names,
+ * mapped to the function names in funcs */
+typedef struct luaopus_lazy_s {
+    const luaL_Reg *funcs;
+    const luaopus_metamethods *methods;
+} luaopus_lazy;
+
+/* encoders and decoders top out at 2 channels */
+#define LUAOPUS_CHANMAP_MAX 2
+
+/* a channel mapping stage, applied to encoder input
+ * or decoder output. matrix is stored by output channel,
+ * each row having in_channels coefficients.
+ * in_channels == 0 means the stage is disabled */
+typedef struct luaopus_chanmap_s {
+    int in_channels;
+    int out_channels;
+    float matrix[LUAOPUS_CHANMAP_MAX * LUAOPUS_CHANMAP_MAX];
+} luaopus_chanmap;
+
+/* 0.1 LU bins covering -70 to +30 LUFS, used for gating */
+#define LUAOPUS_METER_BINS 1000
+/* 100ms sub-blocks in the 3s short-term window */
+#define LUAOPUS_METER_BLOCKS 30
+/* 4x oversampling filter for true-peak, taps per phase */
+#define LUAOPUS_METER_TAPS 12
+
+/* EBU R128 loudness and peak meter, fed from
+ * encoder input or decoder output */
+typedef struct luaopus_meter_s {
+    opus_int32 Fs;
+    int channels;
+
+    /* K-weighting filter: shelf then high-pass,
+     * each as a biquad with per-channel state */
+    double b[2][3];
+    double a[2][3];
+    double z[LUAOPUS_CHANMAP_MAX][2][2];
+
+    /* running sum for the current 100ms sub-block */
+    int block_size;
+    int block_fill;
+    double block_sum;
+
+    /* mean square of recent sub-blocks, as a ring */
+    double blocks[LUAOPUS_METER_BLOCKS];
+    int block_pos;
+    int block_count;
+
+    /* histogram of 400ms gating blocks, for integrated loudness.
+     * we keep the energy per bin too so the result isn't
+     * quantized to the bin width */
+    unsigned int bins[LUAOPUS_METER_BINS];
+    double bin_energy[LUAOPUS_METER_BINS];
+
+    float tp_coef[4][LUAOPUS_METER_TAPS];
+    float tp_hist[LUAOPUS_CHANMAP_MAX][LUAOPUS_METER_TAPS];
+    int tp_pos;
+
+    double true_peak;
+    double sample_peak;
+} luaopus_meter;
+
+/* recommendation from opus header is 4000 bytes */
+#define LUAOPUS_MAX_PACKET 4000
+
+/* max sample rate: 48000
+ * max channels: 2
+ * max ms: 120ms (5760 frames for 48kHz)
+ * this may be overkill (I don't think the encoder interface
+ * lets you encode more than 60ms at a time) */
+#define LUAOPUS_MAX_SAMPLES (5760 * 2)
+
+/* encode times kept for the complexity controller */
+#define LUAOPUS_BUDGET_HISTORY 100
+
+/* kinds of memory we keep counts for */
+#define LUAOPUS_MEM_ENCODER 0
+#define LUAOPUS_MEM_DECODER 1
+#define LUAOPUS_MEM_CACHE 2
+#define LUAOPUS_MEM_SCHEDULER 3
+#define LUAOPUS_MEM_TYPES 4
+
+/* a block from the luaopus allocator, remembering which
+ * allocator it came from so it can be given back */
+typedef struct luaopus_mem_s {
+    lua_Alloc f;
+    void *ud;
+    void *ptr;
+    size_t size;
+    int type;
+} luaopus_mem;
+
+struct luaopus_encoder_s {
+    /* holds the encoder state and both buffers */
+    luaopus_mem mem;
+
+    OpusEncoder *encoder;
+
+    /* buffer for storing the encoded Opus packet
+     * before passing to Lua, LUAOPUS_MAX_PACKET bytes */
+    unsigned char *buffer;
+
+    /* buffer for storing audio samples from Lua
+     * before sending to Opus, LUAOPUS_MAX_SAMPLES long.
+     * using float storage since that can
+     * also encapsulate int16 */
+    float *pcm_float;
+
+    /* will point to pcm_float, so we use the same memory
+     * area for floats and ints */
+    opus_int16 *pcm_int16;
+    opus_int32 Fs;
+    int channels;
+
+    /* optional remapping of the caller's channels
+     * into the encoder's channels */
+    luaopus_chanmap map;
+
+    /* optional loudness meter on the input, kept
+     * alive through the uservalue table */
+    luaopus_meter *meter;
+
+    /* what opus_encoder_init set the complexity to,
+     * it's changed between libopus versions */
+    opus_int32 init_complexity;
+
+    /* silence detection, levels are in dBFS and the
+     * hangover is counted in frames */
+    int vad_mode;
+    float vad_threshold;
+    int vad_hangover;
+    int vad_count;
+    int vad_active;
+    opus_int32 vad_in_dtx;
+    float vad_level;
+
+    /* the caller's OPUS_SET_DTX from before a skipping
+     * mode turned it on, put back when leaving one */
+    opus_int32 vad_saved_dtx;
+
+    /* TOC byte of the last real packet, used to
+     * build DTX packets for skipped frames */
+    int vad_toc;
+
+    /* adaptive complexity, times are in microseconds.
+     * budget_avg == 0 means the controller is off */
+    float budget_avg;
+    float budget_p99;
+    int budget_bandwidth;
+    int budget_max_complexity;
+    int budget_complexity;
+    int budget_max_bandwidth;
+    float budget_times[LUAOPUS_BUDGET_HISTORY];
+    int budget_pos;
+    int budget_count;
+    int budget_frames;
+    float budget_last_avg;
+    float budget_last_p99;
+    unsigned int budget_changes;
+};
+
+typedef struct luaopus_encoder_s luaopus_encoder;
+
+struct luaopus_decoder_s {
+    /* holds the decoder state and the buffer */
+    luaopus_mem mem;
+
+    OpusDecoder *decoder;
+
+    /* buffer for storing audio samples from Opus
+     * before sending to Lua, LUAOPUS_MAX_SAMPLES long.
+     * using float storage since that can
+     * also encapsulate int16 */
+    float *pcm_float;
+
+    /* will point to pcm_float, so we use the same memory
+     * area for floats and ints */
+    opus_int16 *pcm_int16;
+    opus_int32 Fs;
+    int channels;
+
+    /* optional remapping of the decoder's channels
+     * into the channels handed back to the caller */
+    luaopus_chanmap map;
+
+    /* optional loudness meter on the output, kept
+     * alive through the uservalue table */
+    luaopus_meter *meter;
+
+    /* gapless trimming, in samples per channel at Fs.
+     * trim_left < 0 means there's no end trim */
+    opus_int32 trim_skip;
+    opus_int64 trim_left;
+};
+
+typedef struct luaopus_decoder_s luaopus_decoder;
+
 
 #if (!defined LUA_VERSION_NUM) || LUA_VERSION_NUM == 501
 #define lua_setuservalue(L,i) lua_setfenv((L),(i))
@@ -158,6 +358,227 @@ LUAOPUS_PRIVATE
 void *luaL_testudata (lua_State *L, int i, const char *tname);
 #endif
 
+/* reads a channel map from the Lua stack, starting at idx.
+ * codec_channels is the number of channels the codec uses,
+ * codec_is_input is 1 for decoders (codec feeds the map),
+ * 0 for encoders (map feeds the codec).
+ * returns OPUS_OK or OPUS_BAD_ARG */
+LUAOPUS_PRIVATE
+int luaopus_chanmap_check(lua_State *L, int idx, luaopus_chanmap *m, int codec_channels, int codec_is_input);
+
+LUAOPUS_PRIVATE
+void luaopus_chanmap_float(const luaopus_chanmap *m, float *pcm, int frame_size);
+
+LUAOPUS_PRIVATE
+void luaopus_chanmap_int16(const luaopus_chanmap *m, opus_int16 *pcm, int frame_size);
+
+extern const char * const luaopus_encoder_mt;
+extern const char * const luaopus_decoder_mt;
+extern const char * const luaopus_meter_mt;
+
+/* the ctl_get/ctl_set functions, by full name */
+extern const luaopus_lazy luaopus_encoder_ctl;
+extern const luaopus_lazy luaopus_decoder_ctl;
+extern const luaopus_lazy luaopus_projection_encoder_ctl;
+extern const luaopus_lazy luaopus_projection_decoder_ctl;
+extern const luaopus_lazy luaopus_custom_encoder_ctl;
+extern const luaopus_lazy luaopus_custom_decoder_ctl;
+
+/* gives the table on top of the stack a metatable that creates
+ * functions from the n sets the first time they're looked up */
+LUAOPUS_PRIVATE
+void luaopus_lazy_attach(lua_State *L, const luaopus_lazy * const *sets, int n);
+
+/* adds a module's functions to the table on top of the stack,
+ * creating its metatable if this state doesn't have one yet */
+LUAOPUS_PRIVATE
+void luaopus_defines_register(lua_State *L);
+
+LUAOPUS_PRIVATE
+void luaopus_encoder_register(lua_State *L);
+
+LUAOPUS_PRIVATE
+void luaopus_decoder_register(lua_State *L);
+
+LUAOPUS_PRIVATE
+void luaopus_meter_register(lua_State *L);
+
+LUAOPUS_PRIVATE
+void luaopus_scheduler_register(lua_State *L);
+
+LUAOPUS_PRIVATE
+void luaopus_pool_register(lua_State *L);
+
+LUAOPUS_PRIVATE
+void luaopus_memory_register(lua_State *L);
+
+LUAOPUS_PRIVATE
+void luaopus_config_register(lua_State *L);
+
+LUAOPUS_PRIVATE
+void luaopus_reader_register(lua_State *L);
+
+/* adds nothing when libopus doesn't have the projection API */
+LUAOPUS_PRIVATE
+void luaopus_projection_register(lua_State *L);
+
+/* adds nothing before opus 1.5 */
+LUAOPUS_PRIVATE
+void luaopus_dred_register(lua_State *L);
+
+/* adds nothing unless libopus has custom modes */
+LUAOPUS_PRIVATE
+void luaopus_custom_register(lua_State *L);
+
+/* the packet cache is one per process, whichever
+ * lua_State registers it */
+LUAOPUS_PRIVATE
+void luaopus_cache_register(lua_State *L);
+
+#ifdef OPUS_SET_DNN_BLOB
+/* encoder:set_dnn_blob() and decoder:set_dnn_blob(), they
+ * live with the DRED code */
+LUAOPUS_PRIVATE
+int luaopus_encoder_set_dnn_blob(lua_State *L);
+
+LUAOPUS_PRIVATE
+int luaopus_decoder_set_dnn_blob(lua_State *L);
+#endif
+
+#ifdef OPUS_SET_DRED_DURATION
+LUAOPUS_PRIVATE
+int luaopus_decoder_dred_decode(lua_State *L);
+
+LUAOPUS_PRIVATE
+int luaopus_decoder_dred_decode_float(lua_State *L);
+#endif
+
+/* encoder:configure() and encoder:get_config(), they
+ * live with the rest of the config code */
+LUAOPUS_PRIVATE
+int luaopus_encoder_configure(lua_State *L);
+
+LUAOPUS_PRIVATE
+int luaopus_encoder_get_config(lua_State *L);
+
+/* serialize/restore for moving objects between states */
+LUAOPUS_PRIVATE
+int luaopus_encoder_serialize(lua_State *L);
+
+LUAOPUS_PRIVATE
+int luaopus_encoder_restore(lua_State *L);
+
+LUAOPUS_PRIVATE
+int luaopus_decoder_serialize(lua_State *L);
+
+LUAOPUS_PRIVATE
+int luaopus_decoder_restore(lua_State *L);
+
+/* decoding straight to a Lua file or an fd */
+LUAOPUS_PRIVATE
+int luaopus_decode_to_file(lua_State *L);
+
+LUAOPUS_PRIVATE
+int luaopus_decode_float_to_file(lua_State *L);
+
+LUAOPUS_PRIVATE
+int luaopus_decode_to_fd(lua_State *L);
+
+LUAOPUS_PRIVATE
+int luaopus_decode_float_to_fd(lua_State *L);
+
+LUAOPUS_PRIVATE
+void luaopus_meter_float(luaopus_meter *m, const float *pcm, int frame_size);
+
+LUAOPUS_PRIVATE
+void luaopus_meter_int16(luaopus_meter *m, const opus_int16 *pcm, int frame_size);
+
+/* creates an uninitialized object, leaving it on the stack */
+LUAOPUS_PRIVATE
+luaopus_encoder *luaopus_encoder_new(lua_State *L);
+
+LUAOPUS_PRIVATE
+luaopus_decoder *luaopus_decoder_new(lua_State *L);
+
+/* detaches channel maps, meters and the other stages.
+ * idx is the object's absolute stack index */
+LUAOPUS_PRIVATE
+void luaopus_encoder_clear(lua_State *L, int idx, luaopus_encoder *u);
+
+LUAOPUS_PRIVATE
+void luaopus_decoder_clear(lua_State *L, int idx, luaopus_decoder *u);
+
+/* puts every ctl back how opus_*_init left it and clears the
+ * stages, without reloading the built-in models like init does
+ * (unless a DNN blob replaced them). idx is the object's
+ * absolute stack index, returns an opus error */
+LUAOPUS_PRIVATE
+int luaopus_encoder_reset(lua_State *L, int idx, luaopus_encoder *u);
+
+LUAOPUS_PRIVATE
+int luaopus_decoder_reset(lua_State *L, int idx, luaopus_decoder *u);
+
+/* opus_*_init, plus luaopus_*_clear */
+LUAOPUS_PRIVATE
+int luaopus_encoder_setup(lua_State *L, int idx, luaopus_encoder *u, opus_int32 Fs, int channels, int application);
+
+LUAOPUS_PRIVATE
+int luaopus_decoder_setup(lua_State *L, int idx, luaopus_decoder *u, opus_int32 Fs, int channels);
+
+/* runs a frame already copied into pcm_int16/pcm_float
+ * through the encoder pipeline, the packet (if any) ends up
+ * in u->buffer. max_data_bytes is passed on to opus_encode,
+ * at most LUAOPUS_MAX_PACKET. returns bytes or an opus error */
+LUAOPUS_PRIVATE
+int luaopus_encoder_frame(luaopus_encoder *u, int frame_size, opus_int32 max_data_bytes, int is_float);
+
+LUAOPUS_PRIVATE
+int luaopus_encoder_input_channels(const luaopus_encoder *u);
+
+/* decodes into pcm_int16/pcm_float, returns samples
+ * per channel or an opus error. frame_size is at most 5760 */
+LUAOPUS_PRIVATE
+int luaopus_decoder_packet(luaopus_decoder *u, const unsigned char *data, opus_int32 len, int frame_size, int decode_fec, int is_float);
+
+LUAOPUS_PRIVATE
+int luaopus_decoder_output_channels(const luaopus_decoder *u);
+
+#ifdef OPUS_SET_DRED_DURATION
+/* same as luaopus_decoder_packet, but the audio is
+ * recovered from DRED data instead of a packet */
+LUAOPUS_PRIVATE
+int luaopus_decoder_dred(luaopus_decoder *u, const OpusDRED *dred, opus_int32 offset, int frame_size, int is_float);
+#endif
+
+/* allocates size bytes, counted against type, from the
+ * allocator set with luaopus_set_allocator, or L's own.
+ * returns NULL on failure */
+LUAOPUS_PRIVATE
+void *luaopus_mem_alloc(lua_State *L, luaopus_mem *m, int type, size_t size);
+
+/* same, for blocks that outlive the lua_State asking for them.
+ * uses the luaopus_set_allocator allocator, or malloc */
+LUAOPUS_PRIVATE
+void *luaopus_mem_alloc_shared(luaopus_mem *m, int type, size_t size);
+
+/* grows or shrinks a block from luaopus_mem_alloc_shared, or
+ * allocates one if m is empty. on failure returns NULL and
+ * the old block is left as it was */
+LUAOPUS_PRIVATE
+void *luaopus_mem_realloc_shared(luaopus_mem *m, int type, size_t size);
+
+/* frees the block, safe to call on one that's already freed
+ * and when m is stored inside the block itself */
+LUAOPUS_PRIVATE
+void luaopus_mem_free(luaopus_mem *m);
+
+/* rounds a size up so whatever follows it is aligned */
+#define LUAOPUS_MEM_ALIGN(x) (((x) + 15) & ~((size_t)15))
+
+/* monotonic clock, in microseconds */
+LUAOPUS_PRIVATE
+double luaopus_clock_us(void);
+
 #ifdef __cplusplus
 }
 #endif
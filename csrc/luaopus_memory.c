@@ -0,0 +1,231 @@
+#include "luaopus_internal.h"
+#include <stdlib.h>
+
+typedef struct luaopus_memstat_s {
+    size_t live;
+    size_t peak;
+    size_t count;
+    size_t total;
+} luaopus_memstat;
+
+static const char * const luaopus_mem_names[LUAOPUS_MEM_TYPES] = {
+    "encoder",
+    "decoder",
+    "cache",
+    "scheduler",
+};
+
+static lua_Alloc luaopus_alloc_f = NULL;
+static void *luaopus_alloc_ud = NULL;
+
+/* these are shared by every lua_State in the process, which may
+ * be running on different threads. the last one is the total */
+static luaopus_memstat luaopus_memstats[LUAOPUS_MEM_TYPES + 1];
+
+#if defined(__GNUC__)
+#define luaopus_atomic_add(p,v) __sync_add_and_fetch((p),(v))
+#define luaopus_atomic_sub(p,v) __sync_sub_and_fetch((p),(v))
+#define luaopus_atomic_cas(p,o,n) __sync_bool_compare_and_swap((p),(o),(n))
+#else
+/* no atomics, the counts may drift if several
+ * threads allocate at once */
+#define luaopus_atomic_add(p,v) (*(p) += (v))
+#define luaopus_atomic_sub(p,v) (*(p) -= (v))
+#define luaopus_atomic_cas(p,o,n) (*(p) = (n), 1)
+#endif
+
+LUAOPUS_PUBLIC
+void luaopus_set_allocator(lua_Alloc f, void *ud) {
+    luaopus_alloc_f = f;
+    luaopus_alloc_ud = ud;
+}
+
+static void
+luaopus_memstat_add(luaopus_memstat *s, size_t size) {
+    size_t live = 0;
+    size_t peak = 0;
+
+    live = luaopus_atomic_add(&s->live,size);
+    luaopus_atomic_add(&s->count,1);
+    luaopus_atomic_add(&s->total,1);
+    do {
+        peak = s->peak;
+    } while(live > peak && !luaopus_atomic_cas(&s->peak,peak,live));
+}
+
+static void
+luaopus_memstat_sub(luaopus_memstat *s, size_t size) {
+    luaopus_atomic_sub(&s->live,size);
+    luaopus_atomic_sub(&s->count,1);
+}
+
+/* same object, new size */
+static void
+luaopus_memstat_resize(luaopus_memstat *s, size_t osize, size_t nsize) {
+    size_t live = 0;
+    size_t peak = 0;
+
+    if(nsize < osize) {
+        luaopus_atomic_sub(&s->live,osize - nsize);
+        return;
+    }
+    live = luaopus_atomic_add(&s->live,nsize - osize);
+    do {
+        peak = s->peak;
+    } while(live > peak && !luaopus_atomic_cas(&s->peak,peak,live));
+}
+
+/* the fallback for shared blocks, where no lua_State's
+ * allocator can be relied on to still be around */
+static void *
+luaopus_mem_malloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    (void)ud;
+    (void)osize;
+    if(nsize == 0) {
+        free(ptr);
+        return NULL;
+    }
+    return realloc(ptr,nsize);
+}
+
+static void *
+luaopus_mem_take(luaopus_mem *m, int type, size_t size) {
+    m->ptr = m->f(m->ud,NULL,0,size);
+    if(m->ptr == NULL) {
+        return NULL;
+    }
+    m->size = size;
+    m->type = type;
+
+    luaopus_memstat_add(&luaopus_memstats[type],size);
+    luaopus_memstat_add(&luaopus_memstats[LUAOPUS_MEM_TYPES],size);
+    return m->ptr;
+}
+
+LUAOPUS_PRIVATE
+void *luaopus_mem_alloc(lua_State *L, luaopus_mem *m, int type, size_t size) {
+    if(luaopus_alloc_f != NULL) {
+        m->f = luaopus_alloc_f;
+        m->ud = luaopus_alloc_ud;
+    } else {
+        m->f = lua_getallocf(L,&m->ud);
+    }
+    if(luaopus_mem_take(m,type,size) == NULL) {
+        return NULL;
+    }
+
+    /* the collector can't see the block, only the small userdata
+     * holding it. do the GC work it would have done for an
+     * allocation this size, so churning codecs still gets the
+     * old ones finalized */
+    lua_gc(L,LUA_GCSTEP,(int)(size >> 10));
+    return m->ptr;
+}
+
+LUAOPUS_PRIVATE
+void *luaopus_mem_alloc_shared(luaopus_mem *m, int type, size_t size) {
+    if(luaopus_alloc_f != NULL) {
+        m->f = luaopus_alloc_f;
+        m->ud = luaopus_alloc_ud;
+    } else {
+        m->f = luaopus_mem_malloc;
+        m->ud = NULL;
+    }
+    return luaopus_mem_take(m,type,size);
+}
+
+LUAOPUS_PRIVATE
+void *luaopus_mem_realloc_shared(luaopus_mem *m, int type, size_t size) {
+    void *ptr = NULL;
+
+    if(m->ptr == NULL) {
+        return luaopus_mem_alloc_shared(m,type,size);
+    }
+
+    ptr = m->f(m->ud,m->ptr,m->size,size);
+    if(ptr == NULL) {
+        return NULL;
+    }
+
+    luaopus_memstat_resize(&luaopus_memstats[m->type],m->size,size);
+    luaopus_memstat_resize(&luaopus_memstats[LUAOPUS_MEM_TYPES],m->size,size);
+    m->ptr = ptr;
+    m->size = size;
+    return ptr;
+}
+
+LUAOPUS_PRIVATE
+void luaopus_mem_free(luaopus_mem *m) {
+    luaopus_mem block;
+
+    if(m->ptr == NULL) return;
+
+    /* m may live inside the block it describes,
+     * so it's done with before the block goes */
+    block = *m;
+    m->ptr = NULL;
+    m->size = 0;
+
+    luaopus_memstat_sub(&luaopus_memstats[block.type],block.size);
+    luaopus_memstat_sub(&luaopus_memstats[LUAOPUS_MEM_TYPES],block.size);
+    block.f(block.ud,block.ptr,block.size,0);
+}
+
+static void
+luaopus_memstat_push(lua_State *L, const luaopus_memstat *s) {
+    lua_createtable(L,0,4);
+    lua_pushnumber(L,(lua_Number)s->live);
+    lua_setfield(L,-2,"live");
+    lua_pushnumber(L,(lua_Number)s->peak);
+    lua_setfield(L,-2,"peak");
+    lua_pushnumber(L,(lua_Number)s->count);
+    lua_setfield(L,-2,"count");
+    lua_pushnumber(L,(lua_Number)s->total);
+    lua_setfield(L,-2,"total");
+}
+
+/* returns { encoder = {...}, decoder = {...}, cache = {...},
+ * scheduler = {...}, total = {...} } */
+static int
+luaopus_memory_stats(lua_State *L) {
+    int i = 0;
+
+    lua_createtable(L,0,LUAOPUS_MEM_TYPES + 1);
+    for(i=0;i<LUAOPUS_MEM_TYPES;i++) {
+        luaopus_memstat_push(L,&luaopus_memstats[i]);
+        lua_setfield(L,-2,luaopus_mem_names[i]);
+    }
+    luaopus_memstat_push(L,&luaopus_memstats[LUAOPUS_MEM_TYPES]);
+    lua_setfield(L,-2,"total");
+    return 1;
+}
+
+static int
+luaopus_memory_reset_peak(lua_State *L) {
+    int i = 0;
+
+    for(i=0;i<=LUAOPUS_MEM_TYPES;i++) {
+        luaopus_memstats[i].peak = luaopus_memstats[i].live;
+    }
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static const struct luaL_Reg luaopus_memory_functions[] = {
+    { "opus_memory_stats", luaopus_memory_stats },
+    { "opus_memory_reset_peak", luaopus_memory_reset_peak },
+    { NULL, NULL },
+};
+
+LUAOPUS_PRIVATE
+void luaopus_memory_register(lua_State *L) {
+    luaL_setfuncs(L,luaopus_memory_functions,0);
+}
+
+LUAOPUS_PUBLIC
+int luaopen_luaopus_memory(lua_State *L) {
+    lua_newtable(L);
+    luaopus_memory_register(L);
+    return 1;
+}
@@ -0,0 +1,443 @@
+#include "luaopus_internal.h"
+#include <opus/opus_defines.h>
+#include <math.h>
+#include <string.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* loudness bins start at this value, in LUFS */
+#define BIN_FLOOR -70.0
+
+const char * const luaopus_meter_mt = "OpusMeter";
+
+static double
+luaopus_meter_loudness(double ms) {
+    if(ms <= 0.0) {
+        return -HUGE_VAL;
+    }
+    return -0.691 + (10.0 * log10(ms));
+}
+
+/* coefficients from ITU-R BS.1770, re-derived for
+ * sample rates other than 48kHz */
+static void
+luaopus_meter_filters(luaopus_meter *m) {
+    double f0 = 1681.974450955533;
+    double G = 3.999843853973347;
+    double Q = 0.7071752369554196;
+    double K = tan(M_PI * f0 / (double)m->Fs);
+    double Vh = pow(10.0, G / 20.0);
+    double Vb = pow(Vh, 0.4996667741545416);
+    double a0 = 1.0 + K / Q + K * K;
+
+    m->b[0][0] = (Vh + Vb * K / Q + K * K) / a0;
+    m->b[0][1] = 2.0 * (K * K - Vh) / a0;
+    m->b[0][2] = (Vh - Vb * K / Q + K * K) / a0;
+    m->a[0][0] = 1.0;
+    m->a[0][1] = 2.0 * (K * K - 1.0) / a0;
+    m->a[0][2] = (1.0 - K / Q + K * K) / a0;
+
+    f0 = 38.13547087602444;
+    Q = 0.5003270373238773;
+    K = tan(M_PI * f0 / (double)m->Fs);
+    a0 = 1.0 + K / Q + K * K;
+
+    m->b[1][0] = 1.0;
+    m->b[1][1] = -2.0;
+    m->b[1][2] = 1.0;
+    m->a[1][0] = 1.0;
+    m->a[1][1] = 2.0 * (K * K - 1.0) / a0;
+    m->a[1][2] = (1.0 - K / Q + K * K) / a0;
+}
+
+/* windowed-sinc interpolator, split into 4 phases */
+static void
+luaopus_meter_oversampler(luaopus_meter *m) {
+    int taps = 4 * LUAOPUS_METER_TAPS;
+    double center = (double)(taps - 1) / 2.0;
+    double x = 0.0;
+    double h = 0.0;
+    int n = 0;
+
+    for(n=0;n<taps;n++) {
+        x = ((double)n - center) / 4.0;
+        h = x == 0.0 ? 1.0 : sin(M_PI * x) / (M_PI * x);
+        h *= 0.5 - 0.5 * cos(2.0 * M_PI * ((double)n + 0.5) / (double)taps);
+        m->tp_coef[n % 4][n / 4] = (float)h;
+    }
+}
+
+static void
+luaopus_meter_reset(luaopus_meter *m) {
+    memset(m->z,0,sizeof(m->z));
+    memset(m->blocks,0,sizeof(m->blocks));
+    memset(m->bins,0,sizeof(m->bins));
+    memset(m->bin_energy,0,sizeof(m->bin_energy));
+    memset(m->tp_hist,0,sizeof(m->tp_hist));
+    m->block_fill = 0;
+    m->block_sum = 0.0;
+    m->block_pos = 0;
+    m->block_count = 0;
+    m->tp_pos = 0;
+    m->true_peak = 0.0;
+    m->sample_peak = 0.0;
+}
+
+/* mean square over the most recent count sub-blocks */
+static double
+luaopus_meter_window(const luaopus_meter *m, int count) {
+    double sum = 0.0;
+    int i = 0;
+    int pos = m->block_pos;
+
+    if(count > m->block_count) count = m->block_count;
+    if(count == 0) return 0.0;
+
+    for(i=0;i<count;i++) {
+        pos = pos == 0 ? LUAOPUS_METER_BLOCKS - 1 : pos - 1;
+        sum += m->blocks[pos];
+    }
+    return sum / (double)count;
+}
+
+static void
+luaopus_meter_block(luaopus_meter *m) {
+    double ms = 0.0;
+    double lufs = 0.0;
+    int bin = 0;
+
+    m->blocks[m->block_pos] = m->block_sum / (double)m->block_size;
+    m->block_pos = (m->block_pos + 1) % LUAOPUS_METER_BLOCKS;
+    if(m->block_count < LUAOPUS_METER_BLOCKS) m->block_count++;
+    m->block_sum = 0.0;
+    m->block_fill = 0;
+
+    /* gating blocks are 400ms, overlapping by 75% */
+    if(m->block_count < 4) return;
+
+    ms = luaopus_meter_window(m,4);
+    lufs = luaopus_meter_loudness(ms);
+    if(lufs < BIN_FLOOR) return;
+
+    bin = (int)((lufs - BIN_FLOOR) * 10.0);
+    if(bin >= LUAOPUS_METER_BINS) bin = LUAOPUS_METER_BINS - 1;
+    m->bins[bin]++;
+    m->bin_energy[bin] += ms;
+}
+
+static void
+luaopus_meter_frame(luaopus_meter *m, const float *x) {
+    double y = 0.0;
+    double z = 0.0;
+    double sum = 0.0;
+    float peak = 0.0f;
+    float v = 0.0f;
+    int c = 0;
+    int s = 0;
+    int p = 0;
+    int t = 0;
+
+    for(c=0;c<m->channels;c++) {
+        y = (double)x[c];
+        for(s=0;s<2;s++) {
+            z = y;
+            y = m->b[s][0] * z + m->z[c][s][0];
+            m->z[c][s][0] = m->b[s][1] * z - m->a[s][1] * y + m->z[c][s][1];
+            m->z[c][s][1] = m->b[s][2] * z - m->a[s][2] * y;
+        }
+        sum += y * y;
+
+        v = x[c] < 0.0f ? -x[c] : x[c];
+        if(v > m->sample_peak) m->sample_peak = v;
+
+        m->tp_hist[c][m->tp_pos] = x[c];
+        for(p=0;p<4;p++) {
+            v = 0.0f;
+            s = m->tp_pos;
+            for(t=0;t<LUAOPUS_METER_TAPS;t++) {
+                v += m->tp_coef[p][t] * m->tp_hist[c][s];
+                s = s == 0 ? LUAOPUS_METER_TAPS - 1 : s - 1;
+            }
+            if(v < 0.0f) v = -v;
+            if(v > peak) peak = v;
+        }
+    }
+    m->tp_pos = (m->tp_pos + 1) % LUAOPUS_METER_TAPS;
+
+    if(peak > m->true_peak) m->true_peak = peak;
+
+    m->block_sum += sum;
+    if(++m->block_fill == m->block_size) {
+        luaopus_meter_block(m);
+    }
+}
+
+LUAOPUS_PRIVATE
+void luaopus_meter_float(luaopus_meter *m, const float *pcm, int frame_size) {
+    int f = 0;
+    for(f=0;f<frame_size;f++) {
+        luaopus_meter_frame(m,pcm);
+        pcm += m->channels;
+    }
+}
+
+LUAOPUS_PRIVATE
+void luaopus_meter_int16(luaopus_meter *m, const opus_int16 *pcm, int frame_size) {
+    float x[LUAOPUS_CHANMAP_MAX];
+    int f = 0;
+    int c = 0;
+    for(f=0;f<frame_size;f++) {
+        for(c=0;c<m->channels;c++) {
+            x[c] = (float)pcm[c] / 32768.0f;
+        }
+        luaopus_meter_frame(m,x);
+        pcm += m->channels;
+    }
+}
+
+static double
+luaopus_meter_integrated(const luaopus_meter *m) {
+    double sum = 0.0;
+    double gate = 0.0;
+    unsigned long count = 0;
+    int start = 0;
+    int i = 0;
+
+    for(i=0;i<LUAOPUS_METER_BINS;i++) {
+        sum += m->bin_energy[i];
+        count += m->bins[i];
+    }
+    if(count == 0) {
+        return -HUGE_VAL;
+    }
+
+    /* relative gate sits 10 LU below the absolute-gated loudness */
+    gate = luaopus_meter_loudness(sum / (double)count) - 10.0;
+    start = (int)((gate - BIN_FLOOR) * 10.0);
+    if(start < 0) start = 0;
+
+    sum = 0.0;
+    count = 0;
+    for(i=start;i<LUAOPUS_METER_BINS;i++) {
+        sum += m->bin_energy[i];
+        count += m->bins[i];
+    }
+    if(count == 0) {
+        return -HUGE_VAL;
+    }
+    return luaopus_meter_loudness(sum / (double)count);
+}
+
+static double
+luaopus_meter_decibels(double v) {
+    if(v <= 0.0) {
+        return -HUGE_VAL;
+    }
+    return 20.0 * log10(v);
+}
+
+static int
+luaopus_OpusMeter(lua_State *L) {
+    luaopus_meter *m = NULL;
+    opus_int32 Fs = 0;
+    int channels = 0;
+
+    Fs = luaL_checkinteger(L,1);
+    channels = luaL_checkinteger(L,2);
+
+    if(Fs < 8000 || channels < 1 || channels > LUAOPUS_CHANMAP_MAX) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_BAD_ARG);
+        return 2;
+    }
+
+    m = lua_newuserdata(L,sizeof(luaopus_meter));
+    if(m == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+
+    m->Fs = Fs;
+    m->channels = channels;
+    m->block_size = Fs / 10;
+    luaopus_meter_filters(m);
+    luaopus_meter_oversampler(m);
+    luaopus_meter_reset(m);
+
+    luaL_setmetatable(L,luaopus_meter_mt);
+    return 1;
+}
+
+static int
+luaopus_meter_reset_state(lua_State *L) {
+    luaopus_meter *m = luaL_checkudata(L,1,luaopus_meter_mt);
+    luaopus_meter_reset(m);
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luaopus_meter_add(lua_State *L) {
+    luaopus_meter *m = NULL;
+    float x[LUAOPUS_CHANMAP_MAX];
+    int samples = 0;
+    int i = 0;
+
+    m = luaL_checkudata(L,1,luaopus_meter_mt);
+    luaL_checktype(L,2,LUA_TTABLE);
+    samples = lua_rawlen(L,2);
+    samples -= samples % m->channels;
+
+    while(i<samples) {
+        lua_rawgeti(L,2,i+1);
+        x[i % m->channels] = (float)lua_tonumber(L,-1) / 32768.0f;
+        lua_pop(L,1);
+        if(++i % m->channels == 0) {
+            luaopus_meter_frame(m,x);
+        }
+    }
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luaopus_meter_add_float(lua_State *L) {
+    luaopus_meter *m = NULL;
+    float x[LUAOPUS_CHANMAP_MAX];
+    int samples = 0;
+    int i = 0;
+
+    m = luaL_checkudata(L,1,luaopus_meter_mt);
+    luaL_checktype(L,2,LUA_TTABLE);
+    samples = lua_rawlen(L,2);
+    samples -= samples % m->channels;
+
+    while(i<samples) {
+        lua_rawgeti(L,2,i+1);
+        x[i % m->channels] = (float)lua_tonumber(L,-1);
+        lua_pop(L,1);
+        if(++i % m->channels == 0) {
+            luaopus_meter_frame(m,x);
+        }
+    }
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luaopus_meter_momentary(lua_State *L) {
+    luaopus_meter *m = luaL_checkudata(L,1,luaopus_meter_mt);
+    lua_pushnumber(L,luaopus_meter_loudness(luaopus_meter_window(m,4)));
+    return 1;
+}
+
+static int
+luaopus_meter_shortterm(lua_State *L) {
+    luaopus_meter *m = luaL_checkudata(L,1,luaopus_meter_mt);
+    lua_pushnumber(L,luaopus_meter_loudness(luaopus_meter_window(m,LUAOPUS_METER_BLOCKS)));
+    return 1;
+}
+
+static int
+luaopus_meter_integrated_loudness(lua_State *L) {
+    luaopus_meter *m = luaL_checkudata(L,1,luaopus_meter_mt);
+    lua_pushnumber(L,luaopus_meter_integrated(m));
+    return 1;
+}
+
+static int
+luaopus_meter_true_peak(lua_State *L) {
+    luaopus_meter *m = luaL_checkudata(L,1,luaopus_meter_mt);
+    lua_pushnumber(L,luaopus_meter_decibels(m->true_peak));
+    return 1;
+}
+
+static int
+luaopus_meter_sample_peak(lua_State *L) {
+    luaopus_meter *m = luaL_checkudata(L,1,luaopus_meter_mt);
+    lua_pushnumber(L,luaopus_meter_decibels(m->sample_peak));
+    return 1;
+}
+
+/* gain in Q7.8 dB, the unit used by OPUS_SET_GAIN
+ * and the OpusHead output gain field */
+static int
+luaopus_meter_gain(lua_State *L) {
+    luaopus_meter *m = NULL;
+    double target = 0.0;
+    double lufs = 0.0;
+    double gain = 0.0;
+
+    m = luaL_checkudata(L,1,luaopus_meter_mt);
+    target = luaL_optnumber(L,2,-23.0);
+    lufs = luaopus_meter_integrated(m);
+
+    if(lufs == -HUGE_VAL) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_INVALID_STATE);
+        return 2;
+    }
+
+    gain = floor(((target - lufs) * 256.0) + 0.5);
+    if(gain > 32767.0) gain = 32767.0;
+    else if(gain < -32768.0) gain = -32768.0;
+
+    lua_pushinteger(L,(lua_Integer)gain);
+    return 1;
+}
+
+static const struct luaL_Reg luaopus_meter_functions[] = {
+    { "OpusMeter", luaopus_OpusMeter },
+    { "opus_meter_reset", luaopus_meter_reset_state },
+    { "opus_meter_add", luaopus_meter_add },
+    { "opus_meter_add_float", luaopus_meter_add_float },
+    { "opus_meter_momentary", luaopus_meter_momentary },
+    { "opus_meter_shortterm", luaopus_meter_shortterm },
+    { "opus_meter_integrated", luaopus_meter_integrated_loudness },
+    { "opus_meter_true_peak", luaopus_meter_true_peak },
+    { "opus_meter_sample_peak", luaopus_meter_sample_peak },
+    { "opus_meter_gain", luaopus_meter_gain },
+    { NULL, NULL },
+};
+
+static const luaopus_metamethods luaopus_meter_metamethods[] = {
+    { "opus_meter_reset", "reset" },
+    { "opus_meter_add", "add" },
+    { "opus_meter_add_float", "add_float" },
+    { "opus_meter_momentary", "momentary" },
+    { "opus_meter_shortterm", "shortterm" },
+    { "opus_meter_integrated", "integrated" },
+    { "opus_meter_true_peak", "true_peak" },
+    { "opus_meter_sample_peak", "sample_peak" },
+    { "opus_meter_gain", "gain" },
+    { NULL, NULL },
+};
+
+LUAOPUS_PRIVATE
+void luaopus_meter_register(lua_State *L) {
+    const luaopus_metamethods *m = luaopus_meter_metamethods;
+
+    luaL_setfuncs(L,luaopus_meter_functions,0);
+
+    if(luaL_newmetatable(L,luaopus_meter_mt)) {
+        lua_newtable(L);
+        while(m->name != NULL) {
+            lua_getfield(L,-3,m->name);
+            lua_setfield(L,-2,m->metaname);
+            m++;
+        }
+
+        lua_setfield(L,-2,"__index");
+    }
+    lua_pop(L,1);
+}
+
+LUAOPUS_PUBLIC
+int luaopen_luaopus_meter(lua_State *L) {
+    lua_newtable(L);
+    luaopus_meter_register(L);
+    return 1;
+}
@@ -0,0 +1,408 @@
+#include "luaopus_internal.h"
+#include <opus/opus.h>
+#include <string.h>
+
+/* registry key for this lua_State's pool */
+static const char * const luaopus_pool_key = "luaopus.pool";
+
+#define POOL_DEFAULT_MAX 64
+
+/* the pool's uservalue table holds two tables:
+ * lists - free objects, by "e:Fs:channels:application"
+ *         or "d:Fs:channels"
+ * free  - set of objects currently in the pool, so they
+ *         can't be released twice */
+typedef struct luaopus_pool_s {
+    int max;
+    int size;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long releases;
+    unsigned long discards;
+} luaopus_pool;
+
+/* pushes the pool's uservalue table and returns the pool */
+static luaopus_pool *
+luaopus_pool_get(lua_State *L) {
+    luaopus_pool *p = NULL;
+
+    lua_getfield(L,LUA_REGISTRYINDEX,luaopus_pool_key);
+    p = lua_touserdata(L,-1);
+    if(p == NULL) {
+        lua_pop(L,1);
+        p = lua_newuserdata(L,sizeof(luaopus_pool));
+        if(p == NULL) {
+            luaL_error(L,"out of memory");
+            return NULL;
+        }
+        memset(p,0,sizeof(luaopus_pool));
+        p->max = POOL_DEFAULT_MAX;
+
+        lua_createtable(L,0,2);
+        lua_newtable(L);
+        lua_setfield(L,-2,"lists");
+        lua_newtable(L);
+        lua_setfield(L,-2,"free");
+        lua_setuservalue(L,-2);
+
+        lua_pushvalue(L,-1);
+        lua_setfield(L,LUA_REGISTRYINDEX,luaopus_pool_key);
+    }
+
+    lua_getuservalue(L,-1);
+    lua_remove(L,-2);
+    return p;
+}
+
+static void
+luaopus_pool_push_encoder_key(lua_State *L, opus_int32 Fs, int channels, int application) {
+    lua_pushfstring(L,"e:%d:%d:%d",(int)Fs,channels,application);
+}
+
+static void
+luaopus_pool_push_decoder_key(lua_State *L, opus_int32 Fs, int channels) {
+    lua_pushfstring(L,"d:%d:%d",(int)Fs,channels);
+}
+
+/* takes an object from the list named by the key on top of the
+ * stack (which it pops). t is the uservalue table index.
+ * leaves the object, or nil */
+static void
+luaopus_pool_take(lua_State *L, luaopus_pool *p, int t) {
+    int n = 0;
+
+    lua_getfield(L,t,"lists");
+    lua_insert(L,-2);
+    lua_rawget(L,-2);
+    lua_remove(L,-2);
+
+    if(lua_isnil(L,-1)) {
+        return;
+    }
+
+    n = lua_rawlen(L,-1);
+    if(n == 0) {
+        lua_pop(L,1);
+        lua_pushnil(L);
+        return;
+    }
+
+    lua_rawgeti(L,-1,n);
+    lua_pushnil(L);
+    lua_rawseti(L,-3,n);
+    lua_remove(L,-2);
+    p->size--;
+
+    lua_getfield(L,t,"free");
+    lua_pushvalue(L,-2);
+    lua_pushnil(L);
+    lua_rawset(L,-3);
+    lua_pop(L,1);
+}
+
+/* adds the object at idx to the list named by the key on
+ * top of the stack (which it pops). t is the uservalue table index */
+static void
+luaopus_pool_put(lua_State *L, luaopus_pool *p, int t, int idx) {
+    lua_getfield(L,t,"lists");
+    lua_pushvalue(L,-2);
+    lua_rawget(L,-2);
+    if(lua_isnil(L,-1)) {
+        lua_pop(L,1);
+        lua_newtable(L);
+        lua_pushvalue(L,-3);
+        lua_pushvalue(L,-2);
+        lua_rawset(L,-4);
+    }
+
+    lua_pushvalue(L,idx);
+    lua_rawseti(L,-2,lua_rawlen(L,-2) + 1);
+    lua_pop(L,3);
+    p->size++;
+
+    lua_getfield(L,t,"free");
+    lua_pushvalue(L,idx);
+    lua_pushboolean(L,1);
+    lua_rawset(L,-3);
+    lua_pop(L,1);
+}
+
+/* drops objects until the pool fits within max */
+static void
+luaopus_pool_trim(lua_State *L, luaopus_pool *p, int t) {
+    int n = 0;
+
+    lua_getfield(L,t,"lists");
+    lua_getfield(L,t,"free");
+    lua_pushnil(L);
+    while(p->size > p->max && lua_next(L,-3) != 0) {
+        n = lua_rawlen(L,-1);
+        while(p->size > p->max && n > 0) {
+            lua_rawgeti(L,-1,n);
+            lua_pushnil(L);
+            lua_rawset(L,-5);
+            lua_pushnil(L);
+            lua_rawseti(L,-2,n);
+            n--;
+            p->size--;
+            p->discards++;
+        }
+        lua_pop(L,1);
+    }
+    lua_settop(L,t);
+}
+
+static int
+luaopus_pool_acquire_encoder(lua_State *L) {
+    luaopus_pool *p = NULL;
+    luaopus_encoder *u = NULL;
+    opus_int32 Fs = 0;
+    int channels = 0;
+    int application = 0;
+    int result = 0;
+
+    Fs = luaL_checkinteger(L,1);
+    channels = luaL_checkinteger(L,2);
+    application = luaL_checkinteger(L,3);
+    lua_settop(L,3);
+
+    p = luaopus_pool_get(L);
+    luaopus_pool_push_encoder_key(L,Fs,channels,application);
+    luaopus_pool_take(L,p,4);
+
+    if(!lua_isnil(L,-1)) {
+        p->hits++;
+        return 1;
+    }
+    lua_pop(L,1);
+    p->misses++;
+
+    u = luaopus_encoder_new(L);
+    result = luaopus_encoder_setup(L,lua_gettop(L),u,Fs,channels,application);
+    if(result != OPUS_OK) {
+        lua_pushnil(L);
+        lua_pushinteger(L,result);
+        return 2;
+    }
+    return 1;
+}
+
+static int
+luaopus_pool_acquire_decoder(lua_State *L) {
+    luaopus_pool *p = NULL;
+    luaopus_decoder *u = NULL;
+    opus_int32 Fs = 0;
+    int channels = 0;
+    int result = 0;
+
+    Fs = luaL_checkinteger(L,1);
+    channels = luaL_checkinteger(L,2);
+    lua_settop(L,2);
+
+    p = luaopus_pool_get(L);
+    luaopus_pool_push_decoder_key(L,Fs,channels);
+    luaopus_pool_take(L,p,3);
+
+    if(!lua_isnil(L,-1)) {
+        p->hits++;
+        return 1;
+    }
+    lua_pop(L,1);
+    p->misses++;
+
+    u = luaopus_decoder_new(L);
+    result = luaopus_decoder_setup(L,lua_gettop(L),u,Fs,channels);
+    if(result != OPUS_OK) {
+        lua_pushnil(L);
+        lua_pushinteger(L,result);
+        return 2;
+    }
+    return 1;
+}
+
+/* resets the object and pushes its list key, returns
+ * an opus error if it can't be pooled. the reset puts the
+ * ctls back to their defaults by hand, which is much cheaper
+ * than init (on newer libopus that reloads the PLC and DRED
+ * models) */
+static int
+luaopus_pool_reset(lua_State *L, int idx) {
+    luaopus_encoder *e = NULL;
+    luaopus_decoder *d = NULL;
+    opus_int32 application = 0;
+    int result = OPUS_BAD_ARG;
+
+    if((e = luaL_testudata(L,idx,luaopus_encoder_mt)) != NULL) {
+        if(e->channels == 0) return OPUS_BAD_ARG;
+        result = opus_encoder_ctl(e->encoder, OPUS_GET_APPLICATION(&application));
+        if(result != OPUS_OK) return result;
+        result = luaopus_encoder_reset(L,idx,e);
+        if(result != OPUS_OK) return result;
+        luaopus_pool_push_encoder_key(L,e->Fs,e->channels,application);
+    } else if((d = luaL_testudata(L,idx,luaopus_decoder_mt)) != NULL) {
+        if(d->channels == 0) return OPUS_BAD_ARG;
+        result = luaopus_decoder_reset(L,idx,d);
+        if(result != OPUS_OK) return result;
+        luaopus_pool_push_decoder_key(L,d->Fs,d->channels);
+    }
+
+    return result;
+}
+
+static int
+luaopus_pool_release(lua_State *L) {
+    luaopus_pool *p = NULL;
+    int result = 0;
+
+    lua_settop(L,1);
+    p = luaopus_pool_get(L);
+
+    lua_getfield(L,2,"free");
+    lua_pushvalue(L,1);
+    lua_rawget(L,-2);
+    if(lua_toboolean(L,-1)) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_INVALID_STATE);
+        return 2;
+    }
+    lua_settop(L,2);
+
+    result = luaopus_pool_reset(L,1);
+    if(result != OPUS_OK) {
+        lua_pushnil(L);
+        lua_pushinteger(L,result);
+        return 2;
+    }
+
+    p->releases++;
+    if(p->size >= p->max) {
+        p->discards++;
+    } else {
+        luaopus_pool_put(L,p,2,1);
+    }
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+/* pre-fills the pool, shared by reserve_encoder and
+ * reserve_decoder. key is at idx 4 */
+static int
+luaopus_pool_reserve(lua_State *L, int is_encoder) {
+    luaopus_pool *p = NULL;
+    opus_int32 Fs = 0;
+    int channels = 0;
+    int application = 0;
+    int count = 0;
+    int result = 0;
+    void *u = NULL;
+
+    Fs = luaL_checkinteger(L,1);
+    channels = luaL_checkinteger(L,2);
+    if(is_encoder) {
+        application = luaL_checkinteger(L,3);
+        count = luaL_optinteger(L,4,1);
+    } else {
+        count = luaL_optinteger(L,3,1);
+    }
+    lua_settop(L,0);
+
+    p = luaopus_pool_get(L);
+    if(is_encoder) {
+        luaopus_pool_push_encoder_key(L,Fs,channels,application);
+    } else {
+        luaopus_pool_push_decoder_key(L,Fs,channels);
+    }
+
+    while(count-- > 0 && p->size < p->max) {
+        if(is_encoder) {
+            u = luaopus_encoder_new(L);
+            result = luaopus_encoder_setup(L,3,u,Fs,channels,application);
+        } else {
+            u = luaopus_decoder_new(L);
+            result = luaopus_decoder_setup(L,3,u,Fs,channels);
+        }
+        if(result != OPUS_OK) {
+            lua_pushnil(L);
+            lua_pushinteger(L,result);
+            return 2;
+        }
+        lua_pushvalue(L,2);
+        luaopus_pool_put(L,p,1,3);
+        lua_pop(L,1);
+    }
+
+    lua_pushinteger(L,p->size);
+    return 1;
+}
+
+static int
+luaopus_pool_reserve_encoder(lua_State *L) {
+    return luaopus_pool_reserve(L,1);
+}
+
+static int
+luaopus_pool_reserve_decoder(lua_State *L) {
+    return luaopus_pool_reserve(L,0);
+}
+
+static int
+luaopus_pool_set_max(lua_State *L) {
+    luaopus_pool *p = NULL;
+    int max = 0;
+
+    max = luaL_checkinteger(L,1);
+    lua_settop(L,0);
+    p = luaopus_pool_get(L);
+    p->max = max < 0 ? 0 : max;
+    luaopus_pool_trim(L,p,1);
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luaopus_pool_stats(lua_State *L) {
+    luaopus_pool *p = NULL;
+
+    p = luaopus_pool_get(L);
+    lua_pop(L,1);
+
+    lua_createtable(L,0,6);
+    lua_pushinteger(L,p->size);
+    lua_setfield(L,-2,"size");
+    lua_pushinteger(L,p->max);
+    lua_setfield(L,-2,"max");
+    lua_pushinteger(L,p->hits);
+    lua_setfield(L,-2,"hits");
+    lua_pushinteger(L,p->misses);
+    lua_setfield(L,-2,"misses");
+    lua_pushinteger(L,p->releases);
+    lua_setfield(L,-2,"releases");
+    lua_pushinteger(L,p->discards);
+    lua_setfield(L,-2,"discards");
+    return 1;
+}
+
+static const struct luaL_Reg luaopus_pool_functions[] = {
+    { "opus_pool_acquire_encoder", luaopus_pool_acquire_encoder },
+    { "opus_pool_acquire_decoder", luaopus_pool_acquire_decoder },
+    { "opus_pool_release", luaopus_pool_release },
+    { "opus_pool_reserve_encoder", luaopus_pool_reserve_encoder },
+    { "opus_pool_reserve_decoder", luaopus_pool_reserve_decoder },
+    { "opus_pool_set_max", luaopus_pool_set_max },
+    { "opus_pool_stats", luaopus_pool_stats },
+    { NULL, NULL },
+};
+
+LUAOPUS_PRIVATE
+void luaopus_pool_register(lua_State *L) {
+    luaL_setfuncs(L,luaopus_pool_functions,0);
+}
+
+LUAOPUS_PUBLIC
+int luaopen_luaopus_pool(lua_State *L) {
+    lua_newtable(L);
+    luaopus_pool_register(L);
+    return 1;
+}
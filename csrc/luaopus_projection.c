@@ -0,0 +1,715 @@
+#include "luaopus_internal.h"
+#include <opus/opus.h>
+
+/* cmake checks for the header, anything else can
+ * get by with __has_include */
+#if !defined(LUAOPUS_HAVE_PROJECTION) && defined(__has_include)
+#if __has_include(<opus/opus_projection.h>)
+#define LUAOPUS_HAVE_PROJECTION 1
+#endif
+#endif
+
+#ifdef LUAOPUS_HAVE_PROJECTION
+#include <opus/opus_projection.h>
+
+/* most samples per channel a packet decodes to (120ms at 48kHz) */
+#define MAX_FRAME_SIZE 5760
+
+const char * const luaopus_projection_encoder_mt = "OpusProjectionEncoder";
+const char * const luaopus_projection_decoder_mt = "OpusProjectionDecoder";
+
+/* unlike the plain encoder and decoder, the state size depends
+ * on the channel layout, so the block is (re)allocated by init */
+typedef struct luaopus_projection_encoder_s {
+    /* holds the encoder state and the packet buffer */
+    luaopus_mem mem;
+
+    OpusProjectionEncoder *projection_encoder;
+
+    /* LUAOPUS_MAX_PACKET bytes per stream */
+    unsigned char *buffer;
+    opus_int32 buffer_size;
+
+    opus_int32 Fs;
+    int channels;
+    int streams;
+    int coupled_streams;
+} luaopus_projection_encoder;
+
+typedef struct luaopus_projection_decoder_s {
+    /* holds the decoder state and the sample buffer */
+    luaopus_mem mem;
+
+    OpusProjectionDecoder *projection_decoder;
+
+    /* MAX_FRAME_SIZE samples per channel, float
+     * storage that's also used for int16 */
+    float *pcm_float;
+    opus_int16 *pcm_int16;
+
+    opus_int32 Fs;
+    int channels;
+    int streams;
+    int coupled_streams;
+} luaopus_projection_decoder;
+
+/* allocates the state, returns an opus error code */
+static int
+luaopus_projection_encoder_setup(lua_State *L, luaopus_projection_encoder *u, opus_int32 Fs, int channels, int mapping_family, int application) {
+    luaopus_mem mem;
+    unsigned char *block = NULL;
+    opus_int32 state_size = 0;
+    int streams = 0;
+    int coupled_streams = 0;
+    int result = 0;
+
+    state_size = opus_projection_ambisonics_encoder_get_size(channels,mapping_family);
+    if(state_size <= 0) {
+        return OPUS_BAD_ARG;
+    }
+
+    /* streams aren't known until after init, but there's
+     * never more of them than channels */
+    block = luaopus_mem_alloc(L,&mem,LUAOPUS_MEM_ENCODER,
+      LUAOPUS_MEM_ALIGN((size_t)state_size) + ((size_t)LUAOPUS_MAX_PACKET * channels));
+    if(block == NULL) {
+        return OPUS_ALLOC_FAIL;
+    }
+
+    result = opus_projection_ambisonics_encoder_init((OpusProjectionEncoder *)block,
+      Fs,channels,mapping_family,&streams,&coupled_streams,application);
+    if(result != OPUS_OK) {
+        luaopus_mem_free(&mem);
+        return result;
+    }
+
+    luaopus_mem_free(&u->mem);
+    u->mem = mem;
+    u->projection_encoder = (OpusProjectionEncoder *)block;
+    u->buffer = block + LUAOPUS_MEM_ALIGN((size_t)state_size);
+    u->buffer_size = LUAOPUS_MAX_PACKET * streams;
+    u->Fs = Fs;
+    u->channels = channels;
+    u->streams = streams;
+    u->coupled_streams = coupled_streams;
+    return OPUS_OK;
+}
+
+static int
+luaopus_projection_decoder_setup(lua_State *L, luaopus_projection_decoder *u, opus_int32 Fs, int channels, int streams, int coupled_streams, const unsigned char *matrix, size_t matrix_size) {
+    luaopus_mem mem;
+    unsigned char *block = NULL;
+    opus_int32 state_size = 0;
+    int result = 0;
+
+    if(channels < 1 || streams < 1 || coupled_streams < 0 || coupled_streams > streams) {
+        return OPUS_BAD_ARG;
+    }
+
+    state_size = opus_projection_decoder_get_size(channels,streams,coupled_streams);
+    if(state_size <= 0) {
+        return OPUS_BAD_ARG;
+    }
+
+    block = luaopus_mem_alloc(L,&mem,LUAOPUS_MEM_DECODER,
+      LUAOPUS_MEM_ALIGN((size_t)state_size) + (sizeof(float) * MAX_FRAME_SIZE * channels));
+    if(block == NULL) {
+        return OPUS_ALLOC_FAIL;
+    }
+
+    /* libopus doesn't write to the matrix, it just isn't const */
+    result = opus_projection_decoder_init((OpusProjectionDecoder *)block,
+      Fs,channels,streams,coupled_streams,(unsigned char *)matrix,(opus_int32)matrix_size);
+    if(result != OPUS_OK) {
+        luaopus_mem_free(&mem);
+        return result;
+    }
+
+    luaopus_mem_free(&u->mem);
+    u->mem = mem;
+    u->projection_decoder = (OpusProjectionDecoder *)block;
+    u->pcm_float = (float *)(block + LUAOPUS_MEM_ALIGN((size_t)state_size));
+    u->pcm_int16 = (opus_int16 *)u->pcm_float;
+    u->Fs = Fs;
+    u->channels = channels;
+    u->streams = streams;
+    u->coupled_streams = coupled_streams;
+    return OPUS_OK;
+}
+
+static int
+luaopus_projection_encoder_init(lua_State *L) {
+    luaopus_projection_encoder *u = NULL;
+    int result = 0;
+
+    u = luaL_checkudata(L,1,luaopus_projection_encoder_mt);
+    result = luaopus_projection_encoder_setup(L,u,
+      luaL_checkinteger(L,2),
+      luaL_checkinteger(L,3),
+      luaL_checkinteger(L,4),
+      luaL_checkinteger(L,5));
+
+    if(result != OPUS_OK) {
+        lua_pushnil(L);
+        lua_pushinteger(L,result);
+        return 2;
+    }
+
+    lua_pushinteger(L,u->streams);
+    lua_pushinteger(L,u->coupled_streams);
+    return 2;
+}
+
+static int
+luaopus_OpusProjectionEncoder(lua_State *L) {
+    luaopus_projection_encoder *u = NULL;
+    int result = 0;
+
+    u = lua_newuserdata(L,sizeof(luaopus_projection_encoder));
+    if(u == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    u->mem.ptr = NULL;
+    u->projection_encoder = NULL;
+    luaL_setmetatable(L,luaopus_projection_encoder_mt);
+
+    result = luaopus_projection_encoder_setup(L,u,
+      luaL_checkinteger(L,1),
+      luaL_checkinteger(L,2),
+      luaL_checkinteger(L,3),
+      luaL_checkinteger(L,4));
+
+    if(result != OPUS_OK) {
+        lua_pushnil(L);
+        lua_pushinteger(L,result);
+        return 2;
+    }
+
+    lua_pushinteger(L,u->streams);
+    lua_pushinteger(L,u->coupled_streams);
+    return 3;
+}
+
+static int
+luaopus_OpusProjectionEncoder_delete(lua_State *L) {
+    luaopus_projection_encoder *u = NULL;
+
+    u = luaL_checkudata(L,1,luaopus_projection_encoder_mt);
+    luaopus_mem_free(&u->mem);
+    u->projection_encoder = NULL;
+
+    return 0;
+}
+
+static int
+luaopus_projection_decoder_init(lua_State *L) {
+    luaopus_projection_decoder *u = NULL;
+    const unsigned char *matrix = NULL;
+    size_t matrix_size = 0;
+    int result = 0;
+
+    u = luaL_checkudata(L,1,luaopus_projection_decoder_mt);
+    matrix = (const unsigned char *)luaL_checklstring(L,6,&matrix_size);
+    result = luaopus_projection_decoder_setup(L,u,
+      luaL_checkinteger(L,2),
+      luaL_checkinteger(L,3),
+      luaL_checkinteger(L,4),
+      luaL_checkinteger(L,5),
+      matrix,matrix_size);
+
+    if(result != OPUS_OK) {
+        lua_pushnil(L);
+        lua_pushinteger(L,result);
+        return 2;
+    }
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luaopus_OpusProjectionDecoder(lua_State *L) {
+    luaopus_projection_decoder *u = NULL;
+    const unsigned char *matrix = NULL;
+    size_t matrix_size = 0;
+    int result = 0;
+
+    matrix = (const unsigned char *)luaL_checklstring(L,5,&matrix_size);
+
+    u = lua_newuserdata(L,sizeof(luaopus_projection_decoder));
+    if(u == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    u->mem.ptr = NULL;
+    u->projection_decoder = NULL;
+    luaL_setmetatable(L,luaopus_projection_decoder_mt);
+
+    result = luaopus_projection_decoder_setup(L,u,
+      luaL_checkinteger(L,1),
+      luaL_checkinteger(L,2),
+      luaL_checkinteger(L,3),
+      luaL_checkinteger(L,4),
+      matrix,matrix_size);
+
+    if(result != OPUS_OK) {
+        lua_pushnil(L);
+        lua_pushinteger(L,result);
+        return 2;
+    }
+
+    return 1;
+}
+
+static int
+luaopus_OpusProjectionDecoder_delete(lua_State *L) {
+    luaopus_projection_decoder *u = NULL;
+
+    u = luaL_checkudata(L,1,luaopus_projection_decoder_mt);
+    luaopus_mem_free(&u->mem);
+    u->projection_decoder = NULL;
+
+    return 0;
+}
+
+/* pcm is a string of interleaved native-endian samples,
+ * the frame size is however many the string holds */
+static int
+luaopus_projection_encode_packed(lua_State *L, int is_float) {
+    luaopus_projection_encoder *u = NULL;
+    const char *pcm = NULL;
+    size_t len = 0;
+    size_t frame_bytes = 0;
+    int bytes = 0;
+
+    u = luaL_checkudata(L,1,luaopus_projection_encoder_mt);
+    pcm = luaL_checklstring(L,2,&len);
+
+    frame_bytes = (is_float ? sizeof(float) : sizeof(opus_int16)) * u->channels;
+    if(len % frame_bytes != 0 || len / frame_bytes > MAX_FRAME_SIZE) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_BAD_ARG);
+        return 2;
+    }
+
+    /* lua strings are aligned for any type, so the
+     * samples go to the encoder without a copy */
+    if(is_float) {
+        bytes = opus_projection_encode_float(u->projection_encoder,
+          (const float *)pcm,
+          (int)(len / frame_bytes),
+          u->buffer,
+          u->buffer_size);
+    } else {
+        bytes = opus_projection_encode(u->projection_encoder,
+          (const opus_int16 *)pcm,
+          (int)(len / frame_bytes),
+          u->buffer,
+          u->buffer_size);
+    }
+
+    if(bytes < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L,bytes);
+        return 2;
+    }
+
+    lua_pushlstring(L,(const char *)u->buffer,bytes);
+    return 1;
+}
+
+static int
+luaopus_projection_encode(lua_State *L) {
+    return luaopus_projection_encode_packed(L,0);
+}
+
+static int
+luaopus_projection_encode_float(lua_State *L) {
+    return luaopus_projection_encode_packed(L,1);
+}
+
+/* returns the samples as a string of interleaved native-endian
+ * samples, ready for a file or an FFI cast */
+static int
+luaopus_projection_decode_packed(lua_State *L, int is_float) {
+    luaopus_projection_decoder *u = NULL;
+    const unsigned char *data = NULL;
+    size_t len = 0;
+    int decode_fec = 0;
+    int samples = 0;
+
+    u = luaL_checkudata(L,1,luaopus_projection_decoder_mt);
+    data = (const unsigned char *)luaL_checklstring(L,2,&len);
+    if(lua_isboolean(L,3)) {
+        decode_fec = lua_toboolean(L,3);
+    }
+
+    if(is_float) {
+        samples = opus_projection_decode_float(u->projection_decoder,
+          data,
+          (opus_int32)len,
+          u->pcm_float,
+          MAX_FRAME_SIZE,
+          decode_fec);
+    } else {
+        samples = opus_projection_decode(u->projection_decoder,
+          data,
+          (opus_int32)len,
+          u->pcm_int16,
+          MAX_FRAME_SIZE,
+          decode_fec);
+    }
+
+    if(samples < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L,samples);
+        return 2;
+    }
+
+    lua_pushlstring(L,(const char *)u->pcm_float,
+      (size_t)samples * u->channels * (is_float ? sizeof(float) : sizeof(opus_int16)));
+    return 1;
+}
+
+static int
+luaopus_projection_decode(lua_State *L) {
+    return luaopus_projection_decode_packed(L,0);
+}
+
+static int
+luaopus_projection_decode_float(lua_State *L) {
+    return luaopus_projection_decode_packed(L,1);
+}
+
+static int
+luaopus_projection_encoder_get_streams(lua_State *L) {
+    luaopus_projection_encoder *u = NULL;
+
+    u = luaL_checkudata(L,1,luaopus_projection_encoder_mt);
+    lua_pushinteger(L,u->streams);
+    lua_pushinteger(L,u->coupled_streams);
+    return 2;
+}
+
+static int
+luaopus_projection_decoder_get_streams(lua_State *L) {
+    luaopus_projection_decoder *u = NULL;
+
+    u = luaL_checkudata(L,1,luaopus_projection_decoder_mt);
+    lua_pushinteger(L,u->streams);
+    lua_pushinteger(L,u->coupled_streams);
+    return 2;
+}
+
+/* the demixing matrix a decoder needs, as the bytes that go
+ * in an Ogg Opus header for channel mapping family 3 */
+static int
+luaopus_projection_encoder_ctl_get_DEMIXING_MATRIX(lua_State *L) {
+    luaopus_projection_encoder *u = NULL;
+    unsigned char *matrix = NULL;
+    opus_int32 size = 0;
+    int err = 0;
+
+    u = luaL_checkudata(L,1,luaopus_projection_encoder_mt);
+    err = opus_projection_encoder_ctl(u->projection_encoder,
+      OPUS_PROJECTION_GET_DEMIXING_MATRIX_SIZE(&size));
+    if(err < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L,err);
+        return 2;
+    }
+
+    matrix = (unsigned char *)lua_newuserdata(L,(size_t)size);
+    err = opus_projection_encoder_ctl(u->projection_encoder,
+      OPUS_PROJECTION_GET_DEMIXING_MATRIX(matrix,size));
+    if(err < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L,err);
+        return 2;
+    }
+
+    lua_pushlstring(L,(const char *)matrix,(size_t)size);
+    return 1;
+}
+
+#define LUAOPUS_PROJECTION_ENCODER_SET_INTEGER(f) LUAOPUS_CTL_SET_INTEGER(projection_encoder,f)
+#define LUAOPUS_PROJECTION_ENCODER_GET_INTEGER(f) LUAOPUS_CTL_GET_INTEGER(projection_encoder,f)
+#define LUAOPUS_PROJECTION_ENCODER_GET_UINTEGER(f) LUAOPUS_CTL_GET_UINTEGER(projection_encoder,f)
+#define LUAOPUS_PROJECTION_ENCODER_SET_BOOLEAN(f) LUAOPUS_CTL_SET_BOOLEAN(projection_encoder,f)
+#define LUAOPUS_PROJECTION_ENCODER_GET_BOOLEAN(f) LUAOPUS_CTL_GET_BOOLEAN(projection_encoder,f)
+#define LUAOPUS_PROJECTION_DECODER_SET_INTEGER(f) LUAOPUS_CTL_SET_INTEGER(projection_decoder,f)
+#define LUAOPUS_PROJECTION_DECODER_GET_INTEGER(f) LUAOPUS_CTL_GET_INTEGER(projection_decoder,f)
+#define LUAOPUS_PROJECTION_DECODER_GET_UINTEGER(f) LUAOPUS_CTL_GET_UINTEGER(projection_decoder,f)
+#define LUAOPUS_PROJECTION_DECODER_SET_BOOLEAN(f) LUAOPUS_CTL_SET_BOOLEAN(projection_decoder,f)
+#define LUAOPUS_PROJECTION_DECODER_GET_BOOLEAN(f) LUAOPUS_CTL_GET_BOOLEAN(projection_decoder,f)
+
+/* OPUS_PROJECTION_GET_* don't follow the OPUS_GET_* naming */
+#define OPUS_GET_DEMIXING_MATRIX_GAIN(x) OPUS_PROJECTION_GET_DEMIXING_MATRIX_GAIN(x)
+#define OPUS_GET_DEMIXING_MATRIX_SIZE(x) OPUS_PROJECTION_GET_DEMIXING_MATRIX_SIZE(x)
+
+#define ctl_set(t,f) "opus_projection_" t "_ctl_set_" f
+#define ctl_get(t,f) "opus_projection_" t "_ctl_get_" f
+#define ENC_SET(f) luaopus_projection_encoder_ctl_set_ ## f
+#define ENC_GET(f) luaopus_projection_encoder_ctl_get_ ## f
+#define DEC_SET(f) luaopus_projection_decoder_ctl_set_ ## f
+#define DEC_GET(f) luaopus_projection_decoder_ctl_get_ ## f
+
+#define ctl_get_short(t,f) { "opus_projection_" t "_ctl_get_" f , "get_" f }
+#define ctl_set_short(t,f) { "opus_projection_" t "_ctl_set_" f , "set_" f }
+
+LUAOPUS_CTL_RESET_STATE(projection_encoder)
+LUAOPUS_PROJECTION_ENCODER_SET_INTEGER(BITRATE)
+LUAOPUS_PROJECTION_ENCODER_GET_INTEGER(BITRATE)
+LUAOPUS_PROJECTION_ENCODER_SET_INTEGER(COMPLEXITY)
+LUAOPUS_PROJECTION_ENCODER_GET_INTEGER(COMPLEXITY)
+LUAOPUS_PROJECTION_ENCODER_SET_BOOLEAN(VBR)
+LUAOPUS_PROJECTION_ENCODER_GET_BOOLEAN(VBR)
+LUAOPUS_PROJECTION_ENCODER_SET_BOOLEAN(VBR_CONSTRAINT)
+LUAOPUS_PROJECTION_ENCODER_GET_BOOLEAN(VBR_CONSTRAINT)
+LUAOPUS_PROJECTION_ENCODER_SET_INTEGER(MAX_BANDWIDTH)
+LUAOPUS_PROJECTION_ENCODER_GET_INTEGER(MAX_BANDWIDTH)
+LUAOPUS_PROJECTION_ENCODER_SET_INTEGER(SIGNAL)
+LUAOPUS_PROJECTION_ENCODER_GET_INTEGER(SIGNAL)
+LUAOPUS_PROJECTION_ENCODER_SET_BOOLEAN(INBAND_FEC)
+LUAOPUS_PROJECTION_ENCODER_GET_BOOLEAN(INBAND_FEC)
+LUAOPUS_PROJECTION_ENCODER_SET_INTEGER(PACKET_LOSS_PERC)
+LUAOPUS_PROJECTION_ENCODER_GET_INTEGER(PACKET_LOSS_PERC)
+LUAOPUS_PROJECTION_ENCODER_SET_BOOLEAN(DTX)
+LUAOPUS_PROJECTION_ENCODER_GET_BOOLEAN(DTX)
+LUAOPUS_PROJECTION_ENCODER_GET_INTEGER(LOOKAHEAD)
+LUAOPUS_PROJECTION_ENCODER_GET_INTEGER(SAMPLE_RATE)
+LUAOPUS_PROJECTION_ENCODER_GET_UINTEGER(FINAL_RANGE)
+#ifdef OPUS_SET_EXPERT_FRAME_DURATION
+LUAOPUS_PROJECTION_ENCODER_SET_INTEGER(EXPERT_FRAME_DURATION)
+LUAOPUS_PROJECTION_ENCODER_GET_INTEGER(EXPERT_FRAME_DURATION)
+#endif
+LUAOPUS_PROJECTION_ENCODER_GET_INTEGER(DEMIXING_MATRIX_GAIN)
+LUAOPUS_PROJECTION_ENCODER_GET_INTEGER(DEMIXING_MATRIX_SIZE)
+
+LUAOPUS_CTL_RESET_STATE(projection_decoder)
+LUAOPUS_PROJECTION_DECODER_SET_INTEGER(GAIN)
+LUAOPUS_PROJECTION_DECODER_GET_INTEGER(GAIN)
+LUAOPUS_PROJECTION_DECODER_GET_INTEGER(BANDWIDTH)
+LUAOPUS_PROJECTION_DECODER_GET_INTEGER(SAMPLE_RATE)
+LUAOPUS_PROJECTION_DECODER_GET_INTEGER(LAST_PACKET_DURATION)
+LUAOPUS_PROJECTION_DECODER_GET_UINTEGER(FINAL_RANGE)
+#ifdef OPUS_SET_PHASE_INVERSION_DISABLED
+LUAOPUS_PROJECTION_DECODER_SET_BOOLEAN(PHASE_INVERSION_DISABLED)
+LUAOPUS_PROJECTION_DECODER_GET_BOOLEAN(PHASE_INVERSION_DISABLED)
+#endif
+
+static const struct luaL_Reg luaopus_projection_functions[] = {
+    { "OpusProjectionEncoder", luaopus_OpusProjectionEncoder },
+    { "OpusProjectionDecoder", luaopus_OpusProjectionDecoder },
+    { "opus_projection_ambisonics_encoder_init", luaopus_projection_encoder_init },
+    { "opus_projection_encode", luaopus_projection_encode },
+    { "opus_projection_encode_float", luaopus_projection_encode_float },
+    { "opus_projection_encoder_get_streams", luaopus_projection_encoder_get_streams },
+    { "opus_projection_decoder_init", luaopus_projection_decoder_init },
+    { "opus_projection_decode", luaopus_projection_decode },
+    { "opus_projection_decode_float", luaopus_projection_decode_float },
+    { "opus_projection_decoder_get_streams", luaopus_projection_decoder_get_streams },
+    { "opus_projection_encoder_ctl_reset_state", luaopus_projection_encoder_ctl_reset_state },
+    { "opus_projection_decoder_ctl_reset_state", luaopus_projection_decoder_ctl_reset_state },
+    { NULL, NULL },
+};
+
+static const struct luaL_Reg luaopus_projection_encoder_ctl_functions[] = {
+    { ctl_set("encoder","bitrate"), ENC_SET(BITRATE) },
+    { ctl_get("encoder","bitrate"), ENC_GET(BITRATE) },
+    { ctl_set("encoder","complexity"), ENC_SET(COMPLEXITY) },
+    { ctl_get("encoder","complexity"), ENC_GET(COMPLEXITY) },
+    { ctl_set("encoder","vbr"), ENC_SET(VBR) },
+    { ctl_get("encoder","vbr"), ENC_GET(VBR) },
+    { ctl_set("encoder","vbr_constraint"), ENC_SET(VBR_CONSTRAINT) },
+    { ctl_get("encoder","vbr_constraint"), ENC_GET(VBR_CONSTRAINT) },
+    { ctl_set("encoder","max_bandwidth"), ENC_SET(MAX_BANDWIDTH) },
+    { ctl_get("encoder","max_bandwidth"), ENC_GET(MAX_BANDWIDTH) },
+    { ctl_set("encoder","signal"), ENC_SET(SIGNAL) },
+    { ctl_get("encoder","signal"), ENC_GET(SIGNAL) },
+    { ctl_set("encoder","inband_fec"), ENC_SET(INBAND_FEC) },
+    { ctl_get("encoder","inband_fec"), ENC_GET(INBAND_FEC) },
+    { ctl_set("encoder","packet_loss_perc"), ENC_SET(PACKET_LOSS_PERC) },
+    { ctl_get("encoder","packet_loss_perc"), ENC_GET(PACKET_LOSS_PERC) },
+    { ctl_set("encoder","dtx"), ENC_SET(DTX) },
+    { ctl_get("encoder","dtx"), ENC_GET(DTX) },
+    { ctl_get("encoder","lookahead"), ENC_GET(LOOKAHEAD) },
+    { ctl_get("encoder","samplerate"), ENC_GET(SAMPLE_RATE) },
+    { ctl_get("encoder","final_range"), ENC_GET(FINAL_RANGE) },
+#ifdef OPUS_SET_EXPERT_FRAME_DURATION
+    { ctl_set("encoder","expert_frame_duration"), ENC_SET(EXPERT_FRAME_DURATION) },
+    { ctl_get("encoder","expert_frame_duration"), ENC_GET(EXPERT_FRAME_DURATION) },
+#endif
+    { ctl_get("encoder","demixing_matrix"), ENC_GET(DEMIXING_MATRIX) },
+    { ctl_get("encoder","demixing_matrix_gain"), ENC_GET(DEMIXING_MATRIX_GAIN) },
+    { ctl_get("encoder","demixing_matrix_size"), ENC_GET(DEMIXING_MATRIX_SIZE) },
+    { NULL, NULL },
+};
+
+static const struct luaL_Reg luaopus_projection_decoder_ctl_functions[] = {
+    { ctl_set("decoder","gain"), DEC_SET(GAIN) },
+    { ctl_get("decoder","gain"), DEC_GET(GAIN) },
+    { ctl_get("decoder","bandwidth"), DEC_GET(BANDWIDTH) },
+    { ctl_get("decoder","samplerate"), DEC_GET(SAMPLE_RATE) },
+    { ctl_get("decoder","last_packet_duration"), DEC_GET(LAST_PACKET_DURATION) },
+    { ctl_get("decoder","final_range"), DEC_GET(FINAL_RANGE) },
+#ifdef OPUS_SET_PHASE_INVERSION_DISABLED
+    { ctl_set("decoder","phase_inversion_disabled"), DEC_SET(PHASE_INVERSION_DISABLED) },
+    { ctl_get("decoder","phase_inversion_disabled"), DEC_GET(PHASE_INVERSION_DISABLED) },
+#endif
+    { NULL, NULL },
+};
+
+static const luaopus_metamethods luaopus_projection_encoder_metamethods[] = {
+    { "opus_projection_ambisonics_encoder_init", "init" },
+    { "opus_projection_encode", "encode" },
+    { "opus_projection_encode_float", "encode_float" },
+    { "opus_projection_encoder_get_streams", "get_streams" },
+    { "opus_projection_encoder_ctl_reset_state", "reset_state" },
+    { NULL, NULL },
+};
+
+static const luaopus_metamethods luaopus_projection_decoder_metamethods[] = {
+    { "opus_projection_decoder_init", "init" },
+    { "opus_projection_decode", "decode" },
+    { "opus_projection_decode_float", "decode_float" },
+    { "opus_projection_decoder_get_streams", "get_streams" },
+    { "opus_projection_decoder_ctl_reset_state", "reset_state" },
+    { NULL, NULL },
+};
+
+static const luaopus_metamethods luaopus_projection_encoder_ctl_metamethods[] = {
+    ctl_set_short("encoder","bitrate"),
+    ctl_get_short("encoder","bitrate"),
+    ctl_set_short("encoder","complexity"),
+    ctl_get_short("encoder","complexity"),
+    ctl_set_short("encoder","vbr"),
+    ctl_get_short("encoder","vbr"),
+    ctl_set_short("encoder","vbr_constraint"),
+    ctl_get_short("encoder","vbr_constraint"),
+    ctl_set_short("encoder","max_bandwidth"),
+    ctl_get_short("encoder","max_bandwidth"),
+    ctl_set_short("encoder","signal"),
+    ctl_get_short("encoder","signal"),
+    ctl_set_short("encoder","inband_fec"),
+    ctl_get_short("encoder","inband_fec"),
+    ctl_set_short("encoder","packet_loss_perc"),
+    ctl_get_short("encoder","packet_loss_perc"),
+    ctl_set_short("encoder","dtx"),
+    ctl_get_short("encoder","dtx"),
+    ctl_get_short("encoder","lookahead"),
+    ctl_get_short("encoder","samplerate"),
+    ctl_get_short("encoder","final_range"),
+    ctl_set_short("encoder","expert_frame_duration"),
+    ctl_get_short("encoder","expert_frame_duration"),
+    ctl_get_short("encoder","demixing_matrix"),
+    ctl_get_short("encoder","demixing_matrix_gain"),
+    ctl_get_short("encoder","demixing_matrix_size"),
+    { NULL, NULL },
+};
+
+static const luaopus_metamethods luaopus_projection_decoder_ctl_metamethods[] = {
+    ctl_set_short("decoder","gain"),
+    ctl_get_short("decoder","gain"),
+    ctl_get_short("decoder","bandwidth"),
+    ctl_get_short("decoder","samplerate"),
+    ctl_get_short("decoder","last_packet_duration"),
+    ctl_get_short("decoder","final_range"),
+    ctl_set_short("decoder","phase_inversion_disabled"),
+    ctl_get_short("decoder","phase_inversion_disabled"),
+    { NULL, NULL },
+};
+
+const luaopus_lazy luaopus_projection_encoder_ctl = {
+    luaopus_projection_encoder_ctl_functions,
+    NULL,
+};
+
+const luaopus_lazy luaopus_projection_decoder_ctl = {
+    luaopus_projection_decoder_ctl_functions,
+    NULL,
+};
+
+static const luaopus_lazy luaopus_projection_encoder_ctl_methods = {
+    luaopus_projection_encoder_ctl_functions,
+    luaopus_projection_encoder_ctl_metamethods,
+};
+
+static const luaopus_lazy luaopus_projection_decoder_ctl_methods = {
+    luaopus_projection_decoder_ctl_functions,
+    luaopus_projection_decoder_ctl_metamethods,
+};
+
+/* sets up the metatable for one of the two types, the
+ * module table is just below where it's being built */
+static void
+luaopus_projection_metatable(lua_State *L, const char *mt, lua_CFunction gc, const luaopus_metamethods *m, const luaopus_lazy *ctl) {
+    const luaopus_lazy * lazy[1];
+
+    lazy[0] = ctl;
+    if(luaL_newmetatable(L,mt)) {
+        lua_pushcclosure(L,gc,0);
+        lua_setfield(L,-2,"__gc");
+
+        lua_newtable(L);
+        while(m->name != NULL) {
+            lua_getfield(L,-3,m->name);
+            lua_setfield(L,-2,m->metaname);
+            m++;
+        }
+        luaopus_lazy_attach(L,lazy,1);
+
+        lua_setfield(L,-2,"__index");
+    }
+    lua_pop(L,1);
+}
+
+LUAOPUS_PRIVATE
+void luaopus_projection_register(lua_State *L) {
+    luaL_setfuncs(L,luaopus_projection_functions,0);
+
+    luaopus_projection_metatable(L,luaopus_projection_encoder_mt,
+      luaopus_OpusProjectionEncoder_delete,
+      luaopus_projection_encoder_metamethods,
+      &luaopus_projection_encoder_ctl_methods);
+    luaopus_projection_metatable(L,luaopus_projection_decoder_mt,
+      luaopus_OpusProjectionDecoder_delete,
+      luaopus_projection_decoder_metamethods,
+      &luaopus_projection_decoder_ctl_methods);
+}
+
+#else
+
+/* libopus without the projection API, there's nothing to add */
+static const struct luaL_Reg luaopus_projection_none[] = {
+    { NULL, NULL },
+};
+
+const luaopus_lazy luaopus_projection_encoder_ctl = {
+    luaopus_projection_none,
+    NULL,
+};
+
+const luaopus_lazy luaopus_projection_decoder_ctl = {
+    luaopus_projection_none,
+    NULL,
+};
+
+LUAOPUS_PRIVATE
+void luaopus_projection_register(lua_State *L) {
+    (void)L;
+}
+
+#endif
+
+LUAOPUS_PUBLIC
+int luaopen_luaopus_projection(lua_State *L) {
+    static const luaopus_lazy * const lazy[] = {
+        &luaopus_projection_encoder_ctl,
+        &luaopus_projection_decoder_ctl,
+    };
+
+    lua_newtable(L);
+    luaopus_projection_register(L);
+    luaopus_lazy_attach(L,lazy,2);
+    return 1;
+}
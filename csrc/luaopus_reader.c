@@ -0,0 +1,561 @@
+/* for fileno */
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "luaopus_internal.h"
+#include <opus/opus.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#define LUAOPUS_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+const char * const luaopus_reader_mt = "OpusPcmReader";
+
+#define READER_U8 0
+#define READER_S16 1
+#define READER_S24 2
+#define READER_S32 3
+#define READER_F32 4
+#define READER_F64 5
+
+static const char * const luaopus_reader_formats[] = {
+    "u8",
+    "s16",
+    "s24",
+    "s32",
+    "f32",
+    "f64",
+    NULL,
+};
+
+static const int luaopus_reader_format_bytes[] = { 1, 2, 3, 4, 4, 8 };
+
+#define WAVE_FORMAT_PCM 0x0001
+#define WAVE_FORMAT_IEEE_FLOAT 0x0003
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+
+typedef struct luaopus_reader_s {
+    /* exactly one of these is set while the reader is open */
+    FILE *f;
+    const unsigned char *map;
+    size_t map_size;
+
+    /* where the samples start in the mapping */
+    const unsigned char *data;
+
+    /* bytes of samples left, -1 when reading a raw
+     * file until it runs out */
+    opus_int64 remaining;
+    opus_int64 pos;
+
+    int is_wav;
+    int format;
+    int channels;
+    opus_int32 rate;
+    int block_align;
+
+    /* stdio reads land here */
+    lua_Alloc alloc;
+    void *alloc_ud;
+    unsigned char *scratch;
+    size_t scratch_size;
+} luaopus_reader;
+
+static unsigned int
+rd16(const unsigned char *p) {
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8);
+}
+
+static opus_uint32
+rd32(const unsigned char *p) {
+    return (opus_uint32)p[0] | ((opus_uint32)p[1] << 8)
+      | ((opus_uint32)p[2] << 16) | ((opus_uint32)p[3] << 24);
+}
+
+/* reads RIFF chunks up to the start of the data chunk, leaving
+ * the file there. returns NULL, or what's wrong with the file */
+static const char *
+luaopus_reader_parse_wav(luaopus_reader *r) {
+    unsigned char buf[40];
+    opus_uint32 size = 0;
+    unsigned int tag = 0;
+    unsigned int bits = 0;
+    int have_fmt = 0;
+
+    if(fread(buf,1,12,r->f) != 12
+      || memcmp(buf,"RIFF",4) != 0 || memcmp(buf + 8,"WAVE",4) != 0) {
+        return "not a RIFF/WAVE file";
+    }
+
+    for(;;) {
+        if(fread(buf,1,8,r->f) != 8) {
+            return "no data chunk";
+        }
+        size = rd32(buf + 4);
+
+        if(memcmp(buf,"fmt ",4) == 0) {
+            if(size < 16 || fread(buf,1,size < 40 ? size : 40,r->f) != (size < 40 ? size : 40)) {
+                return "bad fmt chunk";
+            }
+            tag = rd16(buf);
+            r->channels = (int)rd16(buf + 2);
+            r->rate = (opus_int32)rd32(buf + 4);
+            r->block_align = (int)rd16(buf + 12);
+            bits = rd16(buf + 14);
+
+            /* the real format is the start of the subformat GUID */
+            if(tag == WAVE_FORMAT_EXTENSIBLE) {
+                if(size < 40) return "bad fmt chunk";
+                tag = rd16(buf + 24);
+            }
+
+            if(tag == WAVE_FORMAT_PCM && bits == 8) r->format = READER_U8;
+            else if(tag == WAVE_FORMAT_PCM && bits == 16) r->format = READER_S16;
+            else if(tag == WAVE_FORMAT_PCM && bits == 24) r->format = READER_S24;
+            else if(tag == WAVE_FORMAT_PCM && bits == 32) r->format = READER_S32;
+            else if(tag == WAVE_FORMAT_IEEE_FLOAT && bits == 32) r->format = READER_F32;
+            else if(tag == WAVE_FORMAT_IEEE_FLOAT && bits == 64) r->format = READER_F64;
+            else return "unsupported sample format";
+
+            if(size > 40 && fseek(r->f,(long)(size - 40),SEEK_CUR) != 0) {
+                return "bad fmt chunk";
+            }
+            have_fmt = 1;
+        } else if(memcmp(buf,"data",4) == 0) {
+            if(!have_fmt) return "data chunk before fmt chunk";
+            /* streamed files don't know their size up front */
+            r->remaining = (size == 0 || size == 0xFFFFFFFF) ? -1 : (opus_int64)size;
+            return NULL;
+        } else if(fseek(r->f,(long)size,SEEK_CUR) != 0) {
+            return "truncated file";
+        }
+
+        /* chunks are padded to an even size */
+        if(size & 1) {
+            if(fseek(r->f,1,SEEK_CUR) != 0) return "truncated file";
+        }
+    }
+}
+
+#ifdef LUAOPUS_MMAP
+/* maps the file, leaving the reader on stdio if it can't be */
+static void
+luaopus_reader_map(luaopus_reader *r) {
+    struct stat st;
+    void *map = NULL;
+    long offset = 0;
+
+    offset = ftell(r->f);
+    if(offset < 0 || fstat(fileno(r->f),&st) != 0 || !S_ISREG(st.st_mode)) {
+        return;
+    }
+    if((opus_int64)st.st_size <= (opus_int64)offset) {
+        return;
+    }
+
+    map = mmap(NULL,(size_t)st.st_size,PROT_READ,MAP_PRIVATE,fileno(r->f),0);
+    if(map == MAP_FAILED) {
+        return;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(map,(size_t)st.st_size,MADV_SEQUENTIAL);
+#endif
+
+    r->map = (const unsigned char *)map;
+    r->map_size = (size_t)st.st_size;
+    r->data = r->map + offset;
+    if(r->remaining < 0 || r->remaining > (opus_int64)st.st_size - offset) {
+        r->remaining = (opus_int64)st.st_size - offset;
+    }
+
+    fclose(r->f);
+    r->f = NULL;
+}
+#endif
+
+static void
+luaopus_reader_close_file(luaopus_reader *r) {
+    if(r->f != NULL) {
+        fclose(r->f);
+        r->f = NULL;
+    }
+#ifdef LUAOPUS_MMAP
+    if(r->map != NULL) {
+        munmap((void *)r->map,r->map_size);
+        r->map = NULL;
+    }
+#endif
+    if(r->scratch != NULL) {
+        r->alloc(r->alloc_ud,r->scratch,r->scratch_size,0);
+        r->scratch = NULL;
+        r->scratch_size = 0;
+    }
+}
+
+static int
+luaopus_reader_fail(lua_State *L, luaopus_reader *r, int err, const char *msg) {
+    luaopus_reader_close_file(r);
+    lua_pushnil(L);
+    lua_pushinteger(L,err);
+    lua_pushstring(L,msg);
+    return 3;
+}
+
+/* opens a WAV file, or a raw one with
+ * { format = 'raw', rate = ..., channels = ..., sample_format = ... } */
+static int
+luaopus_OpusPcmReader(lua_State *L) {
+    luaopus_reader *r = NULL;
+    const char *path = NULL;
+    const char *container = NULL;
+    const char *err = NULL;
+    int use_map = 1;
+
+    path = luaL_checkstring(L,1);
+    lua_settop(L,2);
+    if(!lua_isnil(L,2)) {
+        luaL_checktype(L,2,LUA_TTABLE);
+        lua_getfield(L,2,"format");
+        container = lua_tostring(L,-1);
+        lua_pop(L,1);
+        lua_getfield(L,2,"mmap");
+        if(lua_isboolean(L,-1)) use_map = lua_toboolean(L,-1);
+        lua_pop(L,1);
+    }
+
+    r = (luaopus_reader *)lua_newuserdata(L,sizeof(luaopus_reader));
+    memset(r,0,sizeof(luaopus_reader));
+    r->alloc = lua_getallocf(L,&r->alloc_ud);
+    luaL_setmetatable(L,luaopus_reader_mt);
+
+    r->f = fopen(path,"rb");
+    if(r->f == NULL) {
+        return luaopus_reader_fail(L,r,OPUS_INTERNAL_ERROR,strerror(errno));
+    }
+
+    if(container != NULL && strcmp(container,"raw") == 0) {
+        lua_getfield(L,2,"rate");
+        r->rate = (opus_int32)lua_tointeger(L,-1);
+        lua_getfield(L,2,"channels");
+        r->channels = (int)lua_tointeger(L,-1);
+        lua_getfield(L,2,"sample_format");
+        r->format = luaL_checkoption(L,-1,"s16",luaopus_reader_formats);
+        lua_pop(L,3);
+        r->remaining = -1;
+    } else if(container == NULL || strcmp(container,"wav") == 0) {
+        r->is_wav = 1;
+        err = luaopus_reader_parse_wav(r);
+        if(err != NULL) {
+            return luaopus_reader_fail(L,r,OPUS_BAD_ARG,err);
+        }
+    } else {
+        return luaopus_reader_fail(L,r,OPUS_BAD_ARG,"unknown format");
+    }
+
+    if(r->rate <= 0 || r->channels <= 0 || r->channels > 255) {
+        return luaopus_reader_fail(L,r,OPUS_BAD_ARG,"bad rate or channels");
+    }
+    if(r->is_wav && r->block_align != r->channels * luaopus_reader_format_bytes[r->format]) {
+        return luaopus_reader_fail(L,r,OPUS_BAD_ARG,"unsupported block alignment");
+    }
+    r->block_align = r->channels * luaopus_reader_format_bytes[r->format];
+
+#ifdef LUAOPUS_MMAP
+    if(use_map) {
+        luaopus_reader_map(r);
+    }
+#else
+    (void)use_map;
+#endif
+
+    return 1;
+}
+
+static int
+luaopus_OpusPcmReader_delete(lua_State *L) {
+    luaopus_reader *r = NULL;
+
+    r = luaL_checkudata(L,1,luaopus_reader_mt);
+    luaopus_reader_close_file(r);
+    return 0;
+}
+
+static int
+luaopus_reader_close(lua_State *L) {
+    luaopus_reader *r = NULL;
+
+    r = luaL_checkudata(L,1,luaopus_reader_mt);
+    luaopus_reader_close_file(r);
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luaopus_reader_info(lua_State *L) {
+    luaopus_reader *r = NULL;
+
+    r = luaL_checkudata(L,1,luaopus_reader_mt);
+
+    lua_createtable(L,0,6);
+    lua_pushstring(L,r->is_wav ? "wav" : "raw");
+    lua_setfield(L,-2,"format");
+    lua_pushstring(L,luaopus_reader_formats[r->format]);
+    lua_setfield(L,-2,"sample_format");
+    lua_pushinteger(L,r->rate);
+    lua_setfield(L,-2,"rate");
+    lua_pushinteger(L,r->channels);
+    lua_setfield(L,-2,"channels");
+    lua_pushboolean(L,r->map != NULL);
+    lua_setfield(L,-2,"mmap");
+    lua_pushnumber(L,(lua_Number)(r->pos / r->block_align));
+    lua_setfield(L,-2,"position");
+    if(r->remaining >= 0) {
+        lua_pushnumber(L,(lua_Number)((r->pos + r->remaining) / r->block_align));
+        lua_setfield(L,-2,"frames");
+    }
+    return 1;
+}
+
+/* returns a pointer to up to want frames, with the number
+ * actually available in *got, or NULL on a read error */
+static const unsigned char *
+luaopus_reader_read(luaopus_reader *r, int want, int *got) {
+    size_t bytes = (size_t)want * r->block_align;
+    size_t n = 0;
+    const unsigned char *p = NULL;
+
+    if(r->remaining >= 0 && (opus_int64)bytes > r->remaining) {
+        bytes = (size_t)r->remaining;
+    }
+
+    if(r->map != NULL) {
+        p = r->data + r->pos;
+        n = bytes;
+    } else if(r->f != NULL) {
+        if(r->scratch_size < bytes) {
+            p = r->alloc(r->alloc_ud,r->scratch,r->scratch_size,bytes);
+            if(p == NULL) return NULL;
+            r->scratch = (unsigned char *)p;
+            r->scratch_size = bytes;
+        }
+        n = fread(r->scratch,1,bytes,r->f);
+        if(n < bytes && ferror(r->f)) return NULL;
+        p = r->scratch;
+    } else {
+        p = (const unsigned char *)"";
+    }
+
+    *got = (int)(n / r->block_align);
+    r->pos += (opus_int64)n;
+    if(r->remaining >= 0) r->remaining -= (opus_int64)n;
+    return p;
+}
+
+static void
+luaopus_reader_convert(const luaopus_reader *r, const unsigned char *p, luaopus_encoder *u, int samples) {
+    opus_uint32 x = 0;
+    opus_uint64 xx = 0;
+    opus_int32 v = 0;
+    float f = 0.0f;
+    double d = 0.0;
+    int i = 0;
+
+    switch(r->format) {
+        case READER_S16: {
+            for(i=0;i<samples;i++, p += 2) {
+                v = (opus_int32)rd16(p);
+                u->pcm_int16[i] = (opus_int16)(v >= 0x8000 ? v - 0x10000 : v);
+            }
+            break;
+        }
+        case READER_U8: {
+            for(i=0;i<samples;i++, p++) {
+                u->pcm_float[i] = ((float)p[0] - 128.0f) / 128.0f;
+            }
+            break;
+        }
+        case READER_S24: {
+            for(i=0;i<samples;i++, p += 3) {
+                v = (opus_int32)((opus_uint32)p[0] | ((opus_uint32)p[1] << 8) | ((opus_uint32)p[2] << 16));
+                if(v & 0x800000) v -= 0x1000000;
+                u->pcm_float[i] = (float)v / 8388608.0f;
+            }
+            break;
+        }
+        case READER_S32: {
+            for(i=0;i<samples;i++, p += 4) {
+                x = rd32(p);
+                u->pcm_float[i] = (float)((double)(opus_int32)x / 2147483648.0);
+            }
+            break;
+        }
+        case READER_F32: {
+            for(i=0;i<samples;i++, p += 4) {
+                x = rd32(p);
+                memcpy(&f,&x,sizeof(float));
+                u->pcm_float[i] = f;
+            }
+            break;
+        }
+        case READER_F64: {
+            for(i=0;i<samples;i++, p += 8) {
+                xx = ((opus_uint64)rd32(p + 4) << 32) | rd32(p);
+                memcpy(&d,&xx,sizeof(double));
+                u->pcm_float[i] = (float)d;
+            }
+            break;
+        }
+        default: break;
+    }
+}
+
+/* reads one frame, pads a short last frame with silence and
+ * encodes it. returns the packet and the frames read, nil at
+ * the end of the file, or nil and an error */
+static int
+luaopus_reader_next(lua_State *L, luaopus_reader *r, luaopus_encoder *u, int frame_size) {
+    const unsigned char *p = NULL;
+    int is_float = 0;
+    int got = 0;
+    int bytes = 0;
+    int total = 0;
+
+    if(u->Fs == 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_INVALID_STATE);
+        return 2;
+    }
+    if(u->Fs != r->rate || luaopus_encoder_input_channels(u) != r->channels
+      || frame_size <= 0 || frame_size * r->channels > LUAOPUS_MAX_SAMPLES
+      || frame_size * u->channels > LUAOPUS_MAX_SAMPLES) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_BAD_ARG);
+        return 2;
+    }
+
+    p = luaopus_reader_read(r,frame_size,&got);
+    if(p == NULL) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_INTERNAL_ERROR);
+        lua_pushstring(L,strerror(errno));
+        return 3;
+    }
+    if(got == 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    is_float = r->format != READER_S16;
+    total = frame_size * r->channels;
+    luaopus_reader_convert(r,p,u,got * r->channels);
+    if(is_float) {
+        memset(u->pcm_float + got * r->channels,0,sizeof(float) * (total - got * r->channels));
+    } else {
+        memset(u->pcm_int16 + got * r->channels,0,sizeof(opus_int16) * (total - got * r->channels));
+    }
+
+    bytes = luaopus_encoder_frame(u,frame_size,LUAOPUS_MAX_PACKET,is_float);
+    if(bytes < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L,bytes);
+        return 2;
+    }
+
+    lua_pushlstring(L,(const char *)u->buffer,bytes);
+    lua_pushinteger(L,got);
+    return 2;
+}
+
+static int
+luaopus_reader_next_packet(lua_State *L) {
+    luaopus_reader *r = NULL;
+    luaopus_encoder *u = NULL;
+
+    r = luaL_checkudata(L,1,luaopus_reader_mt);
+    u = luaL_checkudata(L,2,luaopus_encoder_mt);
+    return luaopus_reader_next(L,r,u,(int)luaL_checkinteger(L,3));
+}
+
+/* upvalues are the reader, encoder and frame size */
+static int
+luaopus_reader_packets_iter(lua_State *L) {
+    luaopus_reader *r = NULL;
+    luaopus_encoder *u = NULL;
+    int n = 0;
+
+    r = (luaopus_reader *)lua_touserdata(L,lua_upvalueindex(1));
+    u = (luaopus_encoder *)lua_touserdata(L,lua_upvalueindex(2));
+
+    /* for loops stop at nil, so errors have to be raised */
+    n = luaopus_reader_next(L,r,u,(int)lua_tointeger(L,lua_upvalueindex(3)));
+    if(n == 3) {
+        return luaL_error(L,"OpusPcmReader: %s",lua_tostring(L,-1));
+    }
+    if(n == 2 && lua_isnil(L,-2)) {
+        return luaL_error(L,"OpusPcmReader: %s",opus_strerror((int)lua_tointeger(L,-1)));
+    }
+    return n;
+}
+
+static int
+luaopus_reader_packets(lua_State *L) {
+    luaL_checkudata(L,1,luaopus_reader_mt);
+    luaL_checkudata(L,2,luaopus_encoder_mt);
+    luaL_checkinteger(L,3);
+
+    lua_settop(L,3);
+    lua_pushcclosure(L,luaopus_reader_packets_iter,3);
+    return 1;
+}
+
+static const struct luaL_Reg luaopus_reader_functions[] = {
+    { "OpusPcmReader", luaopus_OpusPcmReader },
+    { "opus_pcm_reader_info", luaopus_reader_info },
+    { "opus_pcm_reader_next_packet", luaopus_reader_next_packet },
+    { "opus_pcm_reader_packets", luaopus_reader_packets },
+    { "opus_pcm_reader_close", luaopus_reader_close },
+    { NULL, NULL },
+};
+
+static const luaopus_metamethods luaopus_reader_metamethods[] = {
+    { "opus_pcm_reader_info", "info" },
+    { "opus_pcm_reader_next_packet", "next_packet" },
+    { "opus_pcm_reader_packets", "packets" },
+    { "opus_pcm_reader_close", "close" },
+    { NULL, NULL },
+};
+
+LUAOPUS_PRIVATE
+void luaopus_reader_register(lua_State *L) {
+    const luaopus_metamethods *m = luaopus_reader_metamethods;
+
+    luaL_setfuncs(L,luaopus_reader_functions,0);
+
+    if(luaL_newmetatable(L,luaopus_reader_mt)) {
+        lua_pushcclosure(L,luaopus_OpusPcmReader_delete,0);
+        lua_setfield(L,-2,"__gc");
+
+        lua_newtable(L);
+        while(m->name != NULL) {
+            lua_getfield(L,-3,m->name);
+            lua_setfield(L,-2,m->metaname);
+            m++;
+        }
+
+        lua_setfield(L,-2,"__index");
+    }
+    lua_pop(L,1);
+}
+
+LUAOPUS_PUBLIC
+int luaopen_luaopus_reader(lua_State *L) {
+    lua_newtable(L);
+    luaopus_reader_register(L);
+    return 1;
+}
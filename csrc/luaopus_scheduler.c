@@ -0,0 +1,800 @@
+#include "luaopus_internal.h"
+#include <opus/opus.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#define LUAOPUS_THREADS
+#include <pthread.h>
+#endif
+
+const char * const luaopus_scheduler_mt = "OpusScheduler";
+
+#define SCHED_REMOVED 0
+#define SCHED_ENCODER 1
+#define SCHED_DECODER 2
+
+/* streams a thread claims at a time during run() */
+#define SCHED_BATCH 8
+
+#define SCHED_MAX_THREADS 64
+
+/* packets are queued with a 2-byte length in front */
+#define SCHED_MAX_PACKET 65535
+
+/* a byte queue, data[pos..len] is what's still pending.
+ * workers grow these, so they come from the shared allocator */
+typedef struct luaopus_sched_buffer_s {
+    luaopus_mem mem;
+    unsigned char *data;
+    size_t pos;
+    size_t len;
+    size_t cap;
+} luaopus_sched_buffer;
+
+typedef struct luaopus_sched_stream_s {
+    int kind;
+    int is_float;
+    luaopus_encoder *encoder;
+    luaopus_decoder *decoder;
+
+    /* cadence, times are in microseconds */
+    int frame_size;
+    double period;
+    double due;
+
+    /* encoders take packed PCM and produce queued packets,
+     * decoders take queued packets and produce packed PCM */
+    luaopus_sched_buffer in;
+    luaopus_sched_buffer out;
+
+    /* counts for the run in progress */
+    unsigned int run_frames;
+    unsigned int run_misses;
+
+    unsigned long frames;
+    unsigned long misses;
+    unsigned long underruns;
+    unsigned long errors;
+    int last_error;
+    double max_late;
+} luaopus_sched_stream;
+
+struct luaopus_scheduler_s {
+    luaopus_mem streams_mem;
+    luaopus_sched_stream *streams;
+    int nstreams;
+    int cap;
+
+    /* notional time of the run in progress, and the
+     * clock reading it started at */
+    double now;
+    double started;
+
+    int threads;
+#ifdef LUAOPUS_THREADS
+    /* scratch space for finding meters shared between streams */
+    luaopus_mem meters_mem;
+    luaopus_meter **meters;
+    int meters_cap;
+
+    pthread_t workers[SCHED_MAX_THREADS];
+    int nworkers;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    unsigned int generation;
+    int busy;
+    int stop;
+    int next;
+#endif
+};
+
+typedef struct luaopus_scheduler_s luaopus_scheduler;
+
+static int
+luaopus_sched_buffer_reserve(luaopus_sched_buffer *b, size_t extra) {
+    unsigned char *data = NULL;
+    size_t cap = 0;
+
+    /* slide pending bytes down before growing */
+    if(b->pos > 0) {
+        memmove(b->data,b->data + b->pos,b->len - b->pos);
+        b->len -= b->pos;
+        b->pos = 0;
+    }
+
+    if(b->len + extra <= b->cap) return 1;
+
+    cap = b->cap ? b->cap : 4096;
+    while(cap < b->len + extra) cap *= 2;
+
+    data = luaopus_mem_realloc_shared(&b->mem,LUAOPUS_MEM_SCHEDULER,cap);
+    if(data == NULL) return 0;
+    b->data = data;
+    b->cap = cap;
+    return 1;
+}
+
+static int
+luaopus_sched_buffer_append(luaopus_sched_buffer *b, const void *data, size_t len) {
+    if(b->len + len > b->cap && !luaopus_sched_buffer_reserve(b,len)) return 0;
+    memcpy(b->data + b->len,data,len);
+    b->len += len;
+    return 1;
+}
+
+static int
+luaopus_sched_buffer_append_packet(luaopus_sched_buffer *b, const unsigned char *data, size_t len) {
+    unsigned char hdr[2];
+
+    hdr[0] = (unsigned char)(len >> 8);
+    hdr[1] = (unsigned char)(len & 0xFF);
+    if(b->len + len + 2 > b->cap && !luaopus_sched_buffer_reserve(b,len + 2)) return 0;
+    luaopus_sched_buffer_append(b,hdr,2);
+    luaopus_sched_buffer_append(b,data,len);
+    return 1;
+}
+
+static void
+luaopus_sched_buffer_clear(luaopus_sched_buffer *b) {
+    b->pos = 0;
+    b->len = 0;
+}
+
+static void
+luaopus_sched_buffer_free(luaopus_sched_buffer *b) {
+    luaopus_mem_free(&b->mem);
+    b->data = NULL;
+    b->pos = 0;
+    b->len = 0;
+    b->cap = 0;
+}
+
+static size_t
+luaopus_sched_sample_bytes(const luaopus_sched_stream *s) {
+    return s->is_float ? sizeof(float) : sizeof(opus_int16);
+}
+
+/* runs one frame of the stream, returns 0 if there
+ * wasn't enough input queued */
+static int
+luaopus_sched_stream_frame(luaopus_sched_stream *s) {
+    const unsigned char *data = NULL;
+    size_t need = 0;
+    size_t len = 0;
+    int r = 0;
+
+    if(s->kind == SCHED_ENCODER) {
+        need = (size_t)s->frame_size
+          * luaopus_encoder_input_channels(s->encoder)
+          * luaopus_sched_sample_bytes(s);
+        if(s->in.len - s->in.pos < need) return 0;
+
+        memcpy(s->encoder->pcm_float,s->in.data + s->in.pos,need);
+        s->in.pos += need;
+
+        r = luaopus_encoder_frame(s->encoder,s->frame_size,LUAOPUS_MAX_PACKET,s->is_float);
+        if(r > 0 && !luaopus_sched_buffer_append_packet(&s->out,s->encoder->buffer,r)) {
+            r = OPUS_ALLOC_FAIL;
+        }
+    } else {
+        if(s->in.len - s->in.pos < 2) return 0;
+
+        len = ((size_t)s->in.data[s->in.pos] << 8) | s->in.data[s->in.pos + 1];
+        data = len ? s->in.data + s->in.pos + 2 : NULL;
+        s->in.pos += 2 + len;
+
+        /* a lost packet gets one frame of concealment */
+        r = luaopus_decoder_packet(s->decoder,data,(opus_int32)len,
+          data ? LUAOPUS_MAX_SAMPLES / LUAOPUS_CHANMAP_MAX : s->frame_size,
+          0,s->is_float);
+        if(r > 0) {
+            need = (size_t)r
+              * luaopus_decoder_output_channels(s->decoder)
+              * luaopus_sched_sample_bytes(s);
+            if(!luaopus_sched_buffer_append(&s->out,s->decoder->pcm_float,need)) {
+                r = OPUS_ALLOC_FAIL;
+            }
+        }
+    }
+
+    if(s->in.pos == s->in.len) luaopus_sched_buffer_clear(&s->in);
+
+    if(r < 0) {
+        s->errors++;
+        s->last_error = r;
+    }
+    return 1;
+}
+
+/* processes every frame of the stream that's due by sched->now.
+ * a frame is late once it finishes after the following frame
+ * was due, that's a deadline miss */
+static void
+luaopus_sched_stream_run(luaopus_scheduler *sched, luaopus_sched_stream *s) {
+    double late = 0.0;
+
+    s->run_frames = 0;
+    s->run_misses = 0;
+    if(s->kind == SCHED_REMOVED) return;
+
+    while(s->due <= sched->now) {
+        if(!luaopus_sched_stream_frame(s)) {
+            s->underruns++;
+            return;
+        }
+
+        late = sched->now + (luaopus_clock_us() - sched->started) - s->due;
+        if(late > s->max_late) s->max_late = late;
+        if(late > s->period) {
+            s->misses++;
+            s->run_misses++;
+        }
+
+        s->frames++;
+        s->run_frames++;
+        s->due += s->period;
+    }
+}
+
+/* claims batches of streams until there are none left */
+static void
+luaopus_sched_drain(luaopus_scheduler *sched) {
+    int first = 0;
+    int last = 0;
+
+    for(;;) {
+#ifdef LUAOPUS_THREADS
+        pthread_mutex_lock(&sched->lock);
+        first = sched->next;
+        sched->next += SCHED_BATCH;
+        pthread_mutex_unlock(&sched->lock);
+#else
+        first = last;
+#endif
+        if(first >= sched->nstreams) return;
+        last = first + SCHED_BATCH;
+        if(last > sched->nstreams) last = sched->nstreams;
+
+        for(;first < last;first++) {
+            luaopus_sched_stream_run(sched,&sched->streams[first]);
+        }
+    }
+}
+
+static luaopus_meter *
+luaopus_sched_stream_meter(const luaopus_sched_stream *s) {
+    if(s->kind == SCHED_ENCODER) return s->encoder->meter;
+    if(s->kind == SCHED_DECODER) return s->decoder->meter;
+    return NULL;
+}
+
+#ifdef LUAOPUS_THREADS
+static int
+luaopus_sched_meter_cmp(const void *a, const void *b) {
+    const luaopus_meter *x = *(luaopus_meter * const *)a;
+    const luaopus_meter *y = *(luaopus_meter * const *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* whether two streams feed the same meter, which can be attached
+ * after the streams were added. those can't run on different
+ * threads, if we can't tell then assume they do */
+static int
+luaopus_sched_meters_shared(luaopus_scheduler *sched) {
+    luaopus_meter **meters = NULL;
+    luaopus_meter *m = NULL;
+    int n = 0;
+    int i = 0;
+
+    if(sched->meters_cap < sched->nstreams) {
+        meters = luaopus_mem_realloc_shared(&sched->meters_mem,LUAOPUS_MEM_SCHEDULER,
+          sizeof(luaopus_meter *) * sched->nstreams);
+        if(meters == NULL) return 1;
+        sched->meters = meters;
+        sched->meters_cap = sched->nstreams;
+    }
+
+    for(i=0;i<sched->nstreams;i++) {
+        m = luaopus_sched_stream_meter(&sched->streams[i]);
+        if(m != NULL) sched->meters[n++] = m;
+    }
+    if(n < 2) return 0;
+
+    qsort(sched->meters,n,sizeof(luaopus_meter *),luaopus_sched_meter_cmp);
+    for(i=1;i<n;i++) {
+        if(sched->meters[i] == sched->meters[i-1]) return 1;
+    }
+    return 0;
+}
+
+static void *
+luaopus_sched_worker(void *ud) {
+    luaopus_scheduler *sched = ud;
+    unsigned int seen = 0;
+
+    pthread_mutex_lock(&sched->lock);
+    for(;;) {
+        while(!sched->stop && sched->generation == seen) {
+            pthread_cond_wait(&sched->work,&sched->lock);
+        }
+        if(sched->stop) break;
+        seen = sched->generation;
+        pthread_mutex_unlock(&sched->lock);
+
+        luaopus_sched_drain(sched);
+
+        pthread_mutex_lock(&sched->lock);
+        if(--sched->busy == 0) {
+            pthread_cond_signal(&sched->done);
+        }
+    }
+    pthread_mutex_unlock(&sched->lock);
+    return NULL;
+}
+#endif
+
+static luaopus_sched_stream *
+luaopus_sched_checkstream(lua_State *L, luaopus_scheduler *sched, int idx) {
+    int id = luaL_checkinteger(L,idx);
+    if(id < 1 || id > sched->nstreams || sched->streams[id-1].kind == SCHED_REMOVED) {
+        return NULL;
+    }
+    return &sched->streams[id-1];
+}
+
+static int
+luaopus_OpusScheduler(lua_State *L) {
+    luaopus_scheduler *u = NULL;
+    int threads = 0;
+
+    threads = luaL_optinteger(L,1,1);
+    if(threads < 1) threads = 1;
+    if(threads > SCHED_MAX_THREADS) threads = SCHED_MAX_THREADS;
+
+    u = lua_newuserdata(L,sizeof(luaopus_scheduler));
+    if(u == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    memset(u,0,sizeof(luaopus_scheduler));
+    u->threads = 1;
+
+    /* codecs we're driving, indexed by stream id */
+    lua_newtable(L);
+    lua_setuservalue(L,-2);
+
+    luaL_setmetatable(L,luaopus_scheduler_mt);
+
+#ifdef LUAOPUS_THREADS
+    pthread_mutex_init(&u->lock,NULL);
+    pthread_cond_init(&u->work,NULL);
+    pthread_cond_init(&u->done,NULL);
+
+    /* the thread calling run() does its share, so we
+     * only need threads - 1 workers */
+    while(u->nworkers < threads - 1) {
+        if(pthread_create(&u->workers[u->nworkers],NULL,luaopus_sched_worker,u) != 0) {
+            break;
+        }
+        u->nworkers++;
+    }
+    u->threads = u->nworkers + 1;
+#else
+    (void)threads;
+#endif
+
+    return 1;
+}
+
+static int
+luaopus_OpusScheduler_delete(lua_State *L) {
+    luaopus_scheduler *u = NULL;
+    int i = 0;
+
+    u = luaL_checkudata(L,1,luaopus_scheduler_mt);
+
+#ifdef LUAOPUS_THREADS
+    if(u->threads > 0) {
+        pthread_mutex_lock(&u->lock);
+        u->stop = 1;
+        pthread_cond_broadcast(&u->work);
+        pthread_mutex_unlock(&u->lock);
+        for(i=0;i<u->nworkers;i++) {
+            pthread_join(u->workers[i],NULL);
+        }
+        pthread_cond_destroy(&u->done);
+        pthread_cond_destroy(&u->work);
+        pthread_mutex_destroy(&u->lock);
+    }
+    luaopus_mem_free(&u->meters_mem);
+    u->meters = NULL;
+    u->meters_cap = 0;
+#endif
+    u->threads = 0;
+
+    for(i=0;i<u->nstreams;i++) {
+        luaopus_sched_buffer_free(&u->streams[i].in);
+        luaopus_sched_buffer_free(&u->streams[i].out);
+    }
+    luaopus_mem_free(&u->streams_mem);
+    u->streams = NULL;
+    u->nstreams = 0;
+    u->cap = 0;
+
+    return 0;
+}
+
+/* shared by add_encoder and add_decoder, the codec is at
+ * index 2, the frame size at 3, is_float at 4 and the
+ * start time at 5 */
+static int
+luaopus_sched_add(lua_State *L, luaopus_scheduler *u, int kind, opus_int32 Fs) {
+    luaopus_sched_stream *streams = NULL;
+    luaopus_sched_stream *s = NULL;
+    luaopus_meter *meter = NULL;
+    void *codec = NULL;
+    int frame_size = 0;
+    int cap = 0;
+    int i = 0;
+
+    frame_size = luaL_checkinteger(L,3);
+    if(Fs <= 0 || frame_size <= 0 || frame_size * LUAOPUS_CHANMAP_MAX > LUAOPUS_MAX_SAMPLES) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_BAD_ARG);
+        return 2;
+    }
+
+    /* streams run on different threads, so they can't
+     * share a codec or a meter */
+    codec = lua_touserdata(L,2);
+    if(kind == SCHED_ENCODER) {
+        meter = ((luaopus_encoder *)codec)->meter;
+    } else {
+        meter = ((luaopus_decoder *)codec)->meter;
+    }
+    for(i=0;i<u->nstreams;i++) {
+        s = &u->streams[i];
+        if(s->kind == SCHED_REMOVED) continue;
+        if((void *)s->encoder == codec || (void *)s->decoder == codec
+          || (meter != NULL && luaopus_sched_stream_meter(s) == meter)) {
+            lua_pushnil(L);
+            lua_pushinteger(L,OPUS_INVALID_STATE);
+            return 2;
+        }
+    }
+
+    if(u->nstreams == u->cap) {
+        cap = u->cap ? u->cap * 2 : 16;
+        streams = luaopus_mem_realloc_shared(&u->streams_mem,LUAOPUS_MEM_SCHEDULER,
+          sizeof(luaopus_sched_stream) * cap);
+        if(streams == NULL) {
+            lua_pushnil(L);
+            lua_pushinteger(L,OPUS_ALLOC_FAIL);
+            return 2;
+        }
+        u->streams = streams;
+        u->cap = cap;
+    }
+
+    s = &u->streams[u->nstreams++];
+    memset(s,0,sizeof(luaopus_sched_stream));
+    s->kind = kind;
+    s->is_float = lua_toboolean(L,4);
+    s->frame_size = frame_size;
+    s->period = (double)frame_size * 1000000.0 / (double)Fs;
+    s->due = luaL_optnumber(L,5,luaopus_clock_us());
+    if(kind == SCHED_ENCODER) {
+        s->encoder = codec;
+    } else {
+        s->decoder = codec;
+    }
+
+    lua_getuservalue(L,1);
+    lua_pushvalue(L,2);
+    lua_rawseti(L,-2,u->nstreams);
+    lua_pop(L,1);
+
+    lua_pushinteger(L,u->nstreams);
+    return 1;
+}
+
+static int
+luaopus_scheduler_add_encoder(lua_State *L) {
+    luaopus_scheduler *u = NULL;
+    luaopus_encoder *e = NULL;
+
+    u = luaL_checkudata(L,1,luaopus_scheduler_mt);
+    e = luaL_checkudata(L,2,luaopus_encoder_mt);
+    return luaopus_sched_add(L,u,SCHED_ENCODER,e->Fs);
+}
+
+static int
+luaopus_scheduler_add_decoder(lua_State *L) {
+    luaopus_scheduler *u = NULL;
+    luaopus_decoder *d = NULL;
+
+    u = luaL_checkudata(L,1,luaopus_scheduler_mt);
+    d = luaL_checkudata(L,2,luaopus_decoder_mt);
+    return luaopus_sched_add(L,u,SCHED_DECODER,d->Fs);
+}
+
+static int
+luaopus_scheduler_remove(lua_State *L) {
+    luaopus_scheduler *u = NULL;
+    luaopus_sched_stream *s = NULL;
+
+    u = luaL_checkudata(L,1,luaopus_scheduler_mt);
+    s = luaopus_sched_checkstream(L,u,2);
+    if(s == NULL) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_BAD_ARG);
+        return 2;
+    }
+
+    s->kind = SCHED_REMOVED;
+    s->encoder = NULL;
+    s->decoder = NULL;
+    luaopus_sched_buffer_free(&s->in);
+    luaopus_sched_buffer_free(&s->out);
+
+    lua_getuservalue(L,1);
+    lua_pushnil(L);
+    lua_rawseti(L,-2,(int)(s - u->streams) + 1);
+    lua_pop(L,1);
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luaopus_scheduler_push(lua_State *L) {
+    luaopus_scheduler *u = NULL;
+    luaopus_sched_stream *s = NULL;
+    const unsigned char *data = NULL;
+    size_t len = 0;
+    int ok = 0;
+
+    u = luaL_checkudata(L,1,luaopus_scheduler_mt);
+    s = luaopus_sched_checkstream(L,u,2);
+    data = (const unsigned char *)luaL_checklstring(L,3,&len);
+
+    if(s == NULL || (s->kind == SCHED_DECODER && len > SCHED_MAX_PACKET)) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_BAD_ARG);
+        return 2;
+    }
+
+    if(s->kind == SCHED_ENCODER) {
+        ok = luaopus_sched_buffer_append(&s->in,data,len);
+    } else {
+        ok = luaopus_sched_buffer_append_packet(&s->in,data,len);
+    }
+
+    if(!ok) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_ALLOC_FAIL);
+        return 2;
+    }
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+/* encoders give back a table of packets, decoders a
+ * string of packed PCM */
+static int
+luaopus_scheduler_pop(lua_State *L) {
+    luaopus_scheduler *u = NULL;
+    luaopus_sched_stream *s = NULL;
+    size_t pos = 0;
+    size_t len = 0;
+    int i = 0;
+
+    u = luaL_checkudata(L,1,luaopus_scheduler_mt);
+    s = luaopus_sched_checkstream(L,u,2);
+    if(s == NULL) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_BAD_ARG);
+        return 2;
+    }
+
+    if(s->kind == SCHED_DECODER) {
+        lua_pushlstring(L,(const char *)s->out.data + s->out.pos,s->out.len - s->out.pos);
+        luaopus_sched_buffer_clear(&s->out);
+        return 1;
+    }
+
+    lua_newtable(L);
+    pos = s->out.pos;
+    while(pos < s->out.len) {
+        len = ((size_t)s->out.data[pos] << 8) | s->out.data[pos + 1];
+        lua_pushlstring(L,(const char *)s->out.data + pos + 2,len);
+        lua_rawseti(L,-2,++i);
+        pos += 2 + len;
+    }
+    luaopus_sched_buffer_clear(&s->out);
+    return 1;
+}
+
+static int
+luaopus_scheduler_run(lua_State *L) {
+    luaopus_scheduler *u = NULL;
+    unsigned long frames = 0;
+    unsigned long misses = 0;
+    int i = 0;
+
+    u = luaL_checkudata(L,1,luaopus_scheduler_mt);
+    u->started = luaopus_clock_us();
+    u->now = luaL_optnumber(L,2,u->started);
+
+#ifdef LUAOPUS_THREADS
+    if(u->nworkers == 0 || luaopus_sched_meters_shared(u)) {
+        /* no workers are waiting on this generation */
+        u->next = 0;
+        luaopus_sched_drain(u);
+    } else {
+        pthread_mutex_lock(&u->lock);
+        u->next = 0;
+        u->busy = u->nworkers;
+        u->generation++;
+        pthread_cond_broadcast(&u->work);
+        pthread_mutex_unlock(&u->lock);
+
+        luaopus_sched_drain(u);
+
+        pthread_mutex_lock(&u->lock);
+        while(u->busy > 0) {
+            pthread_cond_wait(&u->done,&u->lock);
+        }
+        pthread_mutex_unlock(&u->lock);
+    }
+#else
+    luaopus_sched_drain(u);
+#endif
+
+    for(i=0;i<u->nstreams;i++) {
+        frames += u->streams[i].run_frames;
+        misses += u->streams[i].run_misses;
+    }
+
+    lua_pushinteger(L,frames);
+    lua_pushinteger(L,misses);
+    return 2;
+}
+
+/* stats for one stream, or totals across all of them */
+static int
+luaopus_scheduler_stats(lua_State *L) {
+    luaopus_scheduler *u = NULL;
+    luaopus_sched_stream *s = NULL;
+    unsigned long frames = 0;
+    unsigned long misses = 0;
+    unsigned long underruns = 0;
+    unsigned long errors = 0;
+    int last_error = 0;
+    double max_late = 0.0;
+    size_t pending = 0;
+    size_t ready = 0;
+    int first = 0;
+    int last = 0;
+    int i = 0;
+
+    u = luaL_checkudata(L,1,luaopus_scheduler_mt);
+
+    if(lua_isnoneornil(L,2)) {
+        first = 0;
+        last = u->nstreams;
+    } else {
+        s = luaopus_sched_checkstream(L,u,2);
+        if(s == NULL) {
+            lua_pushnil(L);
+            lua_pushinteger(L,OPUS_BAD_ARG);
+            return 2;
+        }
+        first = (int)(s - u->streams);
+        last = first + 1;
+    }
+
+    for(i=first;i<last;i++) {
+        s = &u->streams[i];
+        if(s->kind == SCHED_REMOVED) continue;
+        frames += s->frames;
+        misses += s->misses;
+        underruns += s->underruns;
+        errors += s->errors;
+        if(s->last_error) last_error = s->last_error;
+        if(s->max_late > max_late) max_late = s->max_late;
+        pending += s->in.len - s->in.pos;
+        ready += s->out.len - s->out.pos;
+    }
+
+    lua_createtable(L,0,8);
+    lua_pushinteger(L,frames);
+    lua_setfield(L,-2,"frames");
+    lua_pushinteger(L,misses);
+    lua_setfield(L,-2,"misses");
+    lua_pushinteger(L,underruns);
+    lua_setfield(L,-2,"underruns");
+    lua_pushinteger(L,errors);
+    lua_setfield(L,-2,"errors");
+    lua_pushinteger(L,last_error);
+    lua_setfield(L,-2,"last_error");
+    lua_pushnumber(L,max_late);
+    lua_setfield(L,-2,"max_late_us");
+    lua_pushinteger(L,pending);
+    lua_setfield(L,-2,"pending");
+    lua_pushinteger(L,ready);
+    lua_setfield(L,-2,"ready");
+    return 1;
+}
+
+static int
+luaopus_scheduler_threads(lua_State *L) {
+    luaopus_scheduler *u = NULL;
+
+    u = luaL_checkudata(L,1,luaopus_scheduler_mt);
+    lua_pushinteger(L,u->threads);
+    return 1;
+}
+
+static int
+luaopus_scheduler_clock(lua_State *L) {
+    lua_pushnumber(L,luaopus_clock_us());
+    return 1;
+}
+
+static const struct luaL_Reg luaopus_scheduler_functions[] = {
+    { "OpusScheduler", luaopus_OpusScheduler },
+    { "opus_scheduler_add_encoder", luaopus_scheduler_add_encoder },
+    { "opus_scheduler_add_decoder", luaopus_scheduler_add_decoder },
+    { "opus_scheduler_remove", luaopus_scheduler_remove },
+    { "opus_scheduler_push", luaopus_scheduler_push },
+    { "opus_scheduler_pop", luaopus_scheduler_pop },
+    { "opus_scheduler_run", luaopus_scheduler_run },
+    { "opus_scheduler_stats", luaopus_scheduler_stats },
+    { "opus_scheduler_threads", luaopus_scheduler_threads },
+    { "opus_scheduler_clock", luaopus_scheduler_clock },
+    { NULL, NULL },
+};
+
+static const luaopus_metamethods luaopus_scheduler_metamethods[] = {
+    { "opus_scheduler_add_encoder", "add_encoder" },
+    { "opus_scheduler_add_decoder", "add_decoder" },
+    { "opus_scheduler_remove", "remove" },
+    { "opus_scheduler_push", "push" },
+    { "opus_scheduler_pop", "pop" },
+    { "opus_scheduler_run", "run" },
+    { "opus_scheduler_stats", "stats" },
+    { "opus_scheduler_threads", "threads" },
+    { "opus_scheduler_clock", "clock" },
+    { NULL, NULL },
+};
+
+LUAOPUS_PRIVATE
+void luaopus_scheduler_register(lua_State *L) {
+    const luaopus_metamethods *m = luaopus_scheduler_metamethods;
+
+    luaL_setfuncs(L,luaopus_scheduler_functions,0);
+
+    if(luaL_newmetatable(L,luaopus_scheduler_mt)) {
+        lua_pushcclosure(L,luaopus_OpusScheduler_delete,0);
+        lua_setfield(L,-2,"__gc");
+
+        lua_newtable(L);
+        while(m->name != NULL) {
+            lua_getfield(L,-3,m->name);
+            lua_setfield(L,-2,m->metaname);
+            m++;
+        }
+
+        lua_setfield(L,-2,"__index");
+    }
+    lua_pop(L,1);
+}
+
+LUAOPUS_PUBLIC
+int luaopen_luaopus_scheduler(lua_State *L) {
+    lua_newtable(L);
+    luaopus_scheduler_register(L);
+    return 1;
+}
@@ -0,0 +1,231 @@
+#include "luaopus_internal.h"
+#include <opus/opus.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define luaopus_write(fd,buf,len) _write((fd),(buf),(unsigned int)(len))
+#else
+#include <unistd.h>
+#define luaopus_write(fd,buf,len) write((fd),(buf),(len))
+#endif
+
+/* when decoding several packets to an fd, PCM is
+ * gathered up to this many bytes before each write() */
+#define LUAOPUS_SINK_BATCH 65536
+
+/* most samples per channel we'll ask for, and the default
+ * frame_size, same as opus_decode */
+#define LUAOPUS_SINK_FRAME_SIZE (LUAOPUS_MAX_SAMPLES / LUAOPUS_CHANMAP_MAX)
+
+typedef struct luaopus_sink_s {
+    FILE *f;
+    int fd;
+
+    /* batch buffer, NULL when writing each frame as it's decoded */
+    unsigned char *batch;
+    size_t used;
+
+    /* samples per channel written, and waiting in the batch */
+    lua_Integer written;
+    lua_Integer pending;
+} luaopus_sink;
+
+static FILE *
+luaopus_checkfile(lua_State *L, int idx) {
+#if (!defined LUA_VERSION_NUM) || LUA_VERSION_NUM == 501
+    FILE **f = (FILE **)luaL_checkudata(L,idx,LUA_FILEHANDLE);
+    if(*f == NULL) {
+        luaL_argerror(L,idx,"attempt to use a closed file");
+    }
+    return *f;
+#else
+    luaL_Stream *s = (luaL_Stream *)luaL_checkudata(L,idx,LUA_FILEHANDLE);
+    if(s->closef == NULL) {
+        luaL_argerror(L,idx,"attempt to use a closed file");
+    }
+    return s->f;
+#endif
+}
+
+/* returns 0, or -1 with errno set */
+static int
+luaopus_sink_write(luaopus_sink *s, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    long r = 0;
+
+    if(s->f != NULL) {
+        return fwrite(data,1,len,s->f) == len ? 0 : -1;
+    }
+
+    while(len > 0) {
+        r = (long)luaopus_write(s->fd,p,len);
+        if(r < 0) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        p += r;
+        len -= (size_t)r;
+    }
+    return 0;
+}
+
+static int
+luaopus_sink_flush(luaopus_sink *s) {
+    int r = 0;
+
+    if(s->batch == NULL || s->used == 0) return 0;
+    r = luaopus_sink_write(s,s->batch,s->used);
+    if(r == 0) s->written += s->pending;
+    s->used = 0;
+    s->pending = 0;
+    return r;
+}
+
+/* writes whatever the decoder just produced */
+static int
+luaopus_sink_frame(luaopus_sink *s, const luaopus_decoder *u, int samples, int is_float) {
+    size_t len = 0;
+
+    len = (size_t)samples * luaopus_decoder_output_channels(u)
+      * (is_float ? sizeof(float) : sizeof(opus_int16));
+
+    if(s->batch == NULL) {
+        if(luaopus_sink_write(s,u->pcm_float,len) != 0) return -1;
+        s->written += samples;
+        return 0;
+    }
+
+    if(s->used + len > LUAOPUS_SINK_BATCH && luaopus_sink_flush(s) != 0) {
+        return -1;
+    }
+    memcpy(s->batch + s->used,u->pcm_float,len);
+    s->used += len;
+    s->pending += samples;
+    return 0;
+}
+
+/* decodes the packet or array of packets at idx into the sink,
+ * followed by decode_fec and frame_size like opus_decode.
+ * a nil or empty packet is a lost one. returns samples per
+ * channel, or nil, error and samples written before the error */
+static int
+luaopus_sink_decode(lua_State *L, luaopus_sink *s, int idx, int is_float) {
+    luaopus_decoder *u = NULL;
+    const unsigned char *data = NULL;
+    size_t len = 0;
+    int decode_fec = 0;
+    lua_Integer frame_size = LUAOPUS_SINK_FRAME_SIZE;
+    int samples = 0;
+    int count = 1;
+    int i = 0;
+
+    u = luaL_checkudata(L,1,luaopus_decoder_mt);
+    if(lua_isboolean(L,idx + 1)) {
+        decode_fec = lua_toboolean(L,idx + 1);
+    }
+    if(!lua_isnoneornil(L,idx + 2)) {
+        frame_size = luaL_checkinteger(L,idx + 2);
+        if(frame_size <= 0 || frame_size > LUAOPUS_SINK_FRAME_SIZE) {
+            lua_pushnil(L);
+            lua_pushinteger(L,OPUS_BAD_ARG);
+            lua_pushinteger(L,0);
+            return 3;
+        }
+    }
+
+    s->batch = NULL;
+    s->used = 0;
+    s->written = 0;
+    s->pending = 0;
+    if(lua_type(L,idx) == LUA_TTABLE) {
+        count = (int)lua_rawlen(L,idx);
+        /* stdio already buffers */
+        if(count > 1 && s->f == NULL) {
+            s->batch = (unsigned char *)lua_newuserdata(L,LUAOPUS_SINK_BATCH);
+        }
+    } else if(!lua_isnil(L,idx)) {
+        luaL_checktype(L,idx,LUA_TSTRING);
+    }
+
+    for(i=1;i<=count;i++) {
+        if(lua_type(L,idx) == LUA_TTABLE) {
+            lua_rawgeti(L,idx,i);
+            data = (const unsigned char *)lua_tolstring(L,-1,&len);
+            lua_pop(L,1);
+            if(data == NULL) {
+                samples = OPUS_BAD_ARG;
+                goto fail;
+            }
+        } else {
+            data = (const unsigned char *)lua_tolstring(L,idx,&len);
+        }
+        if(len == 0) data = NULL;
+
+        samples = luaopus_decoder_packet(u,data,(opus_int32)len,
+          (int)frame_size,decode_fec,is_float);
+        if(samples < 0) goto fail;
+        if(samples == 0) continue;
+
+        if(luaopus_sink_frame(s,u,samples,is_float) != 0) goto failio;
+    }
+
+    if(luaopus_sink_flush(s) != 0) goto failio;
+
+    lua_pushinteger(L,s->written);
+    return 1;
+
+    fail:
+    if(luaopus_sink_flush(s) == 0) {
+        /* everything before the bad packet made it out */
+        lua_pushnil(L);
+        lua_pushinteger(L,samples);
+        lua_pushinteger(L,s->written);
+        return 3;
+    }
+
+    failio:
+    lua_pushnil(L);
+    lua_pushinteger(L,OPUS_INTERNAL_ERROR);
+    lua_pushinteger(L,s->written);
+    lua_pushstring(L,strerror(errno));
+    return 4;
+}
+
+LUAOPUS_PRIVATE
+int luaopus_decode_to_file(lua_State *L) {
+    luaopus_sink s;
+
+    s.f = luaopus_checkfile(L,2);
+    s.fd = -1;
+    return luaopus_sink_decode(L,&s,3,0);
+}
+
+LUAOPUS_PRIVATE
+int luaopus_decode_float_to_file(lua_State *L) {
+    luaopus_sink s;
+
+    s.f = luaopus_checkfile(L,2);
+    s.fd = -1;
+    return luaopus_sink_decode(L,&s,3,1);
+}
+
+LUAOPUS_PRIVATE
+int luaopus_decode_to_fd(lua_State *L) {
+    luaopus_sink s;
+
+    s.f = NULL;
+    s.fd = (int)luaL_checkinteger(L,2);
+    return luaopus_sink_decode(L,&s,3,0);
+}
+
+LUAOPUS_PRIVATE
+int luaopus_decode_float_to_fd(lua_State *L) {
+    luaopus_sink s;
+
+    s.f = NULL;
+    s.fd = (int)luaL_checkinteger(L,2);
+    return luaopus_sink_decode(L,&s,3,1);
+}
@@ -0,0 +1,185 @@
+#include "luaopus_internal.h"
+#include <opus/opus.h>
+#include <string.h>
+
+/* an image is this header, then the object's struct, then the
+ * codec state. libopus states don't point into themselves, but
+ * they do point at tables inside libopus, so an image is only
+ * good in the process (and library load) that made it. the
+ * anchor's address is what we check that with */
+static const char luaopus_transfer_anchor = 0;
+
+#define LUAOPUS_TRANSFER_ENCODER "LOE1"
+#define LUAOPUS_TRANSFER_DECODER "LOD1"
+
+typedef struct luaopus_transfer_header_s {
+    char magic[4];
+    opus_uint32 state_size;
+    const void *anchor;
+} luaopus_transfer_header;
+
+/* returns a pointer to the object in the image, or NULL with
+ * err set if the image isn't one of ours */
+static const unsigned char *
+luaopus_transfer_check(const unsigned char *data, size_t len, const char *magic, size_t object_size, size_t max_state, size_t *state_size, int *err) {
+    luaopus_transfer_header h;
+
+    *err = OPUS_BAD_ARG;
+    if(len < sizeof(h) + object_size) {
+        return NULL;
+    }
+    memcpy(&h,data,sizeof(h));
+
+    if(memcmp(h.magic,magic,4) != 0) {
+        return NULL;
+    }
+    if(h.state_size > max_state || len != sizeof(h) + object_size + h.state_size) {
+        return NULL;
+    }
+    if(h.anchor != (const void *)&luaopus_transfer_anchor) {
+        *err = OPUS_INVALID_STATE;
+        return NULL;
+    }
+
+    *state_size = h.state_size;
+    *err = OPUS_OK;
+    return data + sizeof(h);
+}
+
+static void
+luaopus_transfer_push(lua_State *L, const char *magic, const void *object, size_t object_size, const void *state, size_t state_size) {
+    luaL_Buffer b;
+    luaopus_transfer_header h;
+
+    memcpy(h.magic,magic,4);
+    h.state_size = (opus_uint32)state_size;
+    h.anchor = (const void *)&luaopus_transfer_anchor;
+
+    luaL_buffinit(L,&b);
+    luaL_addlstring(&b,(const char *)&h,sizeof(h));
+    luaL_addlstring(&b,(const char *)object,object_size);
+    luaL_addlstring(&b,(const char *)state,state_size);
+    luaL_pushresult(&b);
+}
+
+/* a state with a DNN blob loaded points into a string
+ * owned by this lua_State, so it can't be copied out */
+static int
+luaopus_transfer_has_blob(lua_State *L, int idx) {
+    int r = 0;
+
+    lua_getuservalue(L,idx);
+    lua_getfield(L,-1,"dnn_blob");
+    r = !lua_isnil(L,-1);
+    lua_pop(L,2);
+    return r;
+}
+
+LUAOPUS_PRIVATE
+int luaopus_encoder_serialize(lua_State *L) {
+    luaopus_encoder *u = NULL;
+
+    u = luaL_checkudata(L,1,luaopus_encoder_mt);
+    if(u->Fs == 0 || luaopus_transfer_has_blob(L,1)) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_INVALID_STATE);
+        return 2;
+    }
+
+    luaopus_transfer_push(L,LUAOPUS_TRANSFER_ENCODER,
+      u,sizeof(luaopus_encoder),
+      u->encoder,(size_t)opus_encoder_get_size(u->channels));
+    return 1;
+}
+
+LUAOPUS_PRIVATE
+int luaopus_encoder_restore(lua_State *L) {
+    luaopus_encoder *u = NULL;
+    luaopus_encoder saved;
+    const unsigned char *data = NULL;
+    const unsigned char *image = NULL;
+    size_t len = 0;
+    size_t state_size = 0;
+    int err = 0;
+
+    u = luaL_checkudata(L,1,luaopus_encoder_mt);
+    data = (const unsigned char *)luaL_checklstring(L,2,&len);
+
+    image = luaopus_transfer_check(data,len,LUAOPUS_TRANSFER_ENCODER,
+      sizeof(luaopus_encoder),(size_t)opus_encoder_get_size(2),&state_size,&err);
+    if(image == NULL) {
+        lua_pushnil(L);
+        lua_pushinteger(L,err);
+        return 2;
+    }
+
+    /* the meter belongs to the old lua_State, everything
+     * else in the struct is plain data */
+    luaopus_encoder_clear(L,1,u);
+    memcpy(&saved,u,sizeof(luaopus_encoder));
+    memcpy(u,image,sizeof(luaopus_encoder));
+    u->mem = saved.mem;
+    u->encoder = saved.encoder;
+    u->buffer = saved.buffer;
+    u->pcm_float = saved.pcm_float;
+    u->pcm_int16 = saved.pcm_int16;
+    u->meter = NULL;
+
+    memcpy(u->encoder,image + sizeof(luaopus_encoder),state_size);
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+LUAOPUS_PRIVATE
+int luaopus_decoder_serialize(lua_State *L) {
+    luaopus_decoder *u = NULL;
+
+    u = luaL_checkudata(L,1,luaopus_decoder_mt);
+    if(u->Fs == 0 || luaopus_transfer_has_blob(L,1)) {
+        lua_pushnil(L);
+        lua_pushinteger(L,OPUS_INVALID_STATE);
+        return 2;
+    }
+
+    luaopus_transfer_push(L,LUAOPUS_TRANSFER_DECODER,
+      u,sizeof(luaopus_decoder),
+      u->decoder,(size_t)opus_decoder_get_size(u->channels));
+    return 1;
+}
+
+LUAOPUS_PRIVATE
+int luaopus_decoder_restore(lua_State *L) {
+    luaopus_decoder *u = NULL;
+    luaopus_decoder saved;
+    const unsigned char *data = NULL;
+    const unsigned char *image = NULL;
+    size_t len = 0;
+    size_t state_size = 0;
+    int err = 0;
+
+    u = luaL_checkudata(L,1,luaopus_decoder_mt);
+    data = (const unsigned char *)luaL_checklstring(L,2,&len);
+
+    image = luaopus_transfer_check(data,len,LUAOPUS_TRANSFER_DECODER,
+      sizeof(luaopus_decoder),(size_t)opus_decoder_get_size(2),&state_size,&err);
+    if(image == NULL) {
+        lua_pushnil(L);
+        lua_pushinteger(L,err);
+        return 2;
+    }
+
+    luaopus_decoder_clear(L,1,u);
+    memcpy(&saved,u,sizeof(luaopus_decoder));
+    memcpy(u,image,sizeof(luaopus_decoder));
+    u->mem = saved.mem;
+    u->decoder = saved.decoder;
+    u->pcm_float = saved.pcm_float;
+    u->pcm_int16 = saved.pcm_int16;
+    u->meter = NULL;
+
+    memcpy(u->decoder,image + sizeof(luaopus_decoder),state_size);
+
+    lua_pushboolean(L,1);
+    return 1;
+}
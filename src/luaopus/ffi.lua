@@ -0,0 +1,74 @@
+-- LuaJIT FFI fast path for encoding and decoding,
+-- calls straight into luaopus with pointers to FFI arrays
+
+local ffi = require'ffi'
+local opus = require'luaopus'
+
+-- keep in sync with LUAOPUS_FFI_ABI in csrc/luaopus.h
+local ABI = 1
+
+ffi.cdef[[
+int luaopus_ffi_abi(void);
+int32_t luaopus_ffi_encode(void *encoder, const int16_t *pcm, int frame_size, uint8_t *data, int32_t max_data_bytes);
+int32_t luaopus_ffi_encode_float(void *encoder, const float *pcm, int frame_size, uint8_t *data, int32_t max_data_bytes);
+int luaopus_ffi_decode(void *decoder, const uint8_t *data, int32_t len, int16_t *pcm, int frame_size, int decode_fec);
+int luaopus_ffi_decode_float(void *decoder, const uint8_t *data, int32_t len, float *pcm, int frame_size, int decode_fec);
+int luaopus_ffi_encoder_channels(void *encoder);
+int luaopus_ffi_decoder_channels(void *decoder);
+]]
+
+local function load_library()
+  -- linked into the host program
+  if pcall(function() return ffi.C.luaopus_ffi_abi end) then
+    return ffi.C
+  end
+
+  -- the module require already loaded, opening it
+  -- again gives us the same copy
+  local path = package.searchpath('luaopus', package.cpath)
+  if not path then
+    error('luaopus.ffi: unable to find the luaopus library')
+  end
+  return ffi.load(path)
+end
+
+local C = load_library()
+
+if C.luaopus_ffi_abi() ~= ABI then
+  error(string.format('luaopus.ffi: library has ABI %d, expected %d',
+    C.luaopus_ffi_abi(), ABI))
+end
+
+local registry = debug.getregistry()
+
+-- checks the object once, up front, so the calls
+-- themselves don't have to
+local function handle(obj, metaname)
+  if getmetatable(obj) ~= registry[metaname] then
+    error(string.format('bad argument #1 (%s expected, got %s)',
+      metaname, type(obj)), 3)
+  end
+  return ffi.cast('void *', obj)
+end
+
+return {
+  _ABI = ABI,
+  _VERSION = opus._VERSION,
+
+  -- the handle doesn't keep the object alive, hang on
+  -- to the encoder/decoder for as long as you use it
+  encoder = function(encoder)
+    return handle(encoder, 'OpusEncoder')
+  end,
+
+  decoder = function(decoder)
+    return handle(decoder, 'OpusDecoder')
+  end,
+
+  encode = C.luaopus_ffi_encode,
+  encode_float = C.luaopus_ffi_encode_float,
+  decode = C.luaopus_ffi_decode,
+  decode_float = C.luaopus_ffi_decode_float,
+  encoder_channels = C.luaopus_ffi_encoder_channels,
+  decoder_channels = C.luaopus_ffi_decoder_channels,
+}
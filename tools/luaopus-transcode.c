@@ -0,0 +1,1129 @@
+/* luaopus-transcode - encodes WAV (or raw PCM) files to Ogg Opus,
+ * or decodes Ogg Opus files to WAV, several files at once.
+ *
+ * each worker thread gets its own lua_State with luaopus loaded,
+ * and does the actual coding through the module's OpusPcmReader,
+ * OpusEncoder and OpusDecoder objects. Ogg pages are written and
+ * parsed here, since the module doesn't deal with containers */
+
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "luaopus.h"
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include <opus/opus.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM == 501
+#define lua_rawlen lua_objlen
+#endif
+
+#define TRANSCODE_ENCODE 0
+#define TRANSCODE_DECODE 1
+
+/* the most worker threads we'll start */
+#define TRANSCODE_MAX_THREADS 64
+
+/* pages are flushed once they hold this much audio (48kHz samples) */
+#define TRANSCODE_PAGE_DURATION 48000
+
+#define TRANSCODE_VENDOR "luaopus-transcode"
+
+typedef struct transcode_options_s {
+    int mode;
+    int threads;
+    const char *outdir;
+    int bitrate;
+    int complexity;
+    int frame_ms;
+    int application;
+    int quiet;
+} transcode_options;
+
+typedef struct transcode_job_s {
+    const char *input;
+    char output[4096];
+
+    /* filled in by the worker */
+    int ok;
+    char error[4096 + 256];
+    double seconds;   /* wall time spent on the file */
+    double audio;     /* seconds of audio */
+    double bytes;     /* bytes of input */
+} transcode_job;
+
+typedef struct transcode_queue_s {
+    const transcode_options *opt;
+    transcode_job *jobs;
+    int njobs;
+    int next;
+#ifndef _WIN32
+    pthread_mutex_t lock;
+#endif
+} transcode_queue;
+
+typedef struct ogg_writer_s {
+    FILE *f;
+    opus_uint32 serial;
+    opus_uint32 sequence;
+    int bos;
+    unsigned char lacing[255];
+    int segments;
+    unsigned char *body;
+    size_t body_len;
+    size_t body_size;
+    opus_int64 granule;
+    opus_int64 page_start;
+} ogg_writer;
+
+typedef struct ogg_page_s {
+    int flags;
+    opus_int64 granule;
+    opus_uint32 serial;
+    const unsigned char *lacing;
+    int segments;
+    const unsigned char *body;
+} ogg_page;
+
+static opus_uint32 ogg_crc_table[256];
+
+static void
+ogg_crc_init(void) {
+    opus_uint32 r = 0;
+    int i = 0;
+    int j = 0;
+
+    for(i=0;i<256;i++) {
+        r = (opus_uint32)i << 24;
+        for(j=0;j<8;j++) {
+            r = (r & 0x80000000U) ? (r << 1) ^ 0x04c11db7U : (r << 1);
+        }
+        ogg_crc_table[i] = r & 0xffffffffU;
+    }
+}
+
+static opus_uint32
+ogg_crc(opus_uint32 crc, const unsigned char *data, size_t len) {
+    size_t i = 0;
+
+    for(i=0;i<len;i++) {
+        crc = ((crc << 8) ^ ogg_crc_table[((crc >> 24) & 0xff) ^ data[i]]) & 0xffffffffU;
+    }
+    return crc;
+}
+
+static void
+pack_u16le(unsigned char *p, opus_uint32 v) {
+    p[0] = (unsigned char)(v & 0xff);
+    p[1] = (unsigned char)((v >> 8) & 0xff);
+}
+
+static void
+pack_u32le(unsigned char *p, opus_uint32 v) {
+    pack_u16le(p,v & 0xffff);
+    pack_u16le(p + 2,(v >> 16) & 0xffff);
+}
+
+static void
+pack_u64le(unsigned char *p, opus_int64 v) {
+    pack_u32le(p,(opus_uint32)((opus_uint64)v & 0xffffffffU));
+    pack_u32le(p + 4,(opus_uint32)((opus_uint64)v >> 32));
+}
+
+static opus_uint32
+unpack_u32le(const unsigned char *p) {
+    return (opus_uint32)p[0] | ((opus_uint32)p[1] << 8)
+      | ((opus_uint32)p[2] << 16) | ((opus_uint32)p[3] << 24);
+}
+
+static opus_int64
+unpack_u64le(const unsigned char *p) {
+    return (opus_int64)((opus_uint64)unpack_u32le(p)
+      | ((opus_uint64)unpack_u32le(p + 4) << 32));
+}
+
+static double
+transcode_now(void) {
+#ifdef _WIN32
+    LARGE_INTEGER f;
+    LARGE_INTEGER c;
+
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&c);
+    return (double)c.QuadPart / (double)f.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+static int
+ogg_writer_page(ogg_writer *w, int eos) {
+    unsigned char header[27 + 255];
+    size_t header_len = 0;
+    opus_uint32 crc = 0;
+
+    memcpy(header,"OggS",4);
+    header[4] = 0;
+    header[5] = (unsigned char)((w->bos ? 0x02 : 0) | (eos ? 0x04 : 0));
+    pack_u64le(header + 6,w->granule);
+    pack_u32le(header + 14,w->serial);
+    pack_u32le(header + 18,w->sequence);
+    pack_u32le(header + 22,0);
+    header[26] = (unsigned char)w->segments;
+    memcpy(header + 27,w->lacing,(size_t)w->segments);
+    header_len = 27 + (size_t)w->segments;
+
+    crc = ogg_crc(0,header,header_len);
+    crc = ogg_crc(crc,w->body,w->body_len);
+    pack_u32le(header + 22,crc);
+
+    if(fwrite(header,1,header_len,w->f) != header_len) return -1;
+    if(fwrite(w->body,1,w->body_len,w->f) != w->body_len) return -1;
+
+    w->sequence++;
+    w->bos = 0;
+    w->segments = 0;
+    w->body_len = 0;
+    w->page_start = w->granule;
+    return 0;
+}
+
+/* adds a packet ending at granule, flushing the current page
+ * first if the packet won't fit or the page is long enough */
+static int
+ogg_writer_packet(ogg_writer *w, const unsigned char *data, size_t len, opus_int64 granule) {
+    int segments = 0;
+    unsigned char *body = NULL;
+
+    segments = (int)(len / 255) + 1;
+    if(segments > 255) return -1;
+
+    if(w->segments > 0 &&
+      (w->segments + segments > 255 || w->granule - w->page_start >= TRANSCODE_PAGE_DURATION)) {
+        if(ogg_writer_page(w,0) != 0) return -1;
+    }
+
+    if(w->body_len + len > w->body_size) {
+        body = (unsigned char *)realloc(w->body,w->body_len + len);
+        if(body == NULL) return -1;
+        w->body = body;
+        w->body_size = w->body_len + len;
+    }
+    memcpy(w->body + w->body_len,data,len);
+    w->body_len += len;
+
+    while(segments-- > 1) {
+        w->lacing[w->segments++] = 255;
+    }
+    w->lacing[w->segments++] = (unsigned char)(len % 255);
+    w->granule = granule;
+    return 0;
+}
+
+/* returns the length of the page at data, 0 if it's truncated,
+ * or -1 if it isn't a valid page */
+static long
+ogg_page_parse(const unsigned char *data, size_t len, ogg_page *page) {
+    size_t header_len = 0;
+    size_t body_len = 0;
+    opus_uint32 crc = 0;
+    unsigned char zero[4] = { 0, 0, 0, 0 };
+    int i = 0;
+
+    if(len < 27) return 0;
+    if(memcmp(data,"OggS",4) != 0 || data[4] != 0) return -1;
+
+    page->segments = data[26];
+    header_len = 27 + (size_t)page->segments;
+    if(len < header_len) return 0;
+
+    for(i=0;i<page->segments;i++) {
+        body_len += data[27 + i];
+    }
+    if(len < header_len + body_len) return 0;
+
+    crc = ogg_crc(0,data,22);
+    crc = ogg_crc(crc,zero,4);
+    crc = ogg_crc(crc,data + 26,header_len - 26 + body_len);
+    if(crc != unpack_u32le(data + 22)) return -1;
+
+    page->flags = data[5];
+    page->granule = unpack_u64le(data + 6);
+    page->serial = unpack_u32le(data + 14);
+    page->lacing = data + 27;
+    page->body = data + header_len;
+    return (long)(header_len + body_len);
+}
+
+/* calls the method on the object at obj (an absolute index) with
+ * the nargs values on top of the stack */
+static int
+transcode_method(lua_State *L, int obj, const char *name, int nargs, int nresults) {
+    lua_getfield(L,obj,name);
+    lua_insert(L,-(nargs + 1));
+    lua_pushvalue(L,obj);
+    lua_insert(L,-(nargs + 1));
+    return lua_pcall(L,nargs + 1,nresults,0);
+}
+
+/* sets the job's error from a nil, err, ... return (or a raised
+ * error when nresults is 0) on top of the stack. if the last
+ * value is a string it's added on as the detail */
+static int
+transcode_fail(lua_State *L, transcode_job *job, const char *what, int nresults) {
+    const char *msg = NULL;
+    int err = 0;
+
+    if(nresults == 0) {
+        msg = lua_tostring(L,-1);
+        snprintf(job->error,sizeof(job->error),"%s: %s",what,msg ? msg : "error");
+        return -1;
+    }
+
+    err = (int)lua_tointeger(L,-nresults + 1);
+    if(nresults > 2 && lua_type(L,-1) == LUA_TSTRING) {
+        msg = lua_tostring(L,-1);
+    }
+    if(msg != NULL) {
+        snprintf(job->error,sizeof(job->error),"%s: %s (%s)",what,opus_strerror(err),msg);
+    } else {
+        snprintf(job->error,sizeof(job->error),"%s: %s",what,opus_strerror(err));
+    }
+    return -1;
+}
+
+/* calls a method like transcode_method. sets the job's error and
+ * returns -1 if it raised an error, or if it has more than one
+ * result and returned nil, err, ... */
+static int
+transcode_check(lua_State *L, transcode_job *job, const char *what, int obj, const char *name, int nargs, int nresults) {
+    if(transcode_method(L,obj,name,nargs,nresults) != 0) {
+        return transcode_fail(L,job,what,0);
+    }
+    if(nresults > 1 && lua_isnil(L,-nresults)) {
+        return transcode_fail(L,job,what,nresults);
+    }
+    return 0;
+}
+
+/* the same, for calling one of the module's functions (its
+ * table is at index 1), so a constructor running out of
+ * memory fails the job rather than the whole thread */
+static int
+transcode_new(lua_State *L, transcode_job *job, const char *what, const char *name, int nargs, int nresults) {
+    lua_getfield(L,1,name);
+    lua_insert(L,-(nargs + 1));
+    if(lua_pcall(L,nargs,nresults,0) != 0) {
+        return transcode_fail(L,job,what,0);
+    }
+    if(nresults > 1 && lua_isnil(L,-nresults)) {
+        return transcode_fail(L,job,what,nresults);
+    }
+    return 0;
+}
+
+static double
+transcode_filesize(const char *path) {
+    FILE *f = NULL;
+    long len = 0;
+
+    f = fopen(path,"rb");
+    if(f == NULL) return 0;
+    if(fseek(f,0,SEEK_END) == 0) len = ftell(f);
+    fclose(f);
+    return len > 0 ? (double)len : 0;
+}
+
+static int
+transcode_encode(lua_State *L, const transcode_options *opt, transcode_job *job) {
+    ogg_writer w;
+    unsigned char head[19];
+    unsigned char tags[8 + 4 + sizeof(TRANSCODE_VENDOR) - 1 + 4];
+    const char *packet = NULL;
+    size_t packet_len = 0;
+    opus_int64 encoded = 0;
+    opus_int64 samples = 0;
+    lua_Integer got = 0;
+    int rate = 0;
+    int channels = 0;
+    int frame_size = 0;
+    int frame_48k = 0;
+    int pre_skip = 0;
+    int reader = 0;
+    int encoder = 0;
+    int silence = 0;
+    int r = -1;
+    int i = 0;
+
+    memset(&w,0,sizeof(w));
+
+    lua_pushstring(L,job->input);
+    if(transcode_new(L,job,"open","OpusPcmReader",1,3) != 0) {
+        return -1;
+    }
+    lua_pop(L,2);
+    reader = lua_gettop(L);
+
+    if(transcode_method(L,reader,"info",0,1) != 0) {
+        return transcode_fail(L,job,"info",0);
+    }
+    lua_getfield(L,-1,"rate");
+    rate = (int)lua_tointeger(L,-1);
+    lua_getfield(L,-2,"channels");
+    channels = (int)lua_tointeger(L,-1);
+    lua_pop(L,3);
+
+    if(rate != 8000 && rate != 12000 && rate != 16000 && rate != 24000 && rate != 48000) {
+        snprintf(job->error,sizeof(job->error),"unsupported sample rate %d",rate);
+        goto done;
+    }
+    if(channels < 1 || channels > 2) {
+        snprintf(job->error,sizeof(job->error),"unsupported channel count %d",channels);
+        goto done;
+    }
+    frame_size = rate * opt->frame_ms / 1000;
+    frame_48k = 48000 * opt->frame_ms / 1000;
+
+    if(transcode_new(L,job,"init","OpusEncoder",0,1) != 0) {
+        goto done;
+    }
+    encoder = lua_gettop(L);
+
+    lua_pushinteger(L,rate);
+    lua_pushinteger(L,channels);
+    lua_pushinteger(L,opt->application);
+    if(transcode_check(L,job,"init",encoder,"init",3,2) != 0) {
+        goto done;
+    }
+    lua_pop(L,2);
+
+    lua_newtable(L);
+    if(opt->bitrate > 0) {
+        lua_pushinteger(L,opt->bitrate);
+        lua_setfield(L,-2,"bitrate");
+    }
+    lua_pushinteger(L,opt->complexity);
+    lua_setfield(L,-2,"complexity");
+    if(transcode_check(L,job,"configure",encoder,"configure",1,3) != 0) {
+        goto done;
+    }
+    lua_pop(L,3);
+
+    if(transcode_method(L,encoder,"get_lookahead",0,1) != 0) {
+        transcode_fail(L,job,"get_lookahead",0);
+        goto done;
+    }
+    pre_skip = (int)lua_tointeger(L,-1) * (48000 / rate);
+    lua_pop(L,1);
+
+    w.f = fopen(job->output,"wb");
+    if(w.f == NULL) {
+        snprintf(job->error,sizeof(job->error),"%s: %s",job->output,strerror(errno));
+        goto done;
+    }
+    w.serial = (opus_uint32)rand();
+    w.bos = 1;
+
+    memcpy(head,"OpusHead",8);
+    head[8] = 1;
+    head[9] = (unsigned char)channels;
+    pack_u16le(head + 10,(opus_uint32)pre_skip);
+    pack_u32le(head + 12,(opus_uint32)rate);
+    pack_u16le(head + 16,0);
+    head[18] = 0;
+
+    memcpy(tags,"OpusTags",8);
+    pack_u32le(tags + 8,sizeof(TRANSCODE_VENDOR) - 1);
+    memcpy(tags + 12,TRANSCODE_VENDOR,sizeof(TRANSCODE_VENDOR) - 1);
+    pack_u32le(tags + 12 + sizeof(TRANSCODE_VENDOR) - 1,0);
+
+    if(ogg_writer_packet(&w,head,sizeof(head),0) != 0 || ogg_writer_page(&w,0) != 0 ||
+       ogg_writer_packet(&w,tags,sizeof(tags),0) != 0 || ogg_writer_page(&w,0) != 0) {
+        goto failio;
+    }
+
+    for(;;) {
+        lua_pushvalue(L,encoder);
+        lua_pushinteger(L,frame_size);
+        if(transcode_method(L,reader,"next_packet",2,2) != 0) {
+            transcode_fail(L,job,"encode",0);
+            goto done;
+        }
+        if(lua_isnil(L,-2)) {
+            if(!lua_isnil(L,-1)) {
+                transcode_fail(L,job,"encode",2);
+                goto done;
+            }
+            lua_pop(L,2);
+            break;
+        }
+        packet = lua_tolstring(L,-2,&packet_len);
+        got = lua_tointeger(L,-1);
+
+        samples += got * (48000 / rate);
+        encoded += frame_48k;
+        if(ogg_writer_packet(&w,(const unsigned char *)packet,packet_len,
+          encoded < pre_skip + samples ? encoded : pre_skip + samples) != 0) {
+            lua_pop(L,2);
+            goto failio;
+        }
+        lua_pop(L,2);
+    }
+
+    /* the encoder's lookahead is still holding the last few
+     * milliseconds, push silence through until it's out */
+    while(encoded < samples + pre_skip) {
+        if(silence == 0) {
+            lua_createtable(L,frame_size * channels,0);
+            for(i=1;i<=frame_size * channels;i++) {
+                lua_pushinteger(L,0);
+                lua_rawseti(L,-2,i);
+            }
+            silence = lua_gettop(L);
+        }
+        lua_pushvalue(L,silence);
+        lua_pushinteger(L,frame_size);
+        if(transcode_check(L,job,"encode",encoder,"encode",2,2) != 0) {
+            goto done;
+        }
+        packet = lua_tolstring(L,-2,&packet_len);
+        encoded += frame_48k;
+        if(ogg_writer_packet(&w,(const unsigned char *)packet,packet_len,
+          encoded < pre_skip + samples ? encoded : pre_skip + samples) != 0) {
+            lua_pop(L,2);
+            goto failio;
+        }
+        lua_pop(L,2);
+    }
+
+    if(ogg_writer_page(&w,1) != 0) goto failio;
+
+    job->audio = (double)samples / 48000.0;
+    job->bytes = transcode_filesize(job->input);
+    r = 0;
+    goto done;
+
+    failio:
+    snprintf(job->error,sizeof(job->error),"%s: %s",job->output,strerror(errno));
+
+    done:
+    if(w.f != NULL && fclose(w.f) != 0 && r == 0) {
+        snprintf(job->error,sizeof(job->error),"%s: %s",job->output,strerror(errno));
+        r = -1;
+    }
+    free(w.body);
+    if(transcode_method(L,reader,"close",0,0) != 0) lua_pop(L,1);
+    return r;
+}
+
+/* reads the whole file into memory */
+static unsigned char *
+transcode_slurp(const char *path, size_t *len) {
+    FILE *f = NULL;
+    unsigned char *data = NULL;
+    unsigned char *tmp = NULL;
+    size_t size = 0;
+    size_t r = 0;
+
+    f = fopen(path,"rb");
+    if(f == NULL) return NULL;
+
+    *len = 0;
+    size = 65536;
+    data = (unsigned char *)malloc(size);
+    while(data != NULL) {
+        r = fread(data + *len,1,size - *len,f);
+        *len += r;
+        if(*len < size) break;
+        size *= 2;
+        tmp = (unsigned char *)realloc(data,size);
+        if(tmp == NULL) {
+            free(data);
+            data = NULL;
+        }
+        data = tmp;
+    }
+    if(data != NULL && ferror(f)) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+/* writes a 16-bit PCM WAV header, called again at the end with the sizes */
+static int
+transcode_wav_header(lua_State *L, int fh, int channels, opus_int64 frames) {
+    unsigned char h[44];
+    opus_uint32 data_len = 0;
+
+    data_len = (opus_uint32)(frames * channels * 2);
+    memcpy(h,"RIFF",4);
+    pack_u32le(h + 4,36 + data_len);
+    memcpy(h + 8,"WAVEfmt ",8);
+    pack_u32le(h + 16,16);
+    pack_u16le(h + 20,1);
+    pack_u16le(h + 22,(opus_uint32)channels);
+    pack_u32le(h + 24,48000);
+    pack_u32le(h + 28,48000 * channels * 2);
+    pack_u16le(h + 32,(opus_uint32)channels * 2);
+    pack_u16le(h + 34,16);
+    memcpy(h + 36,"data",4);
+    pack_u32le(h + 40,data_len);
+
+    lua_pushlstring(L,(const char *)h,sizeof(h));
+    if(transcode_method(L,fh,"write",1,2) != 0) return -1;
+    if(lua_isnil(L,-2)) {
+        lua_remove(L,-2);
+        return -1;
+    }
+    lua_pop(L,2);
+    return 0;
+}
+
+/* adds len bytes to a growing buffer, returns 0 if out of memory */
+static int
+transcode_append(unsigned char **buf, size_t *buf_len, size_t *buf_cap, const unsigned char *data, size_t len) {
+    unsigned char *tmp = NULL;
+    size_t cap = 0;
+
+    if(*buf_len + len > *buf_cap) {
+        cap = *buf_cap ? *buf_cap : 4096;
+        while(cap < *buf_len + len) cap *= 2;
+        tmp = (unsigned char *)realloc(*buf,cap);
+        if(tmp == NULL) return 0;
+        *buf = tmp;
+        *buf_cap = cap;
+    }
+    memcpy(*buf + *buf_len,data,len);
+    *buf_len += len;
+    return 1;
+}
+
+static int
+transcode_decode(lua_State *L, const transcode_options *opt, transcode_job *job) {
+    unsigned char *data = NULL;
+    size_t len = 0;
+    size_t pos = 0;
+    long page_len = 0;
+    ogg_page page;
+    opus_uint32 serial = 0;
+    opus_int64 last_granule = -1;
+    opus_int64 frames = 0;
+    const unsigned char *packet = NULL;
+    size_t packet_len = 0;
+    const unsigned char *p = NULL;
+    size_t p_len = 0;
+    unsigned char *join = NULL;
+    size_t join_len = 0;
+    size_t join_cap = 0;
+    int joining = 0;
+    int skip = 0;
+    int packets = 0;
+    int headers = 0;
+    int channels = 0;
+    int pre_skip = 0;
+    int gain = 0;
+    int decoder = 0;
+    int fh = 0;
+    int batch = 0;
+    int r = -1;
+    int i = 0;
+
+    (void)opt;
+
+    data = transcode_slurp(job->input,&len);
+    if(data == NULL) {
+        snprintf(job->error,sizeof(job->error),"%s: %s",job->input,strerror(errno));
+        return -1;
+    }
+    job->bytes = (double)len;
+
+    /* the first logical stream is the one we decode, its
+     * last granule position gives the length for end trimming */
+    for(pos=0;pos < len;pos += (size_t)page_len) {
+        page_len = ogg_page_parse(data + pos,len - pos,&page);
+        if(page_len <= 0) break;
+        if(pos == 0) serial = page.serial;
+        if(page.serial == serial && page.granule != -1) last_granule = page.granule;
+    }
+    if(len == 0 || page_len < 0 || last_granule < 0) {
+        snprintf(job->error,sizeof(job->error),"not an Ogg file, or corrupt");
+        goto done;
+    }
+
+    if(transcode_new(L,job,"init","OpusDecoder",0,1) != 0) {
+        goto done;
+    }
+    decoder = lua_gettop(L);
+
+    for(pos=0;pos < len;pos += (size_t)page_len) {
+        page_len = ogg_page_parse(data + pos,len - pos,&page);
+        if(page_len <= 0) break;
+        if(page.serial != serial) continue;
+
+        packet = page.body;
+        packet_len = 0;
+        packets = 0;
+        if(batch == 0 && headers == 2) {
+            lua_newtable(L);
+            batch = lua_gettop(L);
+        }
+
+        /* packets can be split across pages, the rest of one is
+         * at the start of the next page, which is flagged as
+         * continuing it. without the start it can't be used */
+        skip = 0;
+        if(page.flags & 1) {
+            skip = !joining;
+        } else {
+            joining = 0;
+            join_len = 0;
+        }
+
+        for(i=0;i<page.segments;i++) {
+            packet_len += page.lacing[i];
+            if(page.lacing[i] == 255) continue;
+
+            p = packet;
+            p_len = packet_len;
+            packet += packet_len;
+            packet_len = 0;
+
+            if(skip) {
+                skip = 0;
+                continue;
+            }
+            if(joining) {
+                if(!transcode_append(&join,&join_len,&join_cap,p,p_len)) goto nomem;
+                p = join;
+                p_len = join_len;
+                joining = 0;
+                join_len = 0;
+            }
+
+            if(headers == 0) {
+                if(p_len < 19 || memcmp(p,"OpusHead",8) != 0) {
+                    snprintf(job->error,sizeof(job->error),"not an Ogg Opus file");
+                    goto done;
+                }
+                channels = p[9];
+                pre_skip = p[10] | (p[11] << 8);
+                gain = (opus_int16)(p[16] | (p[17] << 8));
+                if(p[18] != 0 || channels < 1 || channels > 2) {
+                    snprintf(job->error,sizeof(job->error),"unsupported channel mapping");
+                    goto done;
+                }
+            } else if(headers > 1) {
+                lua_pushlstring(L,(const char *)p,p_len);
+                lua_rawseti(L,batch,++packets);
+            }
+            if(headers < 2) headers++;
+        }
+
+        /* the last packet carries on into the next page */
+        if(page.segments > 0 && page.lacing[page.segments - 1] == 255 && !skip) {
+            if(!transcode_append(&join,&join_len,&join_cap,packet,packet_len)) goto nomem;
+            joining = 1;
+        }
+
+        if(headers == 1 && fh == 0) {
+            lua_pushinteger(L,48000);
+            lua_pushinteger(L,channels);
+            if(transcode_check(L,job,"init",decoder,"init",2,2) != 0) {
+                goto done;
+            }
+            lua_pop(L,2);
+
+            lua_pushinteger(L,pre_skip);
+            lua_pushnumber(L,(lua_Number)(last_granule - pre_skip));
+            if(transcode_check(L,job,"set_trim",decoder,"set_trim",2,2) != 0) {
+                goto done;
+            }
+            lua_pop(L,2);
+
+            /* the output gain from OpusHead is in Q7.8 dB, same as OPUS_SET_GAIN */
+            if(gain != 0) {
+                lua_pushinteger(L,gain);
+                if(transcode_check(L,job,"set_gain",decoder,"set_gain",1,2) != 0) {
+                    goto done;
+                }
+                lua_pop(L,2);
+            }
+
+            lua_getglobal(L,"io");
+            lua_getfield(L,-1,"open");
+            lua_pushstring(L,job->output);
+            lua_pushliteral(L,"wb");
+            /* either way the message is on top */
+            if(lua_pcall(L,2,2,0) != 0 || lua_isnil(L,-2)) {
+                snprintf(job->error,sizeof(job->error),"%s",lua_tostring(L,-1));
+                goto done;
+            }
+            lua_pop(L,1);
+            lua_remove(L,-2);
+            fh = lua_gettop(L);
+
+            if(transcode_wav_header(L,fh,channels,0) != 0) goto failio;
+        }
+
+        if(packets > 0) {
+            /* the whole page in one call */
+            while((int)lua_rawlen(L,batch) > packets) {
+                lua_pushnil(L);
+                lua_rawseti(L,batch,(int)lua_rawlen(L,batch));
+            }
+            lua_pushvalue(L,fh);
+            lua_pushvalue(L,batch);
+            if(transcode_method(L,decoder,"decode_to_file",2,4) != 0) {
+                transcode_fail(L,job,"decode",0);
+                goto done;
+            }
+            if(lua_isnil(L,-4)) {
+                transcode_fail(L,job,"decode",4);
+                goto done;
+            }
+            frames += (opus_int64)lua_tonumber(L,-4);
+            lua_pop(L,4);
+        }
+    }
+
+    if(fh == 0 || headers < 2) {
+        snprintf(job->error,sizeof(job->error),"not an Ogg Opus file");
+        goto done;
+    }
+
+    lua_pushliteral(L,"set");
+    lua_pushinteger(L,0);
+    if(transcode_method(L,fh,"seek",2,2) != 0 || lua_isnil(L,-2)) goto failio;
+    lua_pop(L,2);
+    if(transcode_wav_header(L,fh,channels,frames) != 0) goto failio;
+
+    job->audio = (double)frames / 48000.0;
+    r = 0;
+    goto done;
+
+    failio:
+    snprintf(job->error,sizeof(job->error),"%s: %s",job->output,
+      lua_isstring(L,-1) ? lua_tostring(L,-1) : "write error");
+    goto done;
+
+    nomem:
+    snprintf(job->error,sizeof(job->error),"out of memory");
+
+    done:
+    if(fh != 0 && transcode_method(L,fh,"close",0,0) != 0) lua_pop(L,1);
+    free(join);
+    free(data);
+    return r;
+}
+
+static lua_State *
+transcode_state(void) {
+    lua_State *L = NULL;
+
+    L = luaL_newstate();
+    if(L == NULL) return NULL;
+    luaL_openlibs(L);
+
+    /* luaopus copies its version table in from luaopus.version,
+     * which may not be on the path when running from a build tree */
+    lua_getglobal(L,"require");
+    lua_pushliteral(L,"luaopus.version");
+    if(lua_pcall(L,1,0,0) != 0) {
+        lua_pop(L,1);
+        lua_getglobal(L,"package");
+        lua_getfield(L,-1,"loaded");
+        lua_newtable(L);
+        lua_setfield(L,-2,"luaopus.version");
+        lua_pop(L,2);
+    }
+
+    lua_pushcfunction(L,luaopen_luaopus);
+    if(lua_pcall(L,0,1,0) != 0) {
+        fprintf(stderr,"luaopus-transcode: %s\n",lua_tostring(L,-1));
+        lua_close(L);
+        return NULL;
+    }
+    return L;
+}
+
+static void
+transcode_report(const transcode_options *opt, const transcode_job *job) {
+    if(!job->ok) {
+        fprintf(stderr,"%s: %s\n",job->input,job->error);
+        return;
+    }
+    if(opt->quiet) return;
+
+    printf("%s -> %s: %.2fs audio in %.3fs, %.1fx realtime, %.2f MB/s\n",
+      job->input,job->output,job->audio,job->seconds,
+      job->seconds > 0 ? job->audio / job->seconds : 0.0,
+      job->seconds > 0 ? job->bytes / job->seconds / 1e6 : 0.0);
+}
+
+static void
+transcode_run(transcode_queue *q) {
+    transcode_job *job = NULL;
+    lua_State *L = NULL;
+    double start = 0;
+
+    L = transcode_state();
+
+    for(;;) {
+#ifndef _WIN32
+        pthread_mutex_lock(&q->lock);
+#endif
+        job = q->next < q->njobs ? &q->jobs[q->next++] : NULL;
+#ifndef _WIN32
+        pthread_mutex_unlock(&q->lock);
+#endif
+        if(job == NULL) break;
+
+        if(L == NULL) {
+            snprintf(job->error,sizeof(job->error),"unable to create a lua_State");
+        } else {
+            lua_settop(L,1);
+            start = transcode_now();
+            if(q->opt->mode == TRANSCODE_ENCODE) {
+                job->ok = transcode_encode(L,q->opt,job) == 0;
+            } else {
+                job->ok = transcode_decode(L,q->opt,job) == 0;
+            }
+            job->seconds = transcode_now() - start;
+            /* drop this file's objects, the next file's codec
+             * allocations step the collector enough to free them */
+            lua_settop(L,1);
+        }
+
+#ifndef _WIN32
+        pthread_mutex_lock(&q->lock);
+#endif
+        transcode_report(q->opt,job);
+        fflush(stdout);
+#ifndef _WIN32
+        pthread_mutex_unlock(&q->lock);
+#endif
+    }
+
+    if(L != NULL) lua_close(L);
+}
+
+#ifndef _WIN32
+static void *
+transcode_worker(void *ud) {
+    transcode_run((transcode_queue *)ud);
+    return NULL;
+}
+#endif
+
+/* output goes in outdir (or next to the input) with the extension swapped */
+static int
+transcode_output(const transcode_options *opt, transcode_job *job) {
+    const char *base = NULL;
+    const char *dot = NULL;
+    const char *p = NULL;
+    const char *ext = NULL;
+    int dirlen = 0;
+    int baselen = 0;
+    int n = 0;
+
+    base = job->input;
+    for(p=job->input;*p;p++) {
+        if(*p == '/' || *p == '\\') base = p + 1;
+    }
+    dot = strrchr(base,'.');
+    baselen = dot != NULL && dot != base ? (int)(dot - base) : (int)strlen(base);
+    dirlen = (int)(base - job->input);
+    ext = opt->mode == TRANSCODE_ENCODE ? ".opus" : ".wav";
+
+    if(opt->outdir != NULL) {
+        n = snprintf(job->output,sizeof(job->output),"%s/%.*s%s",
+          opt->outdir,baselen,base,ext);
+    } else {
+        n = snprintf(job->output,sizeof(job->output),"%.*s%.*s%s",
+          dirlen,job->input,baselen,base,ext);
+    }
+    return n > 0 && (size_t)n < sizeof(job->output) ? 0 : -1;
+}
+
+static int
+transcode_cpus(void) {
+#if defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#else
+    return 1;
+#endif
+}
+
+static void
+usage(const char *self) {
+    fprintf(stderr,
+      "usage: %s [options] encode|decode file...\n"
+      "\n"
+      "encode takes WAV files and writes Ogg Opus (.opus),\n"
+      "decode takes Ogg Opus files and writes 16-bit 48kHz WAV (.wav)\n"
+      "\n"
+      "options:\n"
+      "  -j threads     files to work on at once (default: number of CPUs)\n"
+      "  -o dir         write output files to dir (default: next to the input)\n"
+      "  -b bitrate     encoder bitrate in bits per second (default: libopus picks)\n"
+      "  -c complexity  encoder complexity, 0-10 (default: 10)\n"
+      "  -f ms          frame duration, 10, 20, 40 or 60 (default: 20)\n"
+      "  -a app         audio, voip or lowdelay (default: audio)\n"
+      "  -q             only report errors and the totals\n",
+      self);
+}
+
+int main(int argc, char *argv[]) {
+    transcode_options opt;
+    transcode_queue q;
+    transcode_job *jobs = NULL;
+    const char *arg = NULL;
+    double start = 0;
+    double seconds = 0;
+    double audio = 0;
+    double bytes = 0;
+    int failed = 0;
+    int njobs = 0;
+    int i = 0;
+#ifndef _WIN32
+    pthread_t workers[TRANSCODE_MAX_THREADS];
+    int nworkers = 0;
+#endif
+
+    memset(&opt,0,sizeof(opt));
+    opt.threads = transcode_cpus();
+    opt.complexity = 10;
+    opt.frame_ms = 20;
+    opt.application = OPUS_APPLICATION_AUDIO;
+
+    for(i=1;i<argc && argv[i][0] == '-' && argv[i][1] != '\0';i++) {
+        if(strcmp(argv[i],"-q") == 0) {
+            opt.quiet = 1;
+            continue;
+        }
+        if(i + 1 >= argc || argv[i][2] != '\0') {
+            usage(argv[0]);
+            return 1;
+        }
+        arg = argv[++i];
+        switch(argv[i - 1][1]) {
+            case 'j': opt.threads = atoi(arg); break;
+            case 'o': opt.outdir = arg; break;
+            case 'b': opt.bitrate = atoi(arg); break;
+            case 'c': opt.complexity = atoi(arg); break;
+            case 'f': opt.frame_ms = atoi(arg); break;
+            case 'a': {
+                if(strcmp(arg,"audio") == 0) opt.application = OPUS_APPLICATION_AUDIO;
+                else if(strcmp(arg,"voip") == 0) opt.application = OPUS_APPLICATION_VOIP;
+                else if(strcmp(arg,"lowdelay") == 0) opt.application = OPUS_APPLICATION_RESTRICTED_LOWDELAY;
+                else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            }
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+    if(i + 1 >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if(strcmp(argv[i],"encode") == 0) {
+        opt.mode = TRANSCODE_ENCODE;
+    } else if(strcmp(argv[i],"decode") == 0) {
+        opt.mode = TRANSCODE_DECODE;
+    } else {
+        usage(argv[0]);
+        return 1;
+    }
+    i++;
+
+    if(opt.frame_ms != 10 && opt.frame_ms != 20 && opt.frame_ms != 40 && opt.frame_ms != 60) {
+        fprintf(stderr,"%s: frame duration must be 10, 20, 40 or 60\n",argv[0]);
+        return 1;
+    }
+    if(opt.threads < 1) opt.threads = 1;
+    if(opt.threads > TRANSCODE_MAX_THREADS) opt.threads = TRANSCODE_MAX_THREADS;
+
+    njobs = argc - i;
+    jobs = (transcode_job *)calloc((size_t)njobs,sizeof(transcode_job));
+    if(jobs == NULL) {
+        fprintf(stderr,"%s: out of memory\n",argv[0]);
+        return 1;
+    }
+    for(njobs=0;i<argc;i++,njobs++) {
+        jobs[njobs].input = argv[i];
+        if(transcode_output(&opt,&jobs[njobs]) != 0) {
+            fprintf(stderr,"%s: path too long\n",argv[i]);
+            free(jobs);
+            return 1;
+        }
+    }
+    if(opt.threads > njobs) opt.threads = njobs;
+
+    ogg_crc_init();
+    srand((unsigned int)time(NULL));
+
+    q.opt = &opt;
+    q.jobs = jobs;
+    q.njobs = njobs;
+    q.next = 0;
+
+    start = transcode_now();
+#ifndef _WIN32
+    pthread_mutex_init(&q.lock,NULL);
+    /* this thread takes files too, so start one fewer */
+    while(nworkers < opt.threads - 1) {
+        if(pthread_create(&workers[nworkers],NULL,transcode_worker,&q) != 0) break;
+        nworkers++;
+    }
+    transcode_run(&q);
+    while(nworkers > 0) {
+        pthread_join(workers[--nworkers],NULL);
+    }
+    pthread_mutex_destroy(&q.lock);
+#else
+    /* no threads on windows yet, files are done one at a time */
+    transcode_run(&q);
+#endif
+    seconds = transcode_now() - start;
+
+    for(i=0;i<njobs;i++) {
+        if(!jobs[i].ok) {
+            failed++;
+            continue;
+        }
+        audio += jobs[i].audio;
+        bytes += jobs[i].bytes;
+    }
+
+    printf("%d file%s, %d failed: %.2fs audio in %.3fs, %.1fx realtime, %.2f MB/s\n",
+      njobs,njobs == 1 ? "" : "s",failed,audio,seconds,
+      seconds > 0 ? audio / seconds : 0.0,
+      seconds > 0 ? bytes / seconds / 1e6 : 0.0);
+
+    free(jobs);
+    return failed ? 1 : 0;
+}